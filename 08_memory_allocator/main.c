@@ -1,43 +1,397 @@
+// For mremap, used to grow large blocks without copying
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <execinfo.h>
 
-#define POOL_SIZE 10240  // 10KB memory pool
-#define MIN_BLOCK_SIZE 16  // Minimum block size
+#define CHUNK_SIZE (1024 * 1024)  // Memory mapped at a time when an arena grows
+#define MMAP_THRESHOLD (128 * 1024)  // Larger requests get a mapping of their own
+#define NUM_ARENAS 4  // Independent heaps, each with its own lock
+#define DIRECT_ARENA 0xFF  // Arena index of directly mapped blocks
+#define MIN_BLOCK_SIZE 16  // Minimum block size (room for the free list links)
+#define SIZE_CLASS_STEP 16  // Request sizes are rounded up to a multiple of this
+#define SMALL_CLASS_LIMIT 512  // Below this, one size class per SIZE_CLASS_STEP bytes
+#define NUM_SIZE_CLASSES 64  // Power-of-two classes above SMALL_CLASS_LIMIT
+#define TCACHE_MAX_SIZE 256  // Largest block kept in the per-thread caches
+#define TCACHE_CLASSES (TCACHE_MAX_SIZE / SIZE_CLASS_STEP + 1)
+#define TCACHE_COUNT 16  // Cached blocks per size class before half go back to the arenas
+#define CACHE_LINE_SIZE 64  // Alignment that keeps data from sharing a cache line
+#define ALIGNED_SEARCH_LIMIT 32  // Free blocks tried per size class for an aligned request
+#define STATS_TIMING_INTERVAL 64  // One allocator call in this many is timed
+#define STATS_PUBLISH_BYTES (64 * 1024)  // Change in live bytes a thread gathers before publishing it
+#define PROFILE_DEFAULT_INTERVAL (512 * 1024)  // Bytes allocated between heap profile samples
+#define PROFILE_MAX_FRAMES 24  // Deepest call stack the heap profiler records
+#define PROFILE_SKIP_FRAMES 1  // Profiler frames left out of the recorded stacks
+#define PROFILE_MAX_STACKS 1024  // Distinct call stacks the heap profiler keeps
+#define PROFILE_MAX_SAMPLES 65536  // Live sampled allocations the heap profiler keeps
+#define PROFILE_DUMP_STACKS 20  // Stacks shown in a heap profile, most live memory first
+#define BENCH_SLOTS 48  // Live allocations kept by the benchmark
+#define BENCH_OPERATIONS 2000000  // Allocations and frees per benchmark run
+#define STRESS_MAX_THREADS 8  // Largest thread count in the stress benchmark
+#define STRESS_SLOTS 64  // Live allocations per stress thread
+#define STRESS_OPERATIONS 1000000  // Allocations and frees per stress thread
+#define STRESS_EXCHANGE_SLOTS 64  // Shared slots for handing pointers to other threads
+#define LARGE_HEAP_BYTES (256UL * 1024 * 1024)  // Live data in the large heap test
+#define SLAB_SIZE (16 * 1024)  // Bytes requested from my_malloc per object pool slab
+#define SLAB_HEADER_SIZE 16  // Slab link, padded so objects stay 16-byte aligned
+#define MIN_SLAB_OBJECTS 8  // Objects per slab when they are too large for SLAB_SIZE
+#define POOL_BENCH_OBJECT_SIZE 32  // Object size in the object pool benchmark
+#define POOL_BENCH_SLOTS 1024  // Live objects kept by the object pool benchmark
+#define REGION_DEFAULT_ALIGN 16  // Alignment of region_alloc, as for my_malloc
+#define REGION_MAX_BLOCK_SIZE (1024 * 1024)  // Regions stop doubling their blocks here
+#define REGION_BENCH_REQUESTS 100000  // Simulated requests in the region benchmark
+#define REGION_BENCH_MAX_OBJECTS 64  // Most allocations made by one simulated request
+#define TRACE_BUFFER_SIZE (64 * 1024)  // Trace bytes the shim buffers before writing them
+#define TRACE_LINE_MAX 96  // Longest line the shim writes to a trace
+#define SAMPLE_TRACE_FILE "sample.trace"  // Written when "sample" is given as the trace to replay
+#define SAMPLE_TRACE_OPERATIONS 500000  // Operations in the sample trace
+#define SAMPLE_TRACE_SLOTS 4096  // Live objects in the program the sample trace imitates
 
-// Structure to represent a memory block
+// Compile with -DALLOCATOR_SHIM -shared -fPIC to build a library that
+// replaces malloc and free in other programs (see the end of this file).
+// Thread-local variables then use the initial-exec TLS model, whose
+// accesses never allocate, as the default model may call malloc.
+#ifdef ALLOCATOR_SHIM
+#define THREAD_LOCAL _Thread_local __attribute__((tls_model("initial-exec")))
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// Keep a function out of its callers, so it shows up in call stacks
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+// Compile with -DHEAP_DEBUG to verify the whole heap after every my_malloc
+// and my_free
+#ifdef HEAP_DEBUG
+#define DEBUG_CHECK_HEAP() do { if (!check_heap(false)) abort(); } while (0)
+#define DEBUG_CHECK_ALIGNED(ptr, alignment) do { \
+        if (((uintptr_t)(ptr) & ((alignment) - 1)) != 0) { \
+            printf("Error: %p is not aligned to %zu bytes\n", (void*)(ptr), (size_t)(alignment)); \
+            abort(); \
+        } \
+    } while (0)
+#else
+#define DEBUG_CHECK_HEAP() do { } while (0)
+#define DEBUG_CHECK_ALIGNED(ptr, alignment) do { } while (0)
+#endif
+
+// Header at the start of every memory block. Blocks lie back to back in
+// a chunk, so the next block starts right after this one's footer. A
+// directly mapped block has only this header, at the start of its mapping.
 typedef struct Block {
     size_t size;           // Size of the block
     bool free;             // Is the block free?
-    struct Block* next;    // Pointer to next block
-    struct Block* prev;    // Pointer to previous block
+    unsigned char arena;   // Index of the arena the block belongs to, or DIRECT_ARENA
+    bool sampled;          // Recorded by the heap profiler
 } Block;
 
-// Global memory pool
-static char memory_pool[POOL_SIZE];
-static Block* head = NULL;
+// Boundary tag: a copy of the header at the end of the block, so the
+// block after it can find the start and state of this one in O(1)
+typedef struct BlockFooter {
+    size_t size;
+    bool free;
+} BlockFooter;
+
+// Free list links, stored in the payload of a free block (which is unused
+// while the block is free, and at least MIN_BLOCK_SIZE bytes)
+typedef struct FreeLinks {
+    Block* next_free;
+    Block* prev_free;
+} FreeLinks;
+
+// my_malloc memory is aligned to SIZE_CLASS_STEP, enough for any type,
+// because chunks start on a page boundary and every header, footer and
+// block size is a multiple of it
+_Static_assert(SIZE_CLASS_STEP % _Alignof(max_align_t) == 0, "blocks must be aligned for any type");
+_Static_assert(sizeof(Block) % SIZE_CLASS_STEP == 0, "headers must keep payloads aligned");
+_Static_assert(sizeof(BlockFooter) % SIZE_CLASS_STEP == 0, "footers must keep payloads aligned");
+_Static_assert(MIN_BLOCK_SIZE % SIZE_CLASS_STEP == 0 && MIN_BLOCK_SIZE >= sizeof(FreeLinks),
+               "a free block must be aligned and hold its links");
+_Static_assert(SLAB_HEADER_SIZE % SIZE_CLASS_STEP == 0, "slab headers must keep objects aligned");
+
+// Smallest span that can be split off as a free block of its own
+#define MIN_FREE_SPAN (sizeof(Block) + sizeof(BlockFooter) + MIN_BLOCK_SIZE)
+
+// A region mapped from the OS for one arena. After this header comes an
+// in-use footer (the prologue), then the blocks, and finally an in-use,
+// zero-size header (the epilogue), so coalescing never has to check
+// whether a neighbor exists or crosses into another chunk.
+typedef struct Chunk {
+    struct Chunk* next;
+    struct Chunk* prev;
+    size_t size;  // Bytes mapped, including this header
+} Chunk;
+
+// Chunk header size, rounded so the blocks stay 16-byte aligned
+#define CHUNK_HEADER_SIZE ((sizeof(Chunk) + 15) & ~(size_t)15)
+
+// An independent heap with its own chunks, free lists and lock. Threads
+// are spread over the arenas so they rarely wait for one another. Arenas
+// start on their own cache line, so one arena's lock and lists don't share
+// a line with its neighbor's in the arenas array.
+typedef struct Arena {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    Chunk* chunks;  // All chunks of the arena, most recently mapped first
+    Chunk* spare;  // Chunk kept mapped when it became entirely free
+    size_t mapped_bytes;
+    int chunk_count;
+    
+    // Segregated free lists: free_lists[c] holds the free blocks of size
+    // class c, and bit c of free_list_map is set while that list is non-empty
+    Block* free_lists[NUM_SIZE_CLASSES];
+    unsigned long long free_list_map;
+} Arena;
+
+// Allocation counters of one thread. Only the owning thread changes them,
+// with relaxed atomic loads and stores that compile to plain memory
+// accesses, so counting takes no locked instruction; write_allocator_stats
+// may still read them from any thread.
+typedef struct ThreadStats {
+    atomic_ullong allocations[NUM_SIZE_CLASSES];
+    atomic_ullong frees[NUM_SIZE_CLASSES];
+    atomic_ullong bytes_allocated;
+    atomic_ullong bytes_freed;
+    atomic_ullong calls;
+    atomic_ullong nanoseconds;  // Estimated from the timed calls
+    long long unpublished_bytes;  // Change in live bytes not yet added to live_bytes
+    long long until_sample;  // Bytes to allocate before the next profile sample
+    bool in_profiler;  // Allocations made while taking a sample are not sampled
+} ThreadStats;
+
+// Small freed blocks kept by one thread for reuse without locking, and the
+// thread's allocation counters. Cached blocks still count as allocated in
+// their arena. They are linked through next_free, and a full class sends
+// half its blocks back to their arenas.
+typedef struct ThreadCache {
+    Block* blocks[TCACHE_CLASSES];
+    int counts[TCACHE_CLASSES];
+    Arena* arena;  // Arena this thread allocates from, NULL until first use
+    ThreadStats stats;
+    struct ThreadCache* next;  // Registry of running threads, for the statistics
+    struct ThreadCache* prev;
+} ThreadCache;
+
+// One thread of the stress benchmark, on its own cache line so threads
+// updating their failure counts don't slow each other down
+typedef struct StressThread {
+    _Alignas(CACHE_LINE_SIZE) pthread_t thread;
+    int id;
+    bool use_system;  // Use malloc/free instead of my_malloc/my_free
+    long failures;
+} StressThread;
+
+// Call stack that made sampled allocations, and its share of the heap.
+// Each sample stands for the bytes allocated since the previous one.
+typedef struct ProfileStack {
+    void* frames[PROFILE_MAX_FRAMES];
+    int depth;
+    size_t live_samples;
+    size_t live_bytes;
+    size_t total_samples;
+    size_t total_bytes;
+} ProfileStack;
+
+// A sampled allocation that is still live
+typedef struct ProfileSample {
+    uintptr_t address;  // Block header; 0 marks an empty entry
+    int stack;
+    size_t weight;  // Bytes the sample stands for
+} ProfileSample;
+
+// Pool of fixed-size objects carved from slabs, which are allocated with
+// my_malloc. Objects carry no header: a free object holds the link to the
+// next free one in its first bytes. A pool has no lock, so it belongs to
+// one thread or must be guarded by its user.
+typedef struct ObjectPool {
+    size_t object_size;  // Rounded up to a multiple of sizeof(void*)
+    size_t objects_per_slab;
+    void* free_objects;  // Intrusive free list
+    void* slabs;  // Slabs, newest first, linked through their first word
+    size_t slab_count;
+    size_t live_objects;
+} ObjectPool;
+
+// Header of a block a region obtained from my_malloc; the memory handed
+// out follows it
+typedef struct RegionBlock {
+    struct RegionBlock* prev;  // Block obtained before this one
+    size_t size;  // Usable bytes after this header
+} RegionBlock;
+
+// Region (bump) allocator for memory that dies all at once, such as the
+// scratch memory of one request. Allocation moves a pointer forward in the
+// current block; nothing is freed on its own, only by releasing to a mark
+// or resetting the whole region. A region has no lock.
+typedef struct Region {
+    RegionBlock* current;  // Block being allocated from, NULL before the first
+    char* top;  // Next free byte in current
+    char* limit;  // End of current
+    size_t block_size;  // Size of the next block, doubling up to REGION_MAX_BLOCK_SIZE
+} Region;
+
+// A saved allocation position in a region, for region_release
+typedef struct RegionMark {
+    RegionBlock* block;
+    char* top;
+} RegionMark;
+
+// One operation of an allocation trace. The pointers recorded in the trace
+// file are replaced by slot numbers when it is loaded, so a replay indexes
+// an array instead of looking pointers up.
+typedef struct TraceOp {
+    char type;  // 'a' malloc, 'm' aligned allocation, 'r' realloc, 'f' free
+    int slot;  // Object the operation allocates, resizes or frees
+    size_t size;  // Requested bytes
+    size_t alignment;  // For 'm'
+} TraceOp;
+
+// An allocation trace loaded for replay
+typedef struct Trace {
+    TraceOp* ops;
+    size_t count;
+    int slot_count;  // Slots used, the most objects live at once
+    size_t skipped;  // Lines ignored: malformed, or freeing an unknown pointer
+} Trace;
+
+// Recorded pointer to slot table, used while loading a trace. Open
+// addressing with linear probing; key 0 marks an empty entry and key 1 a
+// deleted one, as no allocation returns either address.
+typedef struct TracePointerMap {
+    uintptr_t* keys;
+    int* slots;
+    size_t capacity;  // Power of two
+    size_t used;  // Entries holding a pointer or a deletion mark
+} TracePointerMap;
+
+// Outcome of replaying a trace
+typedef struct ReplayResult {
+    double seconds;
+    size_t peak_live;  // Most requested bytes live at once
+    size_t peak_op;  // Number of operations run when peak_live was reached
+    long failures;
+} ReplayResult;
+
+// Global heap state
+static Arena arenas[NUM_ARENAS];
+static atomic_int next_arena = 0;  // Round-robin arena assignment
+static size_t page_size;
+static atomic_size_t direct_mapped_bytes = 0;  // Bytes in direct mappings
+static atomic_int direct_mappings = 0;
+static atomic_size_t heap_mapped_total = 0;  // Bytes mapped for chunks and direct mappings
+static atomic_size_t heap_mapped_peak = 0;  // Highest heap_mapped_total since the last reset
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+
+// Thread caches. The key's destructor returns a cache's blocks when its
+// thread exits.
+static THREAD_LOCAL ThreadCache thread_cache;
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+
+// Allocator statistics. Running threads are found through the registry of
+// their caches; the counts of exited threads are added to retired_stats.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadCache* live_caches = NULL;
+static ThreadStats retired_stats;
+static int retired_threads = 0;
+static atomic_llong live_bytes = 0;  // Published by each thread every STATS_PUBLISH_BYTES
+static atomic_llong peak_live_bytes = 0;
+
+// Heap profiler: open-addressing tables of call stacks and of live
+// samples, sized so they never need memory from the heap they describe
+static atomic_size_t profile_interval = 0;  // Bytes between samples, 0 while stopped
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t profile_sampling_bytes = 0;  // Interval of the current or last run
+static ProfileStack profile_stacks[PROFILE_MAX_STACKS];
+static int profile_stack_count = 0;
+static int profile_stack_table[2 * PROFILE_MAX_STACKS];  // Stack index + 1, 0 if empty
+static ProfileSample profile_samples[2 * PROFILE_MAX_SAMPLES];
+static size_t profile_sample_count = 0;
+static size_t profile_dropped = 0;  // Samples lost because a table was full
+
+// Pointers handed between stress benchmark threads
+static _Atomic(void*) stress_exchange[STRESS_EXCHANGE_SLOTS];
 
 // Function prototypes
 void init_memory_pool();
+void init_arena(Arena* arena);
 void* my_malloc(size_t size);
 void my_free(void* ptr);
+void* my_calloc(size_t count, size_t size);
+void* my_realloc(void* ptr, size_t size);
+void* my_memalign(size_t alignment, size_t size);
+void* my_cache_aligned_alloc(size_t size);
+void* my_page_aligned_alloc(size_t size);
+size_t my_usable_size(void* ptr);
 void print_memory_status();
-Block* find_free_block(size_t size);
-Block* split_block(Block* block, size_t size);
-void merge_blocks();
+Block* arena_malloc(Arena* arena, size_t size);
+Block* arena_malloc_aligned(Arena* arena, size_t size, size_t alignment);
+void arena_free(Arena* arena, Block* block);
+bool arena_grow(Arena* arena);
+void release_chunk(Arena* arena, Chunk* chunk, Block* block);
+Block* find_free_block(Arena* arena, size_t size);
+Block* split_block(Arena* arena, Block* block, size_t size);
+Block* coalesce(Arena* arena, Block* block);
+bool check_heap(bool verbose);
+bool check_arena(Arena* arena, int index, bool verbose);
+int size_class(size_t size);
+void insert_free_block(Arena* arena, Block* block);
+void remove_free_block(Arena* arena, Block* block);
+void flush_thread_cache(ThreadCache* cache, int class_index, int keep);
+void run_benchmark();
+void run_stress_benchmark();
+void run_large_heap_test();
+ObjectPool* object_pool_create(size_t object_size);
+void* object_pool_alloc(ObjectPool* pool);
+void object_pool_free(ObjectPool* pool, void* object);
+void object_pool_destroy(ObjectPool* pool);
+void run_object_pool_benchmark();
+Region* region_create(size_t block_size);
+void* region_alloc(Region* region, size_t size);
+void* region_alloc_aligned(Region* region, size_t size, size_t align);
+RegionMark region_mark(Region* region);
+void region_release(Region* region, RegionMark mark);
+void region_reset(Region* region);
+void region_destroy(Region* region);
+void run_region_benchmark();
+bool load_trace(const char* path, Trace* trace);
+bool write_sample_trace(const char* path);
+void run_trace_replay(const char* path);
+void write_allocator_stats(int fd);
+void heap_profile_start(size_t interval);
+void heap_profile_stop();
+void heap_profile_dump(int fd);
 void print_menu();
 
+#ifndef ALLOCATOR_SHIM
 int main() {
     int choice;
     size_t size;
     void* ptr1, *ptr2, *ptr3;
+    char trace_path[256];
     char continueOperation;
 
     // Initialize memory pool
     init_memory_pool();
     
     printf("Welcome to the Memory Allocator Implementation!\n");
-    printf("Memory Pool Size: %d bytes\n", POOL_SIZE);
+    printf("Heap: %d arenas growing in %d KB chunks\n", NUM_ARENAS, CHUNK_SIZE / 1024);
 
     do {
         print_menu();
@@ -80,12 +434,33 @@ int main() {
                     my_free(ptr2);
                     printf("Freed middle block\n");
                     
-                    // Allocate another block (should reuse freed space)
-                    ptr2 = my_malloc(150);
+                    // Allocate another block of the same size (should reuse
+                    // the freed block from the thread cache)
+                    ptr2 = my_malloc(200);
                     if (ptr2) {
-                        printf("Reallocated 150 bytes at: %p\n", ptr2);
+                        printf("Reallocated 200 bytes at: %p\n", ptr2);
+                    } else {
+                        printf("Failed to reallocate 200 bytes\n");
+                    }
+                    
+                    // The last block is followed by free space, so it
+                    // can grow without moving
+                    ptr1 = my_realloc(ptr3, 400);
+                    if (ptr1) {
+                        printf("Resized the 50-byte block to 400 bytes at: %p (%s)\n",
+                               ptr1, ptr1 == ptr3 ? "in place" : "moved");
+                        ptr3 = ptr1;
                     } else {
-                        printf("Failed to reallocate 150 bytes\n");
+                        printf("Failed to resize to 400 bytes\n");
+                    }
+                    
+                    // Cache-line aligned memory, padded to whole lines, as
+                    // for counters updated by different threads
+                    ptr1 = my_cache_aligned_alloc(100);
+                    if (ptr1) {
+                        printf("Allocated 100 bytes on their own %d-byte cache lines at: %p\n", CACHE_LINE_SIZE, ptr1);
+                    } else {
+                        printf("Failed to allocate cache-aligned memory\n");
                     }
                 } else {
                     printf("Allocation failed\n");
@@ -96,7 +471,55 @@ int main() {
                 print_memory_status();
                 break;
 
-            case 5: // Exit
+            case 5: // Benchmark
+                run_benchmark();
+                break;
+
+            case 6: // Multi-threaded stress benchmark
+                run_stress_benchmark();
+                break;
+
+            case 7: // Large heap test
+                run_large_heap_test();
+                break;
+
+            case 8: // Object pool benchmark
+                run_object_pool_benchmark();
+                break;
+
+            case 9: // Region benchmark
+                run_region_benchmark();
+                break;
+
+            case 10: // Trace replay
+                printf("Enter trace file to replay (\"sample\" writes one first): ");
+                scanf("%255s", trace_path);
+                run_trace_replay(trace_path);
+                break;
+
+            case 11: // Statistics and heap profile
+                fflush(stdout);
+                write_allocator_stats(STDOUT_FILENO);
+                heap_profile_dump(STDOUT_FILENO);
+                break;
+
+            case 12: // Heap profiler
+                printf("Enter sampling interval in bytes (0 stops the profiler): ");
+                scanf("%zu", &size);
+                if (size > 0) {
+                    heap_profile_start(size);
+                    printf("Heap profiler sampling every %zu bytes\n", size);
+                } else {
+                    heap_profile_stop();
+                    printf("Heap profiler stopped\n");
+                }
+                break;
+
+            case 13: // Consistency check
+                check_heap(true);
+                break;
+
+            case 14: // Exit
                 printf("Thank you for using the Memory Allocator!\n");
                 exit(0);
 
@@ -112,152 +535,2602 @@ int main() {
 
     return 0;
 }
+#endif
+
+// Footer of a block, right after its payload
+static BlockFooter* block_footer(Block* block) {
+    return (BlockFooter*)((char*)(block + 1) + block->size);
+}
+
+// Physically next block (the epilogue after the last block)
+static Block* next_block(Block* block) {
+    return (Block*)(block_footer(block) + 1);
+}
+
+// Physically previous block, found through its footer. Must not be called
+// on the first block, whose predecessor is the prologue.
+static Block* prev_block(Block* block) {
+    BlockFooter* footer = (BlockFooter*)block - 1;
+    return (Block*)((char*)footer - footer->size) - 1;
+}
+
+// Write a block's header and footer
+static void set_block(Block* block, size_t size, bool free) {
+    block->size = size;
+    block->free = free;
+    BlockFooter* footer = block_footer(block);
+    footer->size = size;
+    footer->free = free;
+}
 
-// Initialize the memory pool
+// Free list links of a free block
+static FreeLinks* free_links(Block* block) {
+    return (FreeLinks*)(block + 1);
+}
+
+// Round up to a whole number of pages
+static size_t page_round_up(size_t size) {
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// First block of a chunk, right after the prologue
+static Block* chunk_first_block(Chunk* chunk) {
+    return (Block*)((char*)chunk + CHUNK_HEADER_SIZE + sizeof(BlockFooter));
+}
+
+// Does the block cover its whole chunk? Only the prologue has a zero-size
+// footer and only the epilogue a zero-size header.
+static bool block_spans_chunk(Block* block) {
+    return ((BlockFooter*)block - 1)->size == 0 && next_block(block)->size == 0;
+}
+
+// Chunk of a block that spans it
+static Chunk* spanned_chunk(Block* block) {
+    return (Chunk*)((char*)block - sizeof(BlockFooter) - CHUNK_HEADER_SIZE);
+}
+
+// Account for memory mapped from the OS, raising the peak if needed
+static void count_mapped(size_t bytes) {
+    size_t total = atomic_fetch_add(&heap_mapped_total, bytes) + bytes;
+    size_t peak = atomic_load(&heap_mapped_peak);
+    while (total > peak && !atomic_compare_exchange_weak(&heap_mapped_peak, &peak, total)) {
+    }
+}
+
+// Account for memory returned to the OS
+static void count_unmapped(size_t bytes) {
+    atomic_fetch_sub(&heap_mapped_total, bytes);
+}
+
+// Fork handlers: no heap lock may be held by another thread while the
+// process forks, or the child, which has only the forking thread, could
+// never take it
+static void lock_heap() {
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&profile_lock);
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+static void unlock_heap() {
+    for (int i = NUM_ARENAS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void init_heap() {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        init_arena(&arenas[i]);
+    }
+    pthread_atfork(lock_heap, unlock_heap, unlock_heap);
+}
+
+// Initialize every arena, once. Arenas start empty and map their first
+// chunk on the first allocation. Also called on the allocation paths, as
+// a program using the shim never calls it itself.
 void init_memory_pool() {
-    head = (Block*)memory_pool;
-    head->size = POOL_SIZE - sizeof(Block);
-    head->free = true;
-    head->next = NULL;
-    head->prev = NULL;
+    pthread_once(&heap_once, init_heap);
 }
 
-// Custom malloc implementation
-void* my_malloc(size_t size) {
-    // Align size to minimum block size
-    if (size <= 0) return NULL;
+// Initialize an arena with no chunks
+void init_arena(Arena* arena) {
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->chunks = NULL;
+    arena->spare = NULL;
+    arena->mapped_bytes = 0;
+    arena->chunk_count = 0;
     
-    // Add space for block header
-    size_t total_size = size + sizeof(Block);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        arena->free_lists[i] = NULL;
+    }
+    arena->free_list_map = 0;
+}
+
+// Map a new chunk for an arena, whose lock the caller holds, and file it
+// as one free block between the sentinels. Returns false if the OS has no
+// memory to give.
+bool arena_grow(Arena* arena) {
+    void* memory = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
     
-    // Find a free block
-    Block* block = find_free_block(size);
+    Chunk* chunk = (Chunk*)memory;
+    chunk->size = CHUNK_SIZE;
+    chunk->prev = NULL;
+    chunk->next = arena->chunks;
+    if (arena->chunks != NULL) {
+        arena->chunks->prev = chunk;
+    }
+    arena->chunks = chunk;
+    arena->mapped_bytes += CHUNK_SIZE;
+    arena->chunk_count++;
+    count_mapped(CHUNK_SIZE);
     
-    if (block == NULL) {
-        return NULL;  // No free block found
+    // Fresh pages are zeroed, so the prologue footer is already size 0
+    // and in use; only the block and the epilogue need writing
+    Block* block = chunk_first_block(chunk);
+    block->arena = (unsigned char)(arena - arenas);
+    set_block(block, CHUNK_SIZE - CHUNK_HEADER_SIZE - 2 * sizeof(BlockFooter) - 2 * sizeof(Block), true);
+    
+    Block* epilogue = next_block(block);
+    epilogue->size = 0;
+    epilogue->free = false;
+    epilogue->arena = block->arena;
+    
+    insert_free_block(arena, block);
+    return true;
+}
+
+// Deal with a chunk that has become entirely free; block is its single
+// free block, not on any free list. The arena keeps one such chunk as a
+// spare, so a program hovering around a chunk boundary doesn't map and
+// unmap on every call, but gives its pages back with madvise. Any other
+// entirely free chunk is unmapped.
+void release_chunk(Arena* arena, Chunk* chunk, Block* block) {
+    Chunk* spare = arena->spare;
+    bool spare_in_use = spare != NULL && spare != chunk &&
+                        !(chunk_first_block(spare)->free && block_spans_chunk(chunk_first_block(spare)));
+    
+    if (spare == NULL || spare == chunk || spare_in_use) {
+        arena->spare = chunk;
+        insert_free_block(arena, block);
+        
+        // Keep the header, free list links and footer; drop the pages between
+        char* start = (char*)(void*)(free_links(block) + 1);
+        start = (char*)chunk + page_round_up((size_t)(start - (char*)chunk));
+        char* end = (char*)chunk + (((char*)block_footer(block) - (char*)chunk) & ~(page_size - 1));
+        if (end > start) {
+            madvise(start, (size_t)(end - start), MADV_DONTNEED);
+        }
+        return;
     }
     
-    // Split block if it's much larger than needed
-    if (block->size >= size + sizeof(Block) + MIN_BLOCK_SIZE) {
-        block = split_block(block, size);
+    if (chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    } else {
+        arena->chunks = chunk->next;
+    }
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk->prev;
     }
+    arena->mapped_bytes -= chunk->size;
+    arena->chunk_count--;
+    count_unmapped(chunk->size);
+    munmap(chunk, chunk->size);
+}
+
+// Serve a large request with a mapping of its own, bypassing the arenas.
+// The header goes right before the first address with the requested
+// alignment; the mapping starts in the same page as the header, so it is
+// found again by rounding the header down to a page.
+static void* map_direct(size_t size, size_t alignment) {
+    init_memory_pool();
+    size_t offset = alignment > sizeof(Block) ? alignment - sizeof(Block) : 0;
+    char* start;
+    size_t length;
     
-    block->free = false;
+    if (alignment <= page_size) {
+        length = page_round_up(offset + sizeof(Block) + size);
+        start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (start == MAP_FAILED) {
+            return NULL;
+        }
+    } else {
+        // Map enough to find an aligned address with a page before it for
+        // the header, then unmap the excess on both sides
+        length = page_size + page_round_up(size);
+        char* raw = mmap(NULL, length + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        uintptr_t aligned = ((uintptr_t)raw + page_size + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        start = (char*)aligned - page_size;
+        if (start > raw) {
+            munmap(raw, (size_t)(start - raw));
+        }
+        if (raw + length + alignment > start + length) {
+            munmap(start + length, (size_t)(raw + length + alignment - (start + length)));
+        }
+        offset = page_size - sizeof(Block);
+    }
     
-    // Return pointer to memory after the block header
+    Block* block = (Block*)(start + offset);
+    block->size = length - offset - sizeof(Block);
+    block->free = false;
+    block->arena = DIRECT_ARENA;
+    atomic_fetch_add(&direct_mapped_bytes, length);
+    atomic_fetch_add(&direct_mappings, 1);
+    count_mapped(length);
     return (void*)(block + 1);
 }
 
-// Custom free implementation
-void my_free(void* ptr) {
-    if (ptr == NULL) return;
-    
-    // Get block header (stored before the returned pointer)
-    Block* block = (Block*)ptr - 1;
+// Start of the mapping holding a direct block
+static char* direct_mapping(Block* block) {
+    return (char*)((uintptr_t)block & ~(uintptr_t)(page_size - 1));
+}
+
+// Return a direct mapping to the OS
+static void unmap_direct(Block* block) {
+    char* start = direct_mapping(block);
+    size_t length = (size_t)((char*)(block + 1) + block->size - start);
+    atomic_fetch_sub(&direct_mapped_bytes, length);
+    atomic_fetch_sub(&direct_mappings, 1);
+    count_unmapped(length);
+    munmap(start, length);
+}
+
+// Size class of a block or request: one class per SIZE_CLASS_STEP bytes
+// for small sizes, then one per power of two
+int size_class(size_t size) {
+    if (size < SMALL_CLASS_LIMIT) {
+        return (int)(size / SIZE_CLASS_STEP);
+    }
     
-    // Mark block as free
-    block->free = true;
+    int class_index = SMALL_CLASS_LIMIT / SIZE_CLASS_STEP;
+    size_t limit = (size_t)SMALL_CLASS_LIMIT * 2;
+    while (size >= limit && class_index < NUM_SIZE_CLASSES - 1) {
+        class_index++;
+        limit *= 2;
+    }
+    return class_index;
+}
+
+// Index of the lowest set bit of a non-zero mask
+static int lowest_set_bit(unsigned long long mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// Push a free block onto the list for its size class
+void insert_free_block(Arena* arena, Block* block) {
+    int class_index = size_class(block->size);
+    FreeLinks* links = free_links(block);
     
-    // Merge adjacent free blocks
-    merge_blocks();
+    links->prev_free = NULL;
+    links->next_free = arena->free_lists[class_index];
+    if (links->next_free != NULL) {
+        free_links(links->next_free)->prev_free = block;
+    }
+    arena->free_lists[class_index] = block;
+    arena->free_list_map |= 1ULL << class_index;
 }
 
-// Find a free block of sufficient size
-Block* find_free_block(size_t size) {
-    Block* current = head;
+// Unlink a free block from its size class list
+void remove_free_block(Arena* arena, Block* block) {
+    int class_index = size_class(block->size);
+    FreeLinks* links = free_links(block);
     
-    while (current != NULL) {
-        if (current->free && current->size >= size) {
-            return current;
+    if (links->prev_free != NULL) {
+        free_links(links->prev_free)->next_free = links->next_free;
+    } else {
+        arena->free_lists[class_index] = links->next_free;
+        if (arena->free_lists[class_index] == NULL) {
+            arena->free_list_map &= ~(1ULL << class_index);
         }
-        current = current->next;
     }
-    
-    return NULL;  // No suitable block found
+    if (links->next_free != NULL) {
+        free_links(links->next_free)->prev_free = links->prev_free;
+    }
 }
 
-// Split a block into two parts
-Block* split_block(Block* block, size_t size) {
-    size_t remaining_size = block->size - size - sizeof(Block);
+// Give every block in a thread's cache back to its arena
+static void release_thread_cache(void* arg) {
+    ThreadCache* cache = (ThreadCache*)arg;
+    for (int i = 0; i < TCACHE_CLASSES; i++) {
+        flush_thread_cache(cache, i, 0);
+    }
+}
+
+// Add a thread's counters to another set (under stats_lock)
+static void merge_stats(ThreadStats* into, ThreadStats* from);
+
+// Publish a thread's change in live bytes and raise the peak
+static void publish_live_bytes(ThreadStats* stats) {
+    long long live = atomic_fetch_add(&live_bytes, stats->unpublished_bytes) + stats->unpublished_bytes;
+    long long peak = atomic_load(&peak_live_bytes);
+    stats->unpublished_bytes = 0;
+    while (live > peak && !atomic_compare_exchange_weak(&peak_live_bytes, &peak, live)) {
+    }
+}
+
+// Thread exit: return the cache's blocks, fold the thread's counters into
+// the retired totals and take the cache off the registry. Should the
+// thread allocate again in a later destructor, it registers anew.
+static void retire_thread_cache(void* arg) {
+    ThreadCache* cache = (ThreadCache*)arg;
+    release_thread_cache(cache);
     
-    // Only split if remaining block is large enough
-    if (remaining_size >= MIN_BLOCK_SIZE) {
-        Block* new_block = (Block*)((char*)block + sizeof(Block) + size);
-        new_block->size = remaining_size;
-        new_block->free = true;
-        new_block->next = block->next;
-        new_block->prev = block;
+    pthread_mutex_lock(&stats_lock);
+    publish_live_bytes(&cache->stats);
+    merge_stats(&retired_stats, &cache->stats);
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    retired_threads++;
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        live_caches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    cache->arena = NULL;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void create_thread_cache_key() {
+    pthread_key_create(&thread_cache_key, retire_thread_cache);
+}
+
+// Arena of the calling thread. The first call assigns one round-robin,
+// registers the thread's cache to be released when the thread exits and
+// adds it to the registry read by the statistics.
+static Arena* thread_arena() {
+    ThreadCache* cache = &thread_cache;
+    if (cache->arena == NULL) {
+        init_memory_pool();
+        pthread_once(&thread_cache_once, create_thread_cache_key);
+        pthread_setspecific(thread_cache_key, cache);
+        cache->arena = &arenas[atomic_fetch_add(&next_arena, 1) % NUM_ARENAS];
         
-        if (block->next != NULL) {
-            block->next->prev = new_block;
+        pthread_mutex_lock(&stats_lock);
+        cache->prev = NULL;
+        cache->next = live_caches;
+        if (live_caches != NULL) {
+            live_caches->prev = cache;
         }
+        live_caches = cache;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return cache->arena;
+}
+
+// Return blocks of one size class from a thread cache to their arenas until
+// keep are left. Consecutive blocks from the same arena share one lock.
+void flush_thread_cache(ThreadCache* cache, int class_index, int keep) {
+    Arena* locked = NULL;
+    
+    while (cache->counts[class_index] > keep) {
+        Block* block = cache->blocks[class_index];
+        cache->blocks[class_index] = free_links(block)->next_free;
+        cache->counts[class_index]--;
         
-        block->next = new_block;
-        block->size = size;
+        // The block may come from any thread's arena
+        Arena* arena = &arenas[block->arena];
+        if (arena != locked) {
+            if (locked != NULL) pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        arena_free(arena, block);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+// Is the block in the calling thread's cache?
+static bool in_thread_cache(Block* block) {
+    if (block->size > TCACHE_MAX_SIZE) return false;
+    for (Block* b = thread_cache.blocks[size_class(block->size)]; b != NULL; b = free_links(b)->next_free) {
+        if (b == block) return true;
+    }
+    return false;
+}
+
+// Add to a counter of the calling thread. Only the owner changes it, so a
+// relaxed load and store are enough: no locked instruction is needed, and
+// other threads can still read it safely.
+static void stat_add(atomic_ullong* counter, unsigned long long value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+static void merge_stats(ThreadStats* into, ThreadStats* from) {
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        stat_add(&into->allocations[i], atomic_load_explicit(&from->allocations[i], memory_order_relaxed));
+        stat_add(&into->frees[i], atomic_load_explicit(&from->frees[i], memory_order_relaxed));
+    }
+    stat_add(&into->bytes_allocated, atomic_load_explicit(&from->bytes_allocated, memory_order_relaxed));
+    stat_add(&into->bytes_freed, atomic_load_explicit(&from->bytes_freed, memory_order_relaxed));
+    stat_add(&into->calls, atomic_load_explicit(&from->calls, memory_order_relaxed));
+    stat_add(&into->nanoseconds, atomic_load_explicit(&from->nanoseconds, memory_order_relaxed));
+}
+
+static long long monotonic_nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Counters of the calling thread, registering the thread on first use
+static inline ThreadStats* thread_stats() {
+    ThreadCache* cache = &thread_cache;
+    if (cache->arena == NULL) {
+        thread_arena();
+    }
+    return &cache->stats;
+}
+
+// Start timing an allocator call. Reading the clock costs about as much as
+// a small allocation, so only one call in STATS_TIMING_INTERVAL is timed,
+// and its time counts for all of them. Returns 0 for calls not timed.
+static inline long long stats_timer_start(ThreadStats* stats) {
+    unsigned long long calls = atomic_load_explicit(&stats->calls, memory_order_relaxed) + 1;
+    atomic_store_explicit(&stats->calls, calls, memory_order_relaxed);
+    return calls % STATS_TIMING_INTERVAL == 0 ? monotonic_nanoseconds() : 0;
+}
+
+static inline void stats_timer_stop(ThreadStats* stats, long long start) {
+    if (start != 0) {
+        stat_add(&stats->nanoseconds, (monotonic_nanoseconds() - start) * STATS_TIMING_INTERVAL);
+    }
+}
+
+// Count a change in the calling thread's live bytes, publishing it once it
+// is large, so threads rarely touch the shared counter
+static inline void stats_change_live(ThreadStats* stats, long long bytes) {
+    stats->unpublished_bytes += bytes;
+    if (stats->unpublished_bytes >= STATS_PUBLISH_BYTES || stats->unpublished_bytes <= -STATS_PUBLISH_BYTES) {
+        publish_live_bytes(stats);
+    }
+}
+
+// Slot of a block address in a hash table of 2^bits entries: blocks are
+// 16-byte aligned, so the low bits carry no information
+static size_t address_hash(uintptr_t address, size_t mask) {
+    unsigned long long h = (unsigned long long)(address >> 4) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 32)) & mask;
+}
+
+// Index of a call stack in profile_stacks, adding it if it is new; -1 if
+// the table is full. The caller holds profile_lock.
+static int profile_find_stack(void** frames, int depth) {
+    size_t mask = 2 * PROFILE_MAX_STACKS - 1;
+    uintptr_t hash = (uintptr_t)depth;
+    for (int i = 0; i < depth; i++) {
+        hash = hash * 31 + (uintptr_t)frames[i];
     }
     
-    return block;
+    size_t i = address_hash(hash, mask);
+    while (profile_stack_table[i] != 0) {
+        ProfileStack* stack = &profile_stacks[profile_stack_table[i] - 1];
+        if (stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0) {
+            return profile_stack_table[i] - 1;
+        }
+        i = (i + 1) & mask;
+    }
+    if (profile_stack_count == PROFILE_MAX_STACKS) {
+        return -1;
+    }
+    
+    ProfileStack* stack = &profile_stacks[profile_stack_count];
+    memcpy(stack->frames, frames, depth * sizeof(void*));
+    stack->depth = depth;
+    profile_stack_table[i] = ++profile_stack_count;
+    return profile_stack_count - 1;
 }
 
-// Merge adjacent free blocks
-void merge_blocks() {
-    Block* current = head;
+// Record a sampled allocation under its call stack. The stack is captured
+// before taking the lock, since the first backtrace() may allocate.
+static NOINLINE void profile_sample(ThreadStats* stats, Block* block, size_t interval) {
+    long long intervals = 1 + (-stats->until_sample) / (long long)interval;
+    stats->until_sample += intervals * (long long)interval;
+    size_t weight = (size_t)intervals * interval;
     
-    while (current != NULL && current->next != NULL) {
-        // If both current and next blocks are free, merge them
-        if (current->free && current->next->free) {
-            current->size += sizeof(Block) + current->next->size;
-            current->next = current->next->next;
-            
-            if (current->next != NULL) {
-                current->next->prev = current;
+    void* frames[PROFILE_MAX_FRAMES + PROFILE_SKIP_FRAMES];
+    stats->in_profiler = true;
+    int depth = backtrace(frames, PROFILE_MAX_FRAMES + PROFILE_SKIP_FRAMES) - PROFILE_SKIP_FRAMES;
+    stats->in_profiler = false;
+    if (depth < 0) depth = 0;
+    
+    pthread_mutex_lock(&profile_lock);
+    int stack = profile_find_stack(frames + PROFILE_SKIP_FRAMES, depth);
+    if (stack < 0 || profile_sample_count == PROFILE_MAX_SAMPLES) {
+        profile_dropped++;
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+    
+    size_t mask = 2 * PROFILE_MAX_SAMPLES - 1;
+    size_t i = address_hash((uintptr_t)block, mask);
+    while (profile_samples[i].address != 0) {
+        i = (i + 1) & mask;
+    }
+    profile_samples[i] = (ProfileSample){(uintptr_t)block, stack, weight};
+    profile_sample_count++;
+    profile_stacks[stack].live_samples++;
+    profile_stacks[stack].live_bytes += weight;
+    profile_stacks[stack].total_samples++;
+    profile_stacks[stack].total_bytes += weight;
+    block->sampled = true;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Drop the sample of a block that is being freed or resized. Entries after
+// it in its probe run are moved back, so the table needs no deletion marks.
+static void profile_forget(Block* block) {
+    size_t mask = 2 * PROFILE_MAX_SAMPLES - 1;
+    pthread_mutex_lock(&profile_lock);
+    block->sampled = false;
+    
+    size_t i = address_hash((uintptr_t)block, mask);
+    while (profile_samples[i].address != 0 && profile_samples[i].address != (uintptr_t)block) {
+        i = (i + 1) & mask;
+    }
+    if (profile_samples[i].address != 0) {
+        ProfileStack* stack = &profile_stacks[profile_samples[i].stack];
+        stack->live_samples--;
+        stack->live_bytes -= profile_samples[i].weight;
+        profile_sample_count--;
+        
+        for (size_t j = (i + 1) & mask; profile_samples[j].address != 0; j = (j + 1) & mask) {
+            size_t home = address_hash(profile_samples[j].address, mask);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                profile_samples[i] = profile_samples[j];
+                i = j;
             }
-        } else {
-            current = current->next;
         }
+        profile_samples[i].address = 0;
     }
+    pthread_mutex_unlock(&profile_lock);
 }
 
-// Print memory status
-void print_memory_status() {
-    printf("\n===== Memory Pool Status =====\n");
-    printf("Address\t\tSize\tFree\n");
-    printf("--------------------------------\n");
+// Count a block the heap handed out, and take a profile sample once every
+// profile_interval bytes
+static inline void stats_allocated(ThreadStats* stats, void* ptr) {
+    Block* block = (Block*)ptr - 1;
+    stat_add(&stats->allocations[size_class(block->size)], 1);
+    stat_add(&stats->bytes_allocated, block->size);
+    stats_change_live(stats, (long long)block->size);
+    
+    block->sampled = false;
+    size_t interval = atomic_load_explicit(&profile_interval, memory_order_relaxed);
+    if (interval != 0) {
+        stats->until_sample -= (long long)block->size;
+        if (stats->until_sample <= 0 && !stats->in_profiler) {
+            profile_sample(stats, block, interval);
+        }
+    }
+}
+
+// Count a block about to be freed or resized
+static inline void stats_freed(ThreadStats* stats, Block* block) {
+    stat_add(&stats->frees[size_class(block->size)], 1);
+    stat_add(&stats->bytes_freed, block->size);
+    stats_change_live(stats, -(long long)block->size);
+    if (block->sampled) {
+        profile_forget(block);
+    }
+}
+
+// Custom malloc implementation. Small requests are served from the thread
+// cache without locking, and large ones get a mapping of their own; the
+// rest come from the thread's arena, which maps another chunk when full.
+static inline void* heap_malloc(size_t size) {
+    if (size <= 0 || size > SIZE_MAX / 2) return NULL;
     
-    Block* current = head;
-    int block_count = 0;
-    size_t total_free = 0;
-    size_t total_used = 0;
+    // Round up to the size class step, so every block in a small class
+    // fits any request that maps to it
+    size = (size + SIZE_CLASS_STEP - 1) & ~(size_t)(SIZE_CLASS_STEP - 1);
     
-    while (current != NULL) {
-        printf("%p\t%zu\t%s\n", 
-               (void*)current, 
-               current->size, 
-               current->free ? "Yes" : "No");
-        
-        if (current->free) {
-            total_free += current->size;
-        } else {
-            total_used += current->size;
+    if (size > MMAP_THRESHOLD) {
+        return map_direct(size, SIZE_CLASS_STEP);
+    }
+    
+    ThreadCache* cache = &thread_cache;
+    if (size <= TCACHE_MAX_SIZE) {
+        int class_index = size_class(size);
+        Block* block = cache->blocks[class_index];
+        if (block != NULL) {
+            cache->blocks[class_index] = free_links(block)->next_free;
+            cache->counts[class_index]--;
+            return (void*)(block + 1);
         }
-        
-        block_count++;
-        current = current->next;
     }
     
-    printf("\nTotal blocks: %d\n", block_count);
-    printf("Total free memory: %zu bytes\n", total_free);
-    printf("Total used memory: %zu bytes\n", total_used);
-    printf("Memory pool size: %d bytes\n", POOL_SIZE);
+    Arena* arena = thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    Block* block = arena_malloc(arena, size);
+    if (block == NULL && arena_grow(arena)) {
+        block = arena_malloc(arena, size);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    DEBUG_CHECK_HEAP();
+    
+    // Return pointer to memory after the block header
+    return block != NULL ? (void*)(block + 1) : NULL;
 }
 
-// Print the menu
-void print_menu() {
-    printf("\n===== Memory Allocator =====\n");
-    printf("1. Allocate memory\n");
-    printf("2. Free memory\n");
-    printf("3. Demo allocation\n");
-    printf("4. Print memory status\n");
-    printf("5. Exit\n");
-    printf("===========================\n");
-}
\ No newline at end of file
+// Custom free implementation. Any thread may free any block: small blocks
+// go into the calling thread's cache, larger ones straight back to the
+// arena recorded in their header, under that arena's lock, and direct
+// mappings back to the OS.
+static inline void heap_free(void* ptr) {
+    if (ptr == NULL) return;
+    
+    // Get block header (stored before the returned pointer)
+    Block* block = (Block*)ptr - 1;
+#ifdef HEAP_DEBUG
+    if (block->free || in_thread_cache(block)) {
+        printf("Error: double free of %p\n", ptr);
+        abort();
+    }
+#endif
+    
+    if (block->arena == DIRECT_ARENA) {
+        unmap_direct(block);
+        return;
+    }
+    
+    if (block->size <= TCACHE_MAX_SIZE) {
+        ThreadCache* cache = &thread_cache;
+        int class_index = size_class(block->size);
+        thread_arena();  // Registers the cache for release at thread exit
+        free_links(block)->next_free = cache->blocks[class_index];
+        cache->blocks[class_index] = block;
+        if (++cache->counts[class_index] > TCACHE_COUNT) {
+            flush_thread_cache(cache, class_index, TCACHE_COUNT / 2);
+        }
+        return;
+    }
+    
+    Arena* arena = &arenas[block->arena];
+    pthread_mutex_lock(&arena->lock);
+    arena_free(arena, block);
+    pthread_mutex_unlock(&arena->lock);
+    DEBUG_CHECK_HEAP();
+}
+
+// Shrink an allocated block of an arena, whose lock the caller holds, to
+// size bytes, freeing the rest if it is large enough to be a block
+static void shrink_block(Arena* arena, Block* block, size_t size) {
+    if (block->size < size + sizeof(Block) + sizeof(BlockFooter) + MIN_BLOCK_SIZE) {
+        return;
+    }
+    size_t remaining_size = block->size - size - sizeof(Block) - sizeof(BlockFooter);
+    set_block(block, size, false);
+    Block* rest = next_block(block);
+    rest->arena = block->arena;
+    set_block(rest, remaining_size, false);
+    arena_free(arena, rest);
+}
+
+// Allocate zeroed memory for count objects of the given size
+void* my_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+    void* ptr = my_malloc(count * size);
+    
+    // Fresh mappings are already zero
+    if (ptr != NULL && ((Block*)ptr - 1)->arena != DIRECT_ARENA) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+// Resize a block, keeping its contents. A heap block shrinks in place and
+// grows in place when the block after it is free and large enough; a
+// direct mapping is resized with mremap, which moves pages instead of
+// copying them. Otherwise the data moves to a new block.
+static void* heap_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) return heap_malloc(size);
+    if (size == 0) {
+        heap_free(ptr);
+        return NULL;
+    }
+    if (size > SIZE_MAX / 2) return NULL;
+    
+    Block* block = (Block*)ptr - 1;
+    size_t rounded = (size + SIZE_CLASS_STEP - 1) & ~(size_t)(SIZE_CLASS_STEP - 1);
+    
+    if (block->arena == DIRECT_ARENA) {
+#ifdef MREMAP_MAYMOVE
+        if (rounded > MMAP_THRESHOLD) {
+            char* start = direct_mapping(block);
+            size_t offset = (size_t)((char*)block - start);
+            size_t old_length = offset + sizeof(Block) + block->size;
+            size_t new_length = page_round_up(offset + sizeof(Block) + rounded);
+            char* moved = mremap(start, old_length, new_length, MREMAP_MAYMOVE);
+            if (moved == MAP_FAILED) {
+                return NULL;
+            }
+            block = (Block*)(moved + offset);
+            block->size = new_length - offset - sizeof(Block);
+            atomic_fetch_add(&direct_mapped_bytes, new_length - old_length);
+            if (new_length > old_length) {
+                count_mapped(new_length - old_length);
+            } else {
+                count_unmapped(old_length - new_length);
+            }
+            return (void*)(block + 1);
+        }
+#endif
+        if (rounded <= block->size && rounded > MMAP_THRESHOLD) {
+            return ptr;
+        }
+    } else if (rounded <= MMAP_THRESHOLD) {
+        Arena* arena = &arenas[block->arena];
+        bool resized = false;
+        pthread_mutex_lock(&arena->lock);
+        if (rounded <= block->size) {
+            shrink_block(arena, block, rounded);
+            resized = true;
+        } else {
+            Block* next = next_block(block);
+            size_t merged = block->size + sizeof(BlockFooter) + sizeof(Block) + next->size;
+            if (next->free && merged >= rounded) {
+                remove_free_block(arena, next);
+                set_block(block, merged, false);
+                shrink_block(arena, block, rounded);
+                resized = true;
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+        if (resized) {
+            DEBUG_CHECK_HEAP();
+            return ptr;
+        }
+    }
+    
+    void* moved = heap_malloc(size);
+    if (moved == NULL) {
+        return NULL;
+    }
+    memcpy(moved, ptr, block->size < size ? block->size : size);
+    heap_free(ptr);
+    return moved;
+}
+
+// Allocate memory whose address is a multiple of alignment, a power of
+// two. Every block is already aligned to SIZE_CLASS_STEP. For larger
+// alignments the arena looks for a free block that can hold the request
+// at an aligned address; only the space in front of that address and the
+// space after the requested size are split off, and stay free.
+static void* heap_memalign(size_t alignment, size_t size) {
+    if (alignment <= SIZE_CLASS_STEP) return heap_malloc(size);
+    if (size <= 0 || size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4) return NULL;
+    
+    size = (size + SIZE_CLASS_STEP - 1) & ~(size_t)(SIZE_CLASS_STEP - 1);
+    if (size + alignment + MIN_FREE_SPAN > MMAP_THRESHOLD) {
+        return map_direct(size, alignment);
+    }
+    
+    Arena* arena = thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    Block* block = arena_malloc_aligned(arena, size, alignment);
+    if (block == NULL && arena_grow(arena)) {
+        block = arena_malloc_aligned(arena, size, alignment);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    DEBUG_CHECK_HEAP();
+    
+    if (block == NULL) {
+        return NULL;
+    }
+    DEBUG_CHECK_ALIGNED(block + 1, alignment);
+    return (void*)(block + 1);
+}
+
+// The public allocation functions wrap the heap functions above, counting
+// every block in the calling thread's statistics and timing some calls
+
+void* my_malloc(size_t size) {
+    ThreadStats* stats = thread_stats();
+    long long timer = stats_timer_start(stats);
+    void* ptr = heap_malloc(size);
+    if (ptr != NULL) stats_allocated(stats, ptr);
+    stats_timer_stop(stats, timer);
+    return ptr;
+}
+
+void my_free(void* ptr) {
+    if (ptr == NULL) return;
+    ThreadStats* stats = thread_stats();
+    long long timer = stats_timer_start(stats);
+    stats_freed(stats, (Block*)ptr - 1);
+    heap_free(ptr);
+    stats_timer_stop(stats, timer);
+}
+
+// A resized block counts as a free of the old size and an allocation of
+// the new one. The old block's counts and profile sample are dropped
+// first, while its header is sure to exist; if the resize fails, the block
+// is counted as allocated again, but without its sample.
+void* my_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) return my_malloc(size);
+    ThreadStats* stats = thread_stats();
+    long long timer = stats_timer_start(stats);
+    stats_freed(stats, (Block*)ptr - 1);
+    void* resized = heap_realloc(ptr, size);
+    if (resized != NULL) {
+        stats_allocated(stats, resized);
+    } else if (size != 0) {
+        stats_allocated(stats, ptr);
+    }
+    stats_timer_stop(stats, timer);
+    return resized;
+}
+
+// alignment must be a power of two; anything else fails with EINVAL, as
+// the shim's aligned_alloc does, rather than reaching heap_memalign
+void* my_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ThreadStats* stats = thread_stats();
+    long long timer = stats_timer_start(stats);
+    void* ptr = heap_memalign(alignment, size);
+    if (ptr != NULL) stats_allocated(stats, ptr);
+    stats_timer_stop(stats, timer);
+    return ptr;
+}
+
+// Memory for data that one thread updates while others use the memory
+// around it, such as per-thread counters or SIMD buffers: aligned to a
+// cache line and padded to whole lines, so it shares no line with other
+// data and no vector load is split across two lines
+void* my_cache_aligned_alloc(size_t size) {
+    if (size <= 0 || size > SIZE_MAX / 4) return NULL;
+    return my_memalign(CACHE_LINE_SIZE, (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+}
+
+// Page-aligned memory, for buffers used with mprotect or direct I/O
+void* my_page_aligned_alloc(size_t size) {
+    init_memory_pool();
+    return my_memalign(page_size, size);
+}
+
+// Bytes usable at ptr, at least the size that was requested
+size_t my_usable_size(void* ptr) {
+    return ptr != NULL ? ((Block*)ptr - 1)->size : 0;
+}
+
+// Allocate a block of the (rounded) size from one arena, whose lock the
+// caller holds. Returns NULL if the arena has no large enough free block.
+Block* arena_malloc(Arena* arena, size_t size) {
+    // Find a free block
+    Block* block = find_free_block(arena, size);
+    
+    if (block == NULL) {
+        return NULL;  // No free block found
+    }
+    remove_free_block(arena, block);
+    
+    // Split block if it's much larger than needed
+    if (block->size >= size + sizeof(Block) + sizeof(BlockFooter) + MIN_BLOCK_SIZE) {
+        block = split_block(arena, block, size);
+    }
+    
+    set_block(block, block->size, false);
+    return block;
+}
+
+// Header of the block of the given size, with an aligned payload, that a
+// free block could hold, or NULL if it is too small. If the free block's
+// own payload is not aligned, the aligned one starts far enough in to leave
+// a free block in front.
+static Block* aligned_position(Block* block, size_t size, size_t alignment) {
+    uintptr_t payload = (uintptr_t)(block + 1);
+    uintptr_t aligned = payload;
+    if ((payload & (alignment - 1)) != 0) {
+        aligned = (payload + MIN_FREE_SPAN + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+    if (aligned + size > (uintptr_t)block_footer(block)) {
+        return NULL;
+    }
+    return (Block*)aligned - 1;
+}
+
+// Allocate a block of the (rounded) size whose payload is a multiple of
+// alignment from one arena, whose lock the caller holds. Any free block
+// that holds such a payload will do, so a block that happens to be
+// aligned is used without padding. The size classes up to the one where
+// every block fits are searched first-fit, ALIGNED_SEARCH_LIMIT blocks
+// each; above it, the first block of any non-empty class is taken.
+Block* arena_malloc_aligned(Arena* arena, size_t size, size_t alignment) {
+    int fits_all = size_class(size + alignment + MIN_FREE_SPAN) + 1;
+    Block* block = NULL;
+    Block* aligned = NULL;
+    
+    for (int c = size_class(size); c < fits_all && c < NUM_SIZE_CLASSES && aligned == NULL; c++) {
+        int tried = 0;
+        for (block = arena->free_lists[c]; block != NULL && tried < ALIGNED_SEARCH_LIMIT;
+             block = free_links(block)->next_free, tried++) {
+            aligned = aligned_position(block, size, alignment);
+            if (aligned != NULL) break;
+        }
+    }
+    if (aligned == NULL && fits_all < NUM_SIZE_CLASSES) {
+        unsigned long long larger = arena->free_list_map & ~((1ULL << fits_all) - 1);
+        if (larger == 0) {
+            return NULL;
+        }
+        block = arena->free_lists[lowest_set_bit(larger)];
+        aligned = aligned_position(block, size, alignment);
+    }
+    if (aligned == NULL) {
+        return NULL;
+    }
+    
+    // Split off the space in front of the aligned block as a free block.
+    // Its predecessor is in use, as the block was free and fully merged.
+    remove_free_block(arena, block);
+    if (aligned != block) {
+        char* end = (char*)block_footer(block);
+        set_block(block, (size_t)((char*)aligned - sizeof(BlockFooter) - (char*)(block + 1)), true);
+        insert_free_block(arena, block);
+        aligned->arena = block->arena;
+        set_block(aligned, (size_t)(end - (char*)(aligned + 1)), false);
+    }
+    if (aligned->size >= size + MIN_FREE_SPAN) {
+        split_block(arena, aligned, size);
+    }
+    set_block(aligned, aligned->size, false);
+    return aligned;
+}
+
+// Free a block into its arena, whose lock the caller holds: merge with
+// free neighbors, then file the result as one free block, or release its
+// chunk if that is now entirely free
+void arena_free(Arena* arena, Block* block) {
+    block = coalesce(arena, block);
+    if (block_spans_chunk(block)) {
+        release_chunk(arena, spanned_chunk(block), block);
+        return;
+    }
+    insert_free_block(arena, block);
+}
+
+// Find a free block of sufficient size. Small classes only hold blocks
+// large enough for the request, so the head of the list is taken; a
+// power-of-two class may also hold smaller blocks and is searched first-fit.
+// Failing that, the first non-empty larger class is found from the bitmap.
+Block* find_free_block(Arena* arena, size_t size) {
+    int class_index = size_class(size);
+    
+    Block* current = arena->free_lists[class_index];
+    while (current != NULL) {
+        if (current->size >= size) {
+            return current;
+        }
+        current = free_links(current)->next_free;
+    }
+    
+    if (class_index + 1 >= NUM_SIZE_CLASSES) {
+        return NULL;
+    }
+    unsigned long long larger = arena->free_list_map & ~((2ULL << class_index) - 1);
+    if (larger == 0) {
+        return NULL;  // No suitable block found
+    }
+    return arena->free_lists[lowest_set_bit(larger)];
+}
+
+// Split a block into two parts
+Block* split_block(Arena* arena, Block* block, size_t size) {
+    size_t remaining_size = block->size - size - sizeof(Block) - sizeof(BlockFooter);
+    
+    // Only split if remaining block is large enough
+    if (remaining_size >= MIN_BLOCK_SIZE) {
+        set_block(block, size, block->free);
+        Block* new_block = next_block(block);
+        new_block->arena = block->arena;
+        set_block(new_block, remaining_size, true);
+        insert_free_block(arena, new_block);
+    }
+    
+    return block;
+}
+
+// Mark a block free and merge it with its physical neighbors if they are
+// free. The neighbors are found through the boundary tags, so this takes
+// constant time however many blocks the heap holds. Merged neighbors are
+// taken off their free lists; the returned block is not on any list.
+Block* coalesce(Arena* arena, Block* block) {
+    size_t size = block->size;
+    
+    Block* next = next_block(block);
+    if (next->free) {
+        remove_free_block(arena, next);
+        size += sizeof(BlockFooter) + sizeof(Block) + next->size;
+    }
+    
+    BlockFooter* prev_footer = (BlockFooter*)block - 1;
+    if (prev_footer->free) {
+        Block* prev = prev_block(block);
+        remove_free_block(arena, prev);
+        size += prev->size + sizeof(BlockFooter) + sizeof(Block);
+        block = prev;
+    }
+    
+    set_block(block, size, true);
+    return block;
+}
+
+// Verify every arena, each under its own lock. Returns true if all are
+// consistent.
+bool check_heap(bool verbose) {
+    bool ok = true;
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        if (!check_arena(&arenas[i], i, verbose)) {
+            ok = false;
+        }
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return ok;
+}
+
+// Verify one arena: in every chunk the blocks tile the space from the
+// prologue to the epilogue, every footer matches its header and no two
+// free blocks are adjacent; the free lists hold exactly the free blocks,
+// each in its own size class. Prints each problem found (and a summary
+// if verbose); returns true if the arena is consistent.
+bool check_arena(Arena* arena, int index, bool verbose) {
+    bool ok = true;
+    int free_blocks = 0;
+    int listed_blocks = 0;
+    int chunk_count = 0;
+    size_t mapped_bytes = 0;
+    
+    for (Chunk* chunk = arena->chunks; chunk != NULL && ok; chunk = chunk->next) {
+        char* chunk_end = (char*)chunk + chunk->size;
+        chunk_count++;
+        mapped_bytes += chunk->size;
+        
+        BlockFooter* prologue = (BlockFooter*)((char*)chunk + CHUNK_HEADER_SIZE);
+        if (prologue->free || prologue->size != 0 ||
+            (chunk->next != NULL && chunk->next->prev != chunk)) {
+            printf("Heap check: chunk %p of arena %d has a bad prologue or link\n", (void*)chunk, index);
+            ok = false;
+        }
+        
+        Block* block = chunk_first_block(chunk);
+        bool prev_free = false;
+        while (ok && block->size != 0) {
+            if ((char*)next_block(block) + sizeof(Block) > chunk_end) {
+                printf("Heap check: block %p runs past the end of its chunk in arena %d\n", (void*)block, index);
+                ok = false;
+                break;
+            }
+            BlockFooter* footer = block_footer(block);
+            if (footer->size != block->size || footer->free != block->free) {
+                printf("Heap check: footer of block %p does not match its header\n", (void*)block);
+                ok = false;
+            }
+            if (block->size % SIZE_CLASS_STEP != 0 || block->size < MIN_BLOCK_SIZE) {
+                printf("Heap check: block %p has invalid size %zu\n", (void*)block, block->size);
+                ok = false;
+            }
+            if ((uintptr_t)(block + 1) % SIZE_CLASS_STEP != 0) {
+                printf("Heap check: block %p has a misaligned payload\n", (void*)block);
+                ok = false;
+            }
+            if (block->arena != index) {
+                printf("Heap check: block %p in arena %d claims arena %d\n", (void*)block, index, block->arena);
+                ok = false;
+            }
+            if (block->free && prev_free) {
+                printf("Heap check: free block %p was not merged with its predecessor\n", (void*)block);
+                ok = false;
+            }
+            if (block->free) {
+                free_blocks++;
+                if (block_spans_chunk(block) && chunk != arena->spare) {
+                    printf("Heap check: entirely free chunk %p of arena %d was not released\n", (void*)chunk, index);
+                    ok = false;
+                }
+            }
+            prev_free = block->free;
+            block = next_block(block);
+        }
+        if (ok && ((char*)block + sizeof(Block) != chunk_end || block->free)) {
+            printf("Heap check: bad epilogue at %p in arena %d\n", (void*)block, index);
+            ok = false;
+        }
+    }
+    if (ok && (chunk_count != arena->chunk_count || mapped_bytes != arena->mapped_bytes)) {
+        printf("Heap check: arena %d counts %d chunks of %zu bytes but has %d of %zu bytes\n",
+               index, arena->chunk_count, arena->mapped_bytes, chunk_count, mapped_bytes);
+        ok = false;
+    }
+    
+    for (int i = 0; i < NUM_SIZE_CLASSES && ok; i++) {
+        if (((arena->free_list_map >> i) & 1) != (arena->free_lists[i] != NULL)) {
+            printf("Heap check: arena %d bitmap bit %d does not match free list\n", index, i);
+            ok = false;
+        }
+        Block* prev = NULL;
+        for (Block* b = arena->free_lists[i]; b != NULL && ok; b = free_links(b)->next_free) {
+            if (!b->free || b->arena != index ||
+                size_class(b->size) != i || free_links(b)->prev_free != prev) {
+                printf("Heap check: bad entry %p in free list %d of arena %d\n", (void*)b, i, index);
+                ok = false;
+            }
+            if (++listed_blocks > free_blocks) {
+                printf("Heap check: free list %d of arena %d holds more blocks than are free\n", i, index);
+                ok = false;
+            }
+            prev = b;
+        }
+    }
+    if (ok && listed_blocks != free_blocks) {
+        printf("Heap check: arena %d has %d free blocks but %d on the free lists\n",
+               index, free_blocks, listed_blocks);
+        ok = false;
+    }
+    
+    if (verbose && ok) {
+        printf("Heap check passed: arena %d has %d chunk%s and %d free blocks, all listed in their size classes\n",
+               index, chunk_count, chunk_count == 1 ? "" : "s", free_blocks);
+    }
+    return ok;
+}
+
+// Create a pool for objects of the given size. The pool itself comes from
+// my_malloc; slabs are added as objects are needed.
+ObjectPool* object_pool_create(size_t object_size) {
+    if (object_size == 0 || object_size > SIZE_MAX / 2 / MIN_SLAB_OBJECTS) return NULL;
+    
+    ObjectPool* pool = my_malloc(sizeof(ObjectPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    
+    // Every object must be able to hold the free list link
+    if (object_size < sizeof(void*)) {
+        object_size = sizeof(void*);
+    }
+    pool->object_size = (object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    pool->objects_per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / pool->object_size;
+    if (pool->objects_per_slab < MIN_SLAB_OBJECTS) {
+        pool->objects_per_slab = MIN_SLAB_OBJECTS;
+    }
+    pool->free_objects = NULL;
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->live_objects = 0;
+    return pool;
+}
+
+// Allocate a slab from the main heap and thread all its objects onto the
+// free list, lowest address first
+static bool object_pool_grow(ObjectPool* pool) {
+    char* slab = my_malloc(SLAB_HEADER_SIZE + pool->objects_per_slab * pool->object_size);
+    if (slab == NULL) {
+        return false;
+    }
+    *(void**)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+    
+    char* objects = slab + SLAB_HEADER_SIZE;
+    for (size_t i = pool->objects_per_slab; i > 0; i--) {
+        void* object = objects + (i - 1) * pool->object_size;
+        *(void**)object = pool->free_objects;
+        pool->free_objects = object;
+    }
+    return true;
+}
+
+// Take an object off the free list, adding a slab if it is empty
+void* object_pool_alloc(ObjectPool* pool) {
+    if (pool->free_objects == NULL && !object_pool_grow(pool)) {
+        return NULL;
+    }
+    void* object = pool->free_objects;
+    pool->free_objects = *(void**)object;
+    pool->live_objects++;
+    return object;
+}
+
+#ifdef HEAP_DEBUG
+// Is the object one of the pool's slots? Walks the slabs, so it is only
+// used by debug builds.
+static bool object_pool_owns(ObjectPool* pool, void* object) {
+    size_t slab_bytes = pool->objects_per_slab * pool->object_size;
+    for (char* slab = pool->slabs; slab != NULL; slab = *(void**)slab) {
+        char* objects = slab + SLAB_HEADER_SIZE;
+        if ((char*)object >= objects && (char*)object < objects + slab_bytes) {
+            return ((char*)object - objects) % pool->object_size == 0;
+        }
+    }
+    return false;
+}
+#endif
+
+// Return an object to the pool by pushing it on the free list. Slabs stay
+// with the pool until it is destroyed.
+void object_pool_free(ObjectPool* pool, void* object) {
+    if (object == NULL) return;
+#ifdef HEAP_DEBUG
+    bool already_free = false;
+    for (void* o = pool->free_objects; o != NULL && !already_free; o = *(void**)o) {
+        already_free = o == object;
+    }
+    if (!object_pool_owns(pool, object) || already_free) {
+        printf("Error: %p is not a live object of this pool\n", object);
+        abort();
+    }
+#endif
+    
+    *(void**)object = pool->free_objects;
+    pool->free_objects = object;
+    pool->live_objects--;
+}
+
+// Free all slabs and the pool itself. Any objects still live become
+// invalid.
+void object_pool_destroy(ObjectPool* pool) {
+    if (pool == NULL) return;
+    char* slab = pool->slabs;
+    while (slab != NULL) {
+        char* next = *(void**)slab;
+        my_free(slab);
+        slab = next;
+    }
+    my_free(pool);
+}
+
+// Create an empty region. Its first block, of block_size bytes, is taken
+// from my_malloc on the first allocation.
+Region* region_create(size_t block_size) {
+    Region* region = my_malloc(sizeof(Region));
+    if (region == NULL) {
+        return NULL;
+    }
+    region->current = NULL;
+    region->top = NULL;
+    region->limit = NULL;
+    region->block_size = block_size > 0 ? block_size : 1;
+    return region;
+}
+
+// The current block is full: start a new one large enough for the request,
+// with the requested alignment, and allocate from it
+static void* region_alloc_slow(Region* region, size_t size, size_t align) {
+    if (size > SIZE_MAX / 4) return NULL;
+    size_t needed = size + align - 1;
+    size_t block_size = region->block_size > needed ? region->block_size : needed;
+    
+    RegionBlock* block = my_malloc(sizeof(RegionBlock) + block_size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->prev = region->current;
+    block->size = block_size;
+    region->current = block;
+    region->top = (char*)(block + 1);
+    region->limit = region->top + block_size;
+    if (region->block_size < REGION_MAX_BLOCK_SIZE) {
+        region->block_size *= 2;
+    }
+    
+    uintptr_t start = ((uintptr_t)region->top + align - 1) & ~(uintptr_t)(align - 1);
+    region->top = (char*)(start + size);
+    return (void*)start;
+}
+
+// Allocate size bytes aligned to align, which must be a power of two. The
+// common case rounds the top pointer up, compares and moves it forward.
+// Size 0 counts as 1, so every call gets its own address; otherwise a new
+// region, whose top and limit are NULL, would pass the check and hand out
+// NULL.
+void* region_alloc_aligned(Region* region, size_t size, size_t align) {
+    if (size == 0) size = 1;
+    uintptr_t start = ((uintptr_t)region->top + align - 1) & ~(uintptr_t)(align - 1);
+    if (start <= (uintptr_t)region->limit && size <= (uintptr_t)region->limit - start) {
+        region->top = (char*)(start + size);
+        return (void*)start;
+    }
+    return region_alloc_slow(region, size, align);
+}
+
+// Allocate size bytes with the same alignment as my_malloc
+void* region_alloc(Region* region, size_t size) {
+    return region_alloc_aligned(region, size, REGION_DEFAULT_ALIGN);
+}
+
+// Save the current allocation position. Marks nest: releasing to a mark
+// also discards every mark taken after it.
+RegionMark region_mark(Region* region) {
+    RegionMark mark = {region->current, region->top};
+    return mark;
+}
+
+// Free everything allocated since the mark was taken. Blocks obtained
+// after the mark go back to my_malloc.
+void region_release(Region* region, RegionMark mark) {
+#ifdef HEAP_DEBUG
+    RegionBlock* b = region->current;
+    while (b != mark.block && b != NULL) {
+        b = b->prev;
+    }
+    if (b != mark.block || (mark.block == region->current && mark.top > region->top)) {
+        printf("Error: region mark %p is no longer valid\n", (void*)mark.top);
+        abort();
+    }
+#endif
+    while (region->current != mark.block) {
+        RegionBlock* prev = region->current->prev;
+        my_free(region->current);
+        region->current = prev;
+    }
+    region->top = mark.top;
+    region->limit = mark.block != NULL ? (char*)(mark.block + 1) + mark.block->size : NULL;
+}
+
+// Free everything in the region in one step. The newest block, which is
+// the largest, is kept for reuse and the older ones go back to my_malloc,
+// so a region reset after every request settles on a single block.
+void region_reset(Region* region) {
+    RegionBlock* block = region->current;
+    if (block == NULL) {
+        return;
+    }
+    while (block->prev != NULL) {
+        RegionBlock* prev = block->prev->prev;
+        my_free(block->prev);
+        block->prev = prev;
+    }
+    region->top = (char*)(block + 1);
+}
+
+// Free every block and the region itself
+void region_destroy(Region* region) {
+    if (region == NULL) return;
+    region_release(region, (RegionMark){NULL, NULL});
+    my_free(region);
+}
+
+// Print memory status
+void print_memory_status() {
+    printf("\n===== Memory Pool Status =====\n");
+    
+    for (int a = 0; a < NUM_ARENAS; a++) {
+        Arena* arena = &arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        
+        printf("\nArena %d%s: %d chunk%s, %zu bytes mapped\n", a,
+               arena == thread_cache.arena ? " (this thread)" : "",
+               arena->chunk_count, arena->chunk_count == 1 ? "" : "s", arena->mapped_bytes);
+        
+        int block_count = 0;
+        size_t total_free = 0;
+        size_t total_used = 0;
+        
+        for (Chunk* chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+            printf("Chunk %p%s\n", (void*)chunk, chunk == arena->spare ? " (spare)" : "");
+            printf("Address\t\tSize\tFree\n");
+            printf("--------------------------------\n");
+            
+            Block* current = chunk_first_block(chunk);
+            while (current->size != 0) {
+                // Blocks in this thread's cache are free to the program but
+                // still allocated in the arena
+                bool cached = !current->free && in_thread_cache(current);
+                printf("%p\t%zu\t%s\n",
+                       (void*)current,
+                       current->size,
+                       current->free ? "Yes" : cached ? "Cached" : "No");
+                
+                if (current->free) {
+                    total_free += current->size;
+                } else {
+                    total_used += current->size;
+                }
+                
+                block_count++;
+                current = next_block(current);
+            }
+        }
+        
+        printf("\nTotal blocks: %d\n", block_count);
+        printf("Total free memory: %zu bytes\n", total_free);
+        printf("Total used memory: %zu bytes\n", total_used);
+        
+        printf("Free lists by size class:\n");
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            int count = 0;
+            for (Block* b = arena->free_lists[i]; b != NULL; b = free_links(b)->next_free) {
+                count++;
+            }
+            if (count > 0) {
+                printf("  Class %2d: %d block%s\n", i, count, count == 1 ? "" : "s");
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    
+    printf("\nDirect mappings: %d (%zu bytes)\n", atomic_load(&direct_mappings), atomic_load(&direct_mapped_bytes));
+}
+
+// Bytes currently mapped for the whole heap: all arena chunks plus the
+// direct mappings
+static size_t heap_mapped_bytes() {
+    return atomic_load(&heap_mapped_total);
+}
+
+// Smallest block size in a size class
+static size_t size_class_floor(int class_index) {
+    int small_classes = SMALL_CLASS_LIMIT / SIZE_CLASS_STEP;
+    if (class_index < small_classes) {
+        return (size_t)class_index * SIZE_CLASS_STEP;
+    }
+    return (size_t)SMALL_CLASS_LIMIT << (class_index - small_classes);
+}
+
+// Block sizes of a size class, for tables: one size for the small classes,
+// a range above them
+static void size_class_label(int class_index, char* label, size_t length) {
+    size_t low = size_class_floor(class_index);
+    if (low < SMALL_CLASS_LIMIT) {
+        snprintf(label, length, "%zu", low);
+    } else if (class_index == NUM_SIZE_CLASSES - 1) {
+        snprintf(label, length, "%zu and up", low);
+    } else {
+        snprintf(label, length, "%zu-%zu", low, size_class_floor(class_index + 1) - 1);
+    }
+}
+
+// Free blocks of all arenas by size class, and how much of the free memory
+// lies outside the largest free block (external fragmentation)
+static void print_free_list_summary() {
+    size_t counts[NUM_SIZE_CLASSES] = {0};
+    size_t bytes[NUM_SIZE_CLASSES] = {0};
+    size_t total = 0;
+    size_t largest = 0;
+    
+    for (int a = 0; a < NUM_ARENAS; a++) {
+        pthread_mutex_lock(&arenas[a].lock);
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            for (Block* b = arenas[a].free_lists[i]; b != NULL; b = free_links(b)->next_free) {
+                counts[i]++;
+                bytes[i] += b->size;
+                if (b->size > largest) largest = b->size;
+            }
+        }
+        pthread_mutex_unlock(&arenas[a].lock);
+    }
+    
+    printf("Block size           Free blocks        Bytes\n");
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        if (counts[i] == 0) continue;
+        char label[48];
+        size_class_label(i, label, sizeof(label));
+        printf("%-20s %11zu %12zu\n", label, counts[i], bytes[i]);
+        total += bytes[i];
+    }
+    
+    if (total == 0) {
+        printf("No free blocks\n");
+        return;
+    }
+    printf("Free memory: %zu bytes, largest free block: %zu bytes\n", total, largest);
+    printf("External fragmentation: %.1f%% of the free memory is outside the largest block\n",
+           100.0 * (double)(total - largest) / (double)total);
+}
+
+// printf to a file descriptor through a buffer on the stack. The statistics
+// and the heap profile are written this way, as stdio may call malloc,
+// which must not happen inside the shim's allocation functions.
+static void fd_printf(int fd, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > (int)sizeof(line) - 1) length = (int)sizeof(line) - 1;
+    if (length > 0 && write(fd, line, (size_t)length) < 0) {
+        return;
+    }
+}
+
+// Write the allocation counters of all threads, running and exited: calls
+// per size class, bytes allocated, freed and live, the peak, and the time
+// spent in the allocator
+void write_allocator_stats(int fd) {
+    ThreadStats total;
+    memset(&total, 0, sizeof(total));
+    int threads = 0;
+    
+    pthread_mutex_lock(&stats_lock);
+    merge_stats(&total, &retired_stats);
+    for (ThreadCache* cache = live_caches; cache != NULL; cache = cache->next) {
+        merge_stats(&total, &cache->stats);
+        threads++;
+    }
+    int retired = retired_threads;
+    pthread_mutex_unlock(&stats_lock);
+    
+    fd_printf(fd, "\n===== Allocator Statistics =====\n");
+    fd_printf(fd, "Threads: %d running, %d exited\n", threads, retired);
+    fd_printf(fd, "Block size           Allocations        Frees         Live\n");
+    unsigned long long allocations = 0;
+    unsigned long long frees = 0;
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        unsigned long long allocated = atomic_load(&total.allocations[i]);
+        unsigned long long freed = atomic_load(&total.frees[i]);
+        if (allocated == 0 && freed == 0) continue;
+        char label[48];
+        size_class_label(i, label, sizeof(label));
+        fd_printf(fd, "%-20s %11llu %12llu %12lld\n", label, allocated, freed, (long long)(allocated - freed));
+        allocations += allocated;
+        frees += freed;
+    }
+    fd_printf(fd, "%-20s %11llu %12llu %12lld\n", "All", allocations, frees, (long long)(allocations - frees));
+    
+    unsigned long long allocated_bytes = atomic_load(&total.bytes_allocated);
+    unsigned long long freed_bytes = atomic_load(&total.bytes_freed);
+    unsigned long long calls = atomic_load(&total.calls);
+    unsigned long long nanoseconds = atomic_load(&total.nanoseconds);
+    fd_printf(fd, "Bytes allocated: %llu, freed: %llu, live: %lld\n",
+              allocated_bytes, freed_bytes, (long long)(allocated_bytes - freed_bytes));
+    long long peak = atomic_load(&peak_live_bytes);
+    if (peak < (long long)(allocated_bytes - freed_bytes)) peak = (long long)(allocated_bytes - freed_bytes);
+    fd_printf(fd, "Peak live bytes: about %lld (threads publish every %d KB)\n", peak, STATS_PUBLISH_BYTES / 1024);
+    fd_printf(fd, "Time in the allocator: about %.1f ms in %llu calls (%.0f ns per call)\n",
+              nanoseconds / 1e6, calls, calls > 0 ? (double)nanoseconds / calls : 0.0);
+}
+
+// Start sampling one allocation every interval bytes, discarding earlier
+// samples
+void heap_profile_start(size_t interval) {
+    void* frame;
+    backtrace(&frame, 1);  // Loads the unwinder now, as its first use may allocate
+    
+    pthread_mutex_lock(&profile_lock);
+    memset(profile_stack_table, 0, sizeof(profile_stack_table));
+    memset(profile_samples, 0, sizeof(profile_samples));
+    profile_stack_count = 0;
+    profile_sample_count = 0;
+    profile_dropped = 0;
+    profile_sampling_bytes = interval;
+    atomic_store(&profile_interval, interval);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Stop sampling. Samples already taken stay, and are still dropped as
+// their blocks are freed, so a later dump shows what remains of them.
+void heap_profile_stop() {
+    atomic_store(&profile_interval, 0);
+}
+
+// Write the heap profile: the call stacks holding the most sampled live
+// memory, each with its estimated live and total bytes and its symbols.
+// backtrace_symbols_fd writes straight to the file and doesn't allocate.
+void heap_profile_dump(int fd) {
+    int order[PROFILE_DUMP_STACKS];
+    int shown = 0;
+    
+    pthread_mutex_lock(&profile_lock);
+    if (profile_sampling_bytes == 0) {
+        pthread_mutex_unlock(&profile_lock);
+        fd_printf(fd, "\nHeap profiler not started\n");
+        return;
+    }
+    
+    size_t live = 0;
+    size_t total = 0;
+    for (int i = 0; i < profile_stack_count; i++) {
+        live += profile_stacks[i].live_bytes;
+        total += profile_stacks[i].total_bytes;
+    }
+    fd_printf(fd, "\n===== Heap Profile =====\n");
+    fd_printf(fd, "Sampling %s, one sample per %zu bytes allocated\n",
+              atomic_load(&profile_interval) != 0 ? "running" : "stopped", profile_sampling_bytes);
+    fd_printf(fd, "Live: about %zu bytes in %zu samples; allocated since start: about %zu bytes\n",
+              live, profile_sample_count, total);
+    if (profile_dropped > 0) {
+        fd_printf(fd, "Samples dropped because the tables were full: %zu\n", profile_dropped);
+    }
+    
+    // Pick the stacks with the most live memory, largest first
+    while (shown < PROFILE_DUMP_STACKS) {
+        int best = -1;
+        for (int i = 0; i < profile_stack_count; i++) {
+            bool taken = false;
+            for (int j = 0; j < shown; j++) {
+                if (order[j] == i) taken = true;
+            }
+            if (!taken && profile_stacks[i].live_bytes > 0 &&
+                (best < 0 || profile_stacks[i].live_bytes > profile_stacks[best].live_bytes)) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        order[shown++] = best;
+    }
+    
+    for (int i = 0; i < shown; i++) {
+        ProfileStack* stack = &profile_stacks[order[i]];
+        fd_printf(fd, "\n#%d: about %zu bytes live in %zu samples, %zu bytes allocated in total\n",
+                  i + 1, stack->live_bytes, stack->live_samples, stack->total_bytes);
+        backtrace_symbols_fd(stack->frames, stack->depth, fd);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Monotonic wall-clock time in seconds
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Small xorshift generator, so benchmark runs are repeatable
+static unsigned int bench_random(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Request size for the benchmark: mostly small objects, some medium ones
+// and an occasional large buffer, like typical program traffic
+static size_t bench_size(unsigned int* state) {
+    unsigned int r = bench_random(state);
+    unsigned int kind = r % 100;
+    if (kind < 80) return 8 + (r >> 8) % 120;
+    if (kind < 97) return 128 + (r >> 8) % 384;
+    return 512 + (r >> 8) % 1536;
+}
+
+// Random mixed-size allocations and frees over BENCH_SLOTS live pointers,
+// timed for my_malloc/my_free and for the system malloc/free
+void run_benchmark() {
+    void* slots[BENCH_SLOTS];
+    const char* names[2] = {"my_malloc/my_free", "malloc/free"};
+    
+    printf("Running %d mixed-size operations...\n", BENCH_OPERATIONS);
+    for (int allocator = 0; allocator < 2; allocator++) {
+        unsigned int state = 12345;
+        long failures = 0;
+        for (int i = 0; i < BENCH_SLOTS; i++) {
+            slots[i] = NULL;
+        }
+        
+        double start = now_seconds();
+        for (long op = 0; op < BENCH_OPERATIONS; op++) {
+            int slot = bench_random(&state) % BENCH_SLOTS;
+            if (slots[slot] != NULL) {
+                if (allocator == 0) my_free(slots[slot]); else free(slots[slot]);
+                slots[slot] = NULL;
+            } else {
+                size_t size = bench_size(&state);
+                slots[slot] = allocator == 0 ? my_malloc(size) : malloc(size);
+                if (slots[slot] == NULL) failures++;
+            }
+        }
+        double seconds = now_seconds() - start;
+        
+        for (int i = 0; i < BENCH_SLOTS; i++) {
+            if (allocator == 0) my_free(slots[i]); else free(slots[i]);
+        }
+        printf("%-18s %.3f s, %.1f M ops/s, %ld failed allocations\n", names[allocator], seconds,
+               seconds > 0 ? BENCH_OPERATIONS / seconds / 1e6 : 0.0, failures);
+    }
+}
+
+// One stress thread: random allocations and frees over its own slots.
+// One free in eight instead swaps the pointer into a shared exchange slot
+// and frees whatever another thread left there, so blocks are regularly
+// freed by a thread other than the one that allocated them.
+static void* stress_worker(void* arg) {
+    StressThread* t = (StressThread*)arg;
+    void* slots[STRESS_SLOTS] = {NULL};
+    unsigned int state = 12345 + 7919 * t->id;
+    
+    for (long op = 0; op < STRESS_OPERATIONS; op++) {
+        unsigned int r = bench_random(&state);
+        int slot = r % STRESS_SLOTS;
+        void* victim = NULL;
+        
+        if (slots[slot] == NULL) {
+            size_t size = bench_size(&state);
+            slots[slot] = t->use_system ? malloc(size) : my_malloc(size);
+            if (slots[slot] == NULL) t->failures++;
+            continue;
+        }
+        if ((r >> 4) % 8 == 0) {
+            victim = atomic_exchange(&stress_exchange[(r >> 16) % STRESS_EXCHANGE_SLOTS], slots[slot]);
+        } else {
+            victim = slots[slot];
+        }
+        slots[slot] = NULL;
+        if (t->use_system) free(victim); else my_free(victim);
+    }
+    
+    for (int i = 0; i < STRESS_SLOTS; i++) {
+        if (t->use_system) free(slots[i]); else my_free(slots[i]);
+    }
+    return NULL;
+}
+
+// Multi-threaded stress benchmark: 1, 2, 4 ... STRESS_MAX_THREADS threads
+// each run STRESS_OPERATIONS operations; total throughput is compared with
+// the system allocator
+void run_stress_benchmark() {
+    StressThread threads[STRESS_MAX_THREADS];
+    
+    printf("Threads  my_malloc/my_free   malloc/free       Failed\n");
+    for (int count = 1; count <= STRESS_MAX_THREADS; count *= 2) {
+        double rate[2];
+        long failures = 0;
+        
+        for (int allocator = 0; allocator < 2; allocator++) {
+            double start = now_seconds();
+            int started = 0;
+            for (int i = 0; i < count; i++) {
+                threads[i].id = i;
+                threads[i].use_system = allocator == 1;
+                threads[i].failures = 0;
+                if (pthread_create(&threads[i].thread, NULL, stress_worker, &threads[i]) != 0) {
+                    break;
+                }
+                started++;
+            }
+            for (int i = 0; i < started; i++) {
+                pthread_join(threads[i].thread, NULL);
+                failures += threads[i].failures;
+            }
+            double seconds = now_seconds() - start;
+            
+            // Free the pointers still waiting in the exchange
+            for (int i = 0; i < STRESS_EXCHANGE_SLOTS; i++) {
+                void* ptr = atomic_exchange(&stress_exchange[i], NULL);
+                if (allocator == 1) free(ptr); else my_free(ptr);
+            }
+            rate[allocator] = seconds > 0 ? (double)started * STRESS_OPERATIONS / seconds / 1e6 : 0.0;
+        }
+        printf("%7d  %11.1f M ops/s  %9.1f M ops/s  %6ld\n", count, rate[0], rate[1], failures);
+    }
+}
+
+// Fill the heap with LARGE_HEAP_BYTES of live data in mixed sizes, from
+// small objects to multi-megabyte buffers, check that every block kept
+// its contents, then free everything and show the mappings going back to
+// the OS. The pointer table itself grows through my_malloc.
+void run_large_heap_test() {
+    size_t capacity = 1024;
+    size_t count = 0;
+    size_t live = 0;
+    unsigned int state = 4242;
+    void** blocks = my_malloc(capacity * sizeof(void*));
+    if (blocks == NULL) {
+        printf("Failed to allocate the block table\n");
+        return;
+    }
+    
+    printf("Allocating %lu MB of live data...\n", LARGE_HEAP_BYTES / (1024 * 1024));
+    double start = now_seconds();
+    while (live < LARGE_HEAP_BYTES) {
+        unsigned int r = bench_random(&state);
+        size_t size;
+        if (r % 100 < 90) {
+            size = 16 + (r >> 8) % 4080;
+        } else if (r % 100 < 99) {
+            size = 4096 + (r >> 8) % (60 * 1024);
+        } else {
+            size = 256 * 1024 + (r >> 8) % (2 * 1024 * 1024);
+        }
+        
+        if (count == capacity) {
+            void** larger = my_malloc(2 * capacity * sizeof(void*));
+            if (larger == NULL) break;
+            memcpy(larger, blocks, capacity * sizeof(void*));
+            my_free(blocks);
+            blocks = larger;
+            capacity *= 2;
+        }
+        
+        // Each block starts with its size and is filled with a pattern
+        // byte, so its contents can be checked before it is freed
+        unsigned char* ptr = my_malloc(size);
+        if (ptr == NULL) break;
+        memset(ptr, (unsigned char)count, size);
+        memcpy(ptr, &size, sizeof(size));
+        blocks[count++] = ptr;
+        live += size;
+    }
+    double seconds = now_seconds() - start;
+    
+    printf("Allocated %zu MB in %zu blocks in %.3f s\n", live / (1024 * 1024), count, seconds);
+    printf("Heap mapped: %zu MB, %d direct mappings\n",
+           heap_mapped_bytes() / (1024 * 1024), atomic_load(&direct_mappings));
+    if (live < LARGE_HEAP_BYTES) {
+        printf("Allocation failed before reaching the target\n");
+    }
+    check_heap(false);
+    
+    size_t corrupted = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* ptr = blocks[i];
+        size_t size;
+        memcpy(&size, ptr, sizeof(size));
+        if (ptr[sizeof(size)] != (unsigned char)i || ptr[size - 1] != (unsigned char)i) {
+            corrupted++;
+        }
+    }
+    printf("Blocks with corrupted contents: %zu\n", corrupted);
+    
+    // Free every other block first, then the rest, so the frees build up
+    // fragmentation before coalescing empties the chunks
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = pass; i < count; i += 2) {
+            my_free(blocks[i]);
+        }
+    }
+    my_free(blocks);
+    release_thread_cache(&thread_cache);
+    printf("After freeing everything, heap mapped: %zu MB\n", heap_mapped_bytes() / (1024 * 1024));
+}
+
+// Random allocations and frees of same-size objects over POOL_BENCH_SLOTS
+// live pointers, timed for an object pool and for my_malloc/my_free, with
+// the memory each object takes in either
+void run_object_pool_benchmark() {
+    void* slots[POOL_BENCH_SLOTS];
+    const char* names[2] = {"object pool", "my_malloc/my_free"};
+    ObjectPool* pool = object_pool_create(POOL_BENCH_OBJECT_SIZE);
+    if (pool == NULL) {
+        printf("Failed to create the object pool\n");
+        return;
+    }
+    
+    printf("Running %d operations on %d-byte objects...\n", BENCH_OPERATIONS, POOL_BENCH_OBJECT_SIZE);
+    for (int allocator = 0; allocator < 2; allocator++) {
+        unsigned int state = 12345;
+        long failures = 0;
+        for (int i = 0; i < POOL_BENCH_SLOTS; i++) {
+            slots[i] = NULL;
+        }
+        
+        double start = now_seconds();
+        for (long op = 0; op < BENCH_OPERATIONS; op++) {
+            int slot = bench_random(&state) % POOL_BENCH_SLOTS;
+            if (slots[slot] != NULL) {
+                if (allocator == 0) object_pool_free(pool, slots[slot]); else my_free(slots[slot]);
+                slots[slot] = NULL;
+            } else {
+                slots[slot] = allocator == 0 ? object_pool_alloc(pool) : my_malloc(POOL_BENCH_OBJECT_SIZE);
+                if (slots[slot] == NULL) failures++;
+            }
+        }
+        double seconds = now_seconds() - start;
+        
+        for (int i = 0; i < POOL_BENCH_SLOTS; i++) {
+            if (allocator == 0) object_pool_free(pool, slots[i]); else my_free(slots[i]);
+        }
+        printf("%-18s %.3f s, %.1f M ops/s, %ld failed allocations\n", names[allocator], seconds,
+               seconds > 0 ? BENCH_OPERATIONS / seconds / 1e6 : 0.0, failures);
+    }
+    
+    // A heap block adds a header and a footer to the rounded-up payload
+    size_t block_bytes = ((POOL_BENCH_OBJECT_SIZE + SIZE_CLASS_STEP - 1) & ~(size_t)(SIZE_CLASS_STEP - 1)) +
+                         sizeof(Block) + sizeof(BlockFooter);
+    printf("Memory per object: %zu bytes in the pool, %zu bytes as a heap block\n", pool->object_size, block_bytes);
+    printf("Pool used %zu slabs of %zu objects\n", pool->slab_count, pool->objects_per_slab);
+    object_pool_destroy(pool);
+}
+
+// Simulated requests, each making up to REGION_BENCH_MAX_OBJECTS small
+// allocations, half of them temporaries in a nested scope, and then
+// dropping all its memory. Timed with a region (released to a mark and
+// reset) and with my_malloc/my_free (every allocation freed one by one).
+void run_region_benchmark() {
+    void* objects[REGION_BENCH_MAX_OBJECTS];
+    const char* names[2] = {"region", "my_malloc/my_free"};
+    Region* region = region_create(4096);
+    if (region == NULL) {
+        printf("Failed to create the region\n");
+        return;
+    }
+    
+    printf("Running %d requests...\n", REGION_BENCH_REQUESTS);
+    for (int allocator = 0; allocator < 2; allocator++) {
+        unsigned int state = 12345;
+        long allocations = 0;
+        long failures = 0;
+        
+        double start = now_seconds();
+        for (int request = 0; request < REGION_BENCH_REQUESTS; request++) {
+            int count = 1 + bench_random(&state) % REGION_BENCH_MAX_OBJECTS;
+            int kept = 0;
+            
+            // Long-lived allocations for the whole request, then a scope
+            // of temporaries that is dropped before the request ends
+            for (int phase = 0; phase < 2; phase++) {
+                RegionMark mark = region_mark(region);
+                int first = kept;
+                for (int i = phase == 0 ? 0 : count / 2; i < (phase == 0 ? count / 2 : count); i++) {
+                    size_t size = 8 + bench_random(&state) % 248;
+                    void* ptr = allocator == 0 ? region_alloc(region, size) : my_malloc(size);
+                    if (ptr == NULL) {
+                        failures++;
+                        continue;
+                    }
+                    ((char*)ptr)[0] = (char)i;
+                    objects[kept++] = ptr;
+                    allocations++;
+                }
+                if (phase == 1) {
+                    if (allocator == 0) {
+                        region_release(region, mark);
+                    } else {
+                        for (int i = first; i < kept; i++) my_free(objects[i]);
+                    }
+                    kept = first;
+                }
+            }
+            
+            if (allocator == 0) {
+                region_reset(region);
+            } else {
+                for (int i = 0; i < kept; i++) my_free(objects[i]);
+            }
+        }
+        double seconds = now_seconds() - start;
+        
+        printf("%-18s %.3f s, %.1f M allocations/s, %ld failed allocations\n", names[allocator], seconds,
+               seconds > 0 ? allocations / seconds / 1e6 : 0.0, failures);
+    }
+    region_destroy(region);
+}
+
+// Hash of a recorded pointer: blocks are 16-byte aligned, so the low bits
+// carry no information
+static size_t trace_map_index(TracePointerMap* map, uintptr_t key) {
+    unsigned long long h = (unsigned long long)(key >> 4) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 32)) & (map->capacity - 1);
+}
+
+// Remove a recorded pointer, returning its slot or -1 if it was not live
+static int trace_map_remove(TracePointerMap* map, uintptr_t key) {
+    for (size_t i = trace_map_index(map, key); map->keys[i] != 0; i = (i + 1) & (map->capacity - 1)) {
+        if (map->keys[i] == key) {
+            map->keys[i] = 1;
+            return map->slots[i];
+        }
+    }
+    return -1;
+}
+
+// Add a recorded pointer that is not in the map, rebuilding the table when
+// half of it is in use
+static bool trace_map_insert(TracePointerMap* map, uintptr_t key, int slot) {
+    if (2 * (map->used + 1) > map->capacity) {
+        TracePointerMap larger;
+        larger.capacity = map->capacity * 2;
+        larger.used = 0;
+        larger.keys = calloc(larger.capacity, sizeof(uintptr_t));
+        larger.slots = malloc(larger.capacity * sizeof(int));
+        if (larger.keys == NULL || larger.slots == NULL) {
+            free(larger.keys);
+            free(larger.slots);
+            return false;
+        }
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i] > 1) {
+                trace_map_insert(&larger, map->keys[i], map->slots[i]);
+            }
+        }
+        free(map->keys);
+        free(map->slots);
+        *map = larger;
+    }
+    
+    size_t i = trace_map_index(map, key);
+    while (map->keys[i] > 1) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    if (map->keys[i] == 0) {
+        map->used++;
+    }
+    map->keys[i] = key;
+    map->slots[i] = slot;
+    return true;
+}
+
+// Append an operation to a trace being loaded
+static bool trace_push(Trace* trace, size_t* capacity, TraceOp op) {
+    if (trace->count == *capacity) {
+        size_t larger = *capacity > 0 ? *capacity * 2 : 4096;
+        TraceOp* ops = realloc(trace->ops, larger * sizeof(TraceOp));
+        if (ops == NULL) return false;
+        trace->ops = ops;
+        *capacity = larger;
+    }
+    trace->ops[trace->count++] = op;
+    return true;
+}
+
+// Load an allocation trace. Each line is one operation, with pointers in
+// hex as the program saw them:
+//   a <ptr> <size>              malloc or calloc
+//   m <ptr> <alignment> <size>  aligned allocation
+//   r <old> <new> <size>        realloc of a live pointer
+//   f <ptr>                     free
+// Lines starting with '#' are comments. A recorded pointer names an object
+// from its allocation to its free; each object gets a slot, and slots are
+// reused once freed. Frees of pointers allocated before recording started
+// are skipped. The loader's own tables use the system allocator, so only
+// the replayed objects occupy the heap being measured.
+bool load_trace(const char* path, Trace* trace) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    
+    trace->ops = NULL;
+    trace->count = 0;
+    trace->slot_count = 0;
+    trace->skipped = 0;
+    size_t capacity = 0;
+    int* free_slots = NULL;  // Slots of freed objects, for reuse
+    int free_slot_count = 0;
+    TracePointerMap map = {calloc(1024, sizeof(uintptr_t)), malloc(1024 * sizeof(int)), 1024, 0};
+    bool ok = map.keys != NULL && map.slots != NULL;
+    char line[256];
+    
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long ptr = 0, old = 0;
+        size_t size = 0, alignment = 0;
+        bool valid;
+        switch (line[0]) {
+            case 'a': valid = sscanf(line + 1, "%llx %zu", &ptr, &size) == 2; break;
+            case 'm': valid = sscanf(line + 1, "%llx %zu %zu", &ptr, &alignment, &size) == 3 &&
+                              alignment > 0 && (alignment & (alignment - 1)) == 0; break;
+            case 'r': valid = sscanf(line + 1, "%llx %llx %zu", &old, &ptr, &size) == 3; break;
+            case 'f': valid = sscanf(line + 1, "%llx", &ptr) == 1; break;
+            case '#': case '\n': case '\0': continue;
+            default: valid = false;
+        }
+        if (!valid || ptr <= 1) {
+            trace->skipped++;
+            continue;
+        }
+        
+        TraceOp op = {line[0], -1, size > 0 ? size : 1, alignment};
+        if (op.type == 'f') {
+            op.slot = trace_map_remove(&map, (uintptr_t)ptr);
+            if (op.slot < 0) {
+                trace->skipped++;
+                continue;
+            }
+            free_slots[free_slot_count++] = op.slot;
+            ok = trace_push(trace, &capacity, op);
+            continue;
+        }
+        
+        // A resized object keeps its slot. Resizing a pointer allocated
+        // before recording started is replayed as an allocation.
+        if (op.type == 'r') {
+            op.slot = trace_map_remove(&map, (uintptr_t)old);
+            if (op.slot < 0) op.type = 'a';
+        }
+        
+        // A pointer handed out again while still live means its free was
+        // not recorded; free the old object first
+        int stale = trace_map_remove(&map, (uintptr_t)ptr);
+        if (stale >= 0) {
+            free_slots[free_slot_count++] = stale;
+            ok = trace_push(trace, &capacity, (TraceOp){'f', stale, 0, 0});
+        }
+        
+        if (op.slot < 0) {
+            if (free_slot_count > 0) {
+                op.slot = free_slots[--free_slot_count];
+            } else {
+                // Grow the free slot stack with the slots, so every slot
+                // always fits on it
+                int* larger = realloc(free_slots, (trace->slot_count + 1) * sizeof(int));
+                if (larger == NULL) {
+                    ok = false;
+                    break;
+                }
+                free_slots = larger;
+                op.slot = trace->slot_count++;
+            }
+        }
+        ok = ok && trace_map_insert(&map, (uintptr_t)ptr, op.slot) && trace_push(trace, &capacity, op);
+    }
+    
+    fclose(file);
+    free(map.keys);
+    free(map.slots);
+    free(free_slots);
+    if (!ok) {
+        free(trace->ops);
+        trace->ops = NULL;
+    }
+    return ok;
+}
+
+// Write a synthetic trace imitating a long-running program: mostly small
+// objects with random lifetimes, growing buffers resized with realloc, a
+// few cache-line aligned and large allocations, and a periodic cleanup that
+// frees most objects while the rest survive. Pointers are made up, but
+// unique while live, as in a recorded trace.
+bool write_sample_trace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    
+    unsigned long long live[SAMPLE_TRACE_SLOTS] = {0};
+    size_t sizes[SAMPLE_TRACE_SLOTS] = {0};
+    unsigned long long next_address = 0x10000;
+    unsigned int state = 2024;
+    
+    fprintf(file, "# sample allocation trace\n");
+    for (long op = 0; op < SAMPLE_TRACE_OPERATIONS; op++) {
+        unsigned int r = bench_random(&state);
+        int slot = r % SAMPLE_TRACE_SLOTS;
+        
+        if (op % (SAMPLE_TRACE_OPERATIONS / 5) == 0) {
+            for (int i = 0; i < SAMPLE_TRACE_SLOTS; i++) {
+                if (live[i] != 0 && bench_random(&state) % 4 != 0) {
+                    fprintf(file, "f %llx\n", live[i]);
+                    live[i] = 0;
+                }
+            }
+        }
+        
+        if (live[slot] == 0) {
+            unsigned int kind = (r >> 12) % 100;
+            size_t size = kind < 1 ? 64 * 1024 + (r >> 8) % (256 * 1024) : bench_size(&state);
+            live[slot] = next_address;
+            sizes[slot] = size;
+            if (kind >= 1 && kind < 3) {
+                fprintf(file, "m %llx 64 %zu\n", live[slot], size);
+            } else {
+                fprintf(file, "a %llx %zu\n", live[slot], size);
+            }
+        } else if ((r >> 12) % 8 == 0 && sizes[slot] < 64 * 1024) {
+            sizes[slot] = sizes[slot] * 2;
+            fprintf(file, "r %llx %llx %zu\n", live[slot], next_address, sizes[slot]);
+            live[slot] = next_address;
+        } else {
+            fprintf(file, "f %llx\n", live[slot]);
+            live[slot] = 0;
+        }
+        next_address += 16;
+    }
+    return fclose(file) == 0;
+}
+
+// Run the first `end` operations of a trace on my_malloc and friends or
+// on the system allocator. objects and sizes hold one entry per slot and
+// start zeroed; the objects still live at the end are left allocated.
+static void replay_trace(Trace* trace, size_t end, bool use_system, void** objects, size_t* sizes,
+                         ReplayResult* result) {
+    size_t live = 0;
+    result->peak_live = 0;
+    result->peak_op = 0;
+    result->failures = 0;
+    
+    double start = now_seconds();
+    for (size_t i = 0; i < end; i++) {
+        TraceOp* op = &trace->ops[i];
+        if (op->type == 'f') {
+            if (use_system) free(objects[op->slot]); else my_free(objects[op->slot]);
+            live -= sizes[op->slot];
+            objects[op->slot] = NULL;
+            sizes[op->slot] = 0;
+            continue;
+        }
+        
+        void* ptr;
+        if (op->type == 'r' && objects[op->slot] != NULL) {
+            ptr = use_system ? realloc(objects[op->slot], op->size) : my_realloc(objects[op->slot], op->size);
+        } else if (op->type == 'm') {
+            if (!use_system) {
+                ptr = my_memalign(op->alignment, op->size);
+            } else if (posix_memalign(&ptr, op->alignment < sizeof(void*) ? sizeof(void*) : op->alignment, op->size) != 0) {
+                ptr = NULL;
+            }
+        } else {
+            ptr = use_system ? malloc(op->size) : my_malloc(op->size);
+        }
+        if (ptr == NULL) {
+            result->failures++;
+            continue;
+        }
+        
+        live += op->size - sizes[op->slot];
+        objects[op->slot] = ptr;
+        sizes[op->slot] = op->size;
+        if (live > result->peak_live) {
+            result->peak_live = live;
+            result->peak_op = i + 1;
+        }
+    }
+    result->seconds = now_seconds() - start;
+}
+
+// Free every object a replay left allocated
+static void free_replayed_objects(Trace* trace, bool use_system, void** objects, size_t* sizes) {
+    for (int i = 0; i < trace->slot_count; i++) {
+        if (use_system) free(objects[i]); else my_free(objects[i]);
+        objects[i] = NULL;
+        sizes[i] = 0;
+    }
+}
+
+// Replay a trace file against my_malloc/my_free and the system allocator,
+// reporting throughput, the peak of live data and of the mapped heap, and
+// the free lists at the moment of peak live data. "sample" replays a
+// freshly written synthetic trace.
+void run_trace_replay(const char* path) {
+    const char* names[2] = {"my_malloc/my_free", "malloc/free"};
+    Trace trace;
+    ReplayResult results[2];
+    
+    if (strcmp(path, "sample") == 0) {
+        path = SAMPLE_TRACE_FILE;
+        if (!write_sample_trace(path)) {
+            printf("Failed to write %s\n", path);
+            return;
+        }
+        printf("Wrote a sample trace to %s\n", path);
+    }
+    if (!load_trace(path, &trace)) {
+        printf("Failed to load trace %s\n", path);
+        return;
+    }
+    printf("Trace: %zu operations on up to %d live objects, %zu lines skipped\n",
+           trace.count, trace.slot_count, trace.skipped);
+    
+    void** objects = calloc(trace.slot_count > 0 ? trace.slot_count : 1, sizeof(void*));
+    size_t* sizes = calloc(trace.slot_count > 0 ? trace.slot_count : 1, sizeof(size_t));
+    if (objects == NULL || sizes == NULL) {
+        printf("Failed to allocate the replay tables\n");
+        free(objects);
+        free(sizes);
+        free(trace.ops);
+        return;
+    }
+    
+    // The peak counts the heap as it was before the replay, too
+    release_thread_cache(&thread_cache);
+    atomic_store(&heap_mapped_peak, heap_mapped_bytes());
+    for (int allocator = 0; allocator < 2; allocator++) {
+        replay_trace(&trace, trace.count, allocator == 1, objects, sizes, &results[allocator]);
+        free_replayed_objects(&trace, allocator == 1, objects, sizes);
+        printf("%-18s %.3f s, %.1f M ops/s, %ld failed allocations\n", names[allocator], results[allocator].seconds,
+               results[allocator].seconds > 0 ? trace.count / results[allocator].seconds / 1e6 : 0.0,
+               results[allocator].failures);
+    }
+    
+    size_t peak_heap = atomic_load(&heap_mapped_peak);
+    size_t peak_live = results[0].peak_live;
+    printf("Peak live data: %zu KB requested\n", peak_live / 1024);
+    printf("Peak heap size: %zu KB mapped\n", peak_heap / 1024);
+    if (peak_live > 0) {
+        printf("Fragmentation ratio: %.2f (peak heap / peak live data)\n", (double)peak_heap / (double)peak_live);
+    }
+    
+    // Run the trace again up to its peak and look at the free lists there,
+    // with this thread's cached blocks back on them
+    replay_trace(&trace, results[0].peak_op, false, objects, sizes, &results[0]);
+    release_thread_cache(&thread_cache);
+    printf("\nFree lists at peak live data:\n");
+    print_free_list_summary();
+    free_replayed_objects(&trace, false, objects, sizes);
+    release_thread_cache(&thread_cache);
+    
+    free(objects);
+    free(sizes);
+    free(trace.ops);
+}
+
+// Print the menu
+void print_menu() {
+    printf("\n===== Memory Allocator =====\n");
+    printf("1. Allocate memory\n");
+    printf("2. Free memory\n");
+    printf("3. Demo allocation\n");
+    printf("4. Print memory status\n");
+    printf("5. Run allocation benchmark\n");
+    printf("6. Run multi-threaded stress benchmark\n");
+    printf("7. Run large heap test\n");
+    printf("8. Run object pool benchmark\n");
+    printf("9. Run region benchmark\n");
+    printf("10. Replay allocation trace\n");
+    printf("11. Print allocator statistics and heap profile\n");
+    printf("12. Start or stop the heap profiler\n");
+    printf("13. Check heap consistency\n");
+    printf("14. Exit\n");
+    printf("===========================\n");
+}
+
+#ifdef ALLOCATOR_SHIM
+// The standard allocation functions, for use as a preloaded library:
+//   gcc -O2 -DALLOCATOR_SHIM -shared -fPIC -o liballocator.so main.c -pthread
+//   LD_PRELOAD=./liballocator.so some_program
+// Every allocation function of the C library is replaced, so no pointer
+// from the system allocator ever reaches my_free.
+//
+// With ALLOCATOR_TRACE=<file> in the environment, every call is also
+// recorded in <file>.<pid>, in the format load_trace reads, so traces of
+// real programs can be replayed from menu option 10. The trace lock is held
+// across each traced call, so the recorded order is the order in which
+// the calls took effect, even with many threads.
+
+static int trace_fd = -1;  // Set before main when tracing
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char trace_buffer[TRACE_BUFFER_SIZE];
+static size_t trace_used = 0;
+
+// Open the trace file of this process
+static void trace_open() {
+    const char* path = getenv("ALLOCATOR_TRACE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    char name[4096];
+    snprintf(name, sizeof(name), "%s.%d", path, (int)getpid());
+    trace_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+// Write out the buffered lines, with write() as stdio would allocate
+static void trace_flush() {
+    size_t done = 0;
+    while (done < trace_used) {
+        ssize_t written = write(trace_fd, trace_buffer + done, trace_used - done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+        done += (size_t)written;
+    }
+    trace_used = 0;
+}
+
+static void trace_put_number(unsigned long long value, unsigned int base) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    trace_buffer[trace_used++] = ' ';
+    while (count > 0) {
+        trace_buffer[trace_used++] = digits[--count];
+    }
+}
+
+// Start a traced call: returns true, holding the trace lock, if tracing
+static bool trace_begin() {
+    if (trace_fd < 0) {
+        return false;
+    }
+    pthread_mutex_lock(&trace_lock);
+    return true;
+}
+
+// Record a call that returned or freed ptr and release the trace lock.
+// Failed calls (ptr NULL) are not recorded. errno is left as the call set it.
+static void trace_end(char type, void* ptr, void* old, size_t alignment, size_t size) {
+    if (ptr != NULL) {
+        int saved_errno = errno;
+        if (trace_used > TRACE_BUFFER_SIZE - TRACE_LINE_MAX) {
+            trace_flush();
+        }
+        trace_buffer[trace_used++] = type;
+        if (type == 'r') trace_put_number((uintptr_t)old, 16);
+        trace_put_number((uintptr_t)ptr, 16);
+        if (type == 'm') trace_put_number(alignment, 10);
+        if (type != 'f') trace_put_number(size, 10);
+        trace_buffer[trace_used++] = '\n';
+        errno = saved_errno;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Fork handlers. The child drops the parent's buffered lines and records
+// into a file of its own.
+static void trace_lock_for_fork() {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_unlock_after_fork() {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_restart_in_child() {
+    close(trace_fd);
+    trace_fd = -1;
+    trace_used = 0;
+    trace_open();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((constructor)) static void trace_start() {
+    trace_open();
+    if (trace_fd < 0) {
+        return;
+    }
+    // Registered after the arena handlers, so forking takes the trace lock
+    // before the arena locks, the same order as a traced call
+    init_memory_pool();
+    pthread_atfork(trace_lock_for_fork, trace_unlock_after_fork, trace_restart_in_child);
+}
+
+__attribute__((destructor)) static void trace_stop() {
+    if (trace_fd >= 0) {
+        pthread_mutex_lock(&trace_lock);
+        trace_flush();
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+// Heap profiling. With ALLOCATOR_PROFILE=<file> the profiler samples
+// every ALLOCATOR_PROFILE_INTERVAL bytes (PROFILE_DEFAULT_INTERVAL if
+// unset), and the statistics and heap profile are appended to <file>.<pid>
+// at exit and whenever the process receives SIGUSR2. The signal handler
+// only sets a flag; the next malloc writes the dump, outside the handler.
+static const char* profile_path = NULL;
+static volatile sig_atomic_t profile_dump_requested = 0;
+
+static void request_profile_dump(int signal_number) {
+    (void)signal_number;
+    profile_dump_requested = 1;
+}
+
+static void write_profile_file() {
+    char name[4096];
+    profile_dump_requested = 0;
+    snprintf(name, sizeof(name), "%s.%d", profile_path, (int)getpid());
+    int fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    write_allocator_stats(fd);
+    heap_profile_dump(fd);
+    close(fd);
+}
+
+__attribute__((constructor)) static void profile_start() {
+    profile_path = getenv("ALLOCATOR_PROFILE");
+    if (profile_path == NULL || *profile_path == '\0') {
+        profile_path = NULL;
+        return;
+    }
+    const char* interval = getenv("ALLOCATOR_PROFILE_INTERVAL");
+    heap_profile_start(interval != NULL && atol(interval) > 0 ? (size_t)atol(interval) : PROFILE_DEFAULT_INTERVAL);
+    
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_profile_dump;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, NULL);
+}
+
+__attribute__((destructor)) static void profile_finish() {
+    if (profile_path != NULL) {
+        write_profile_file();
+    }
+}
+
+void* malloc(size_t size) {
+    if (profile_dump_requested) {
+        write_profile_file();
+    }
+    bool tracing = trace_begin();
+    // Programs expect a unique pointer even for 0 bytes
+    void* ptr = my_malloc(size > 0 ? size : 1);
+    if (ptr == NULL) errno = ENOMEM;
+    if (tracing) trace_end('a', ptr, NULL, 0, size);
+    return ptr;
+}
+
+void free(void* ptr) {
+    bool tracing = ptr != NULL && trace_begin();
+    my_free(ptr);
+    if (tracing) trace_end('f', ptr, NULL, 0, 0);
+}
+
+void* calloc(size_t count, size_t size) {
+    bool tracing = trace_begin();
+    void* ptr = my_calloc(count > 0 ? count : 1, size > 0 ? size : 1);
+    if (ptr == NULL) errno = ENOMEM;
+    if (tracing) trace_end('a', ptr, NULL, 0, count * size);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    bool tracing = trace_begin();
+    void* moved = my_realloc(ptr, ptr == NULL && size == 0 ? 1 : size);
+    if (moved == NULL && size > 0) errno = ENOMEM;
+    if (tracing) {
+        if (ptr == NULL) {
+            trace_end('a', moved, NULL, 0, size);
+        } else if (size == 0) {
+            trace_end('f', ptr, NULL, 0, 0);
+        } else {
+            trace_end('r', moved, ptr, 0, size);
+        }
+    }
+    return moved;
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    bool tracing = trace_begin();
+    void* ptr = my_memalign(alignment, size > 0 ? size : 1);
+    if (tracing) trace_end('m', ptr, NULL, alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    bool tracing = trace_begin();
+    void* ptr = my_memalign(alignment, size > 0 ? size : 1);
+    if (ptr == NULL) errno = ENOMEM;
+    if (tracing) trace_end('m', ptr, NULL, alignment, size);
+    return ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size) {
+    init_memory_pool();
+    return aligned_alloc(page_size, size);
+}
+
+void* pvalloc(size_t size) {
+    init_memory_pool();
+    return aligned_alloc(page_size, page_round_up(size > 0 ? size : 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return my_usable_size(ptr);
+}
+#endif
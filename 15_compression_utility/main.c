@@ -2,10 +2,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define HAVE_HW_CRC32C 1
+#endif
 
 #define MAX_NODES 512
 #define MAX_BITS 32
 
+#define ARCHIVE_MAGIC "HUF2"
+#define BLOCK_SIZE 65536             // Raw bytes covered by one block checksum
+#define CRC32C_POLY 0x82F63B78u      // Castagnoli polynomial (reflected)
+
 // Huffman tree node
 typedef struct {
     unsigned char data;
@@ -21,6 +32,25 @@ typedef struct {
     int code_length;
 } HuffmanCode;
 
+// Archive header
+// Layout on disk: magic, block size, original size, frequency table,
+// then a CRC32C of all preceding header bytes.
+typedef struct {
+    char magic[4];
+    uint32_t block_size;
+    uint64_t original_size;
+    uint32_t freq[256];
+    uint32_t header_crc;
+} ArchiveHeader;
+
+// Per-block header, followed by packed_length bytes of bitstream.
+// Each block starts on a byte boundary so it can be checked on its own.
+typedef struct {
+    uint32_t raw_length;
+    uint32_t packed_length;
+    uint32_t crc;               // CRC32C of the raw (uncompressed) bytes
+} BlockHeader;
+
 // Global variables
 Node nodes[MAX_NODES];
 HuffmanCode codes[256];
@@ -28,13 +58,18 @@ int node_count = 0;
 int code_count = 0;
 
 // Function prototypes
-void build_frequency_table(const char* data, int* freq_table);
+void build_frequency_table(const unsigned char* data, long length, int* freq_table);
 int build_huffman_tree(int* freq_table);
+int merge_huffman_nodes(const int* freq_table);
+int tree_depth(int root);
 void generate_codes(int root, int code[], int code_length);
 void compress_file(const char* input_filename, const char* output_filename);
 void decompress_file(const char* input_filename, const char* output_filename);
-void write_header(FILE* file, int* freq_table);
-int read_header(FILE* file, int* freq_table);
+void validate_file(const char* input_filename);
+int decode_archive(FILE* input, FILE* output);
+void write_header(FILE* file, ArchiveHeader* header);
+int read_header(FILE* file, ArchiveHeader* header);
+uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t length);
 void print_menu();
 
 int main() {
@@ -66,7 +101,13 @@ int main() {
                 decompress_file(input_file, output_file);
                 break;
                 
-            case 3:  // Exit
+            case 3:  // Validate archive
+                printf("Enter compressed filename: ");
+                scanf("%s", input_file);
+                validate_file(input_file);
+                break;
+                
+            case 4:  // Exit
                 printf("Goodbye!\n");
                 exit(0);
                 
@@ -83,21 +124,62 @@ int main() {
 }
 
 // Build frequency table for input data
-void build_frequency_table(const char* data, int* freq_table) {
+void build_frequency_table(const unsigned char* data, long length, int* freq_table) {
     // Initialize frequency table
     for (int i = 0; i < 256; i++) {
         freq_table[i] = 0;
     }
     
-    // Count character frequencies
-    int len = strlen(data);
-    for (int i = 0; i < len; i++) {
-        freq_table[(unsigned char)data[i]]++;
+    // Count character frequencies (length-based so binary files with
+    // embedded zero bytes are counted completely)
+    for (long i = 0; i < length; i++) {
+        freq_table[data[i]]++;
     }
 }
 
-// Build Huffman tree from frequency table
+// Build Huffman tree from frequency table, with no code longer than
+// MAX_BITS. The decompressor rebuilds the same tree from the header, so
+// limiting is done here on a copy rather than in the stored frequencies.
 int build_huffman_tree(int* freq_table) {
+    int scaled[256];
+    memcpy(scaled, freq_table, sizeof(scaled));
+    
+    for (;;) {
+        int root = merge_huffman_nodes(scaled);
+        if (tree_depth(root) <= MAX_BITS) {
+            return root;
+        }
+        
+        // Too deep (e.g. Fibonacci-like frequencies): halve the counts,
+        // keeping every used symbol at 1 or more, and build again. All
+        // ones gives a balanced tree of depth 8, so this always ends.
+        for (int i = 0; i < 256; i++) {
+            if (scaled[i] > 0) {
+                scaled[i] = (scaled[i] + 1) / 2;
+            }
+        }
+    }
+}
+
+// Length of the longest code in the tree under root
+int tree_depth(int root) {
+    int depth[MAX_NODES];
+    int deepest = 0;
+    
+    if (root < 0) return 0;
+    
+    // Parents are always created after their children, so walking down
+    // from the root visits each parent before its children
+    depth[root] = 0;
+    for (int i = root - 1; i >= 0; i--) {
+        depth[i] = depth[nodes[i].parent] + 1;
+        if (depth[i] > deepest) deepest = depth[i];
+    }
+    return deepest;
+}
+
+// One plain Huffman merge of the symbols in freq_table; returns the root
+int merge_huffman_nodes(const int* freq_table) {
     // Initialize nodes
     node_count = 0;
     for (int i = 0; i < 256; i++) {
@@ -116,16 +198,16 @@ int build_huffman_tree(int* freq_table) {
     while (node_count > 1) {
         // Find two nodes with minimum frequency
         int min1 = -1, min2 = -1;
-        int freq1 = 999999, freq2 = 999999;
+        int freq1 = 0, freq2 = 0;
         
         for (int i = 0; i < node_count; i++) {
             if (nodes[i].parent == -1) {  // Not yet merged
-                if (nodes[i].frequency < freq1) {
+                if (min1 == -1 || nodes[i].frequency < freq1) {
                     freq2 = freq1;
                     min2 = min1;
                     freq1 = nodes[i].frequency;
                     min1 = i;
-                } else if (nodes[i].frequency < freq2) {
+                } else if (min2 == -1 || nodes[i].frequency < freq2) {
                     freq2 = nodes[i].frequency;
                     min2 = i;
                 }
@@ -158,6 +240,11 @@ void generate_codes(int root, int code[], int code_length) {
     
     // If leaf node, store code
     if (nodes[root].is_leaf) {
+        // A single-symbol tree has a leaf root; give it a one-bit code
+        if (code_length == 0) {
+            code[0] = 0;
+            code_length = 1;
+        }
         codes[code_count].data = nodes[root].data;
         codes[code_count].code_length = code_length;
         for (int i = 0; i < code_length; i++) {
@@ -189,7 +276,14 @@ void compress_file(const char* input_filename, const char* output_filename) {
     long file_size = ftell(input);
     fseek(input, 0, SEEK_SET);
     
-    char* data = (char*)malloc(file_size + 1);
+    // Frequencies are counted in ints, so their sum must fit in one
+    if (file_size < 0 || file_size > INT_MAX) {
+        printf("Error: Input file is too large!\n");
+        fclose(input);
+        return;
+    }
+    
+    unsigned char* data = (unsigned char*)malloc(file_size + 1);
     if (!data) {
         printf("Error: Memory allocation failed!\n");
         fclose(input);
@@ -197,12 +291,11 @@ void compress_file(const char* input_filename, const char* output_filename) {
     }
     
     fread(data, 1, file_size, input);
-    data[file_size] = '\0';
     fclose(input);
     
     // Build frequency table
     int freq_table[256];
-    build_frequency_table(data, freq_table);
+    build_frequency_table(data, file_size, freq_table);
     
     // Build Huffman tree
     int root = build_huffman_tree(freq_table);
@@ -210,67 +303,200 @@ void compress_file(const char* input_filename, const char* output_filename) {
     // Generate Huffman codes
     code_count = 0;
     int code[MAX_BITS];
-    generate_codes(root, code, 0);
+    if (file_size > 0) {
+        generate_codes(root, code, 0);
+    }
+    
+    // Map each byte value straight to its code
+    int code_index[256];
+    for (int i = 0; i < 256; i++) {
+        code_index[i] = -1;
+    }
+    for (int j = 0; j < code_count; j++) {
+        code_index[codes[j].data] = j;
+    }
+    
+    // Packed output buffer for one block (worst case MAX_BITS per byte)
+    unsigned char* packed = (unsigned char*)malloc((size_t)BLOCK_SIZE * MAX_BITS / 8 + 1);
+    if (!packed) {
+        printf("Error: Memory allocation failed!\n");
+        free(data);
+        return;
+    }
     
     // Write compressed file
     FILE* output = fopen(output_filename, "wb");
     if (!output) {
         printf("Error: Could not create output file!\n");
+        free(packed);
         free(data);
         return;
     }
     
-    // Write frequency table as header
-    write_header(output, freq_table);
-    
-    // Compress data
-    unsigned char bit_buffer = 0;
-    int bit_count = 0;
+    // Write archive header
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, 4);
+    header.block_size = BLOCK_SIZE;
+    header.original_size = (uint64_t)file_size;
+    for (int i = 0; i < 256; i++) {
+        header.freq[i] = (uint32_t)freq_table[i];
+    }
+    write_header(output, &header);
     
-    for (long i = 0; i < file_size; i++) {
-        unsigned char ch = data[i];
+    // Compress data block by block
+    for (long start = 0; start < file_size; start += BLOCK_SIZE) {
+        long raw_length = file_size - start;
+        if (raw_length > BLOCK_SIZE) raw_length = BLOCK_SIZE;
         
-        // Find Huffman code for character
-        for (int j = 0; j < code_count; j++) {
-            if (codes[j].data == ch) {
-                // Write code bits
-                for (int k = 0; k < codes[j].code_length; k++) {
-                    bit_buffer |= (codes[j].code[k] << (7 - bit_count));
-                    bit_count++;
-                    
-                    if (bit_count == 8) {
-                        fwrite(&bit_buffer, 1, 1, output);
-                        bit_buffer = 0;
-                        bit_count = 0;
-                    }
+        unsigned char bit_buffer = 0;
+        int bit_count = 0;
+        uint32_t packed_length = 0;
+        
+        for (long i = start; i < start + raw_length; i++) {
+            HuffmanCode* hc = &codes[code_index[data[i]]];
+            
+            // Write code bits
+            for (int k = 0; k < hc->code_length; k++) {
+                bit_buffer |= (hc->code[k] << (7 - bit_count));
+                bit_count++;
+                
+                if (bit_count == 8) {
+                    packed[packed_length++] = bit_buffer;
+                    bit_buffer = 0;
+                    bit_count = 0;
                 }
-                break;
             }
         }
+        
+        // Write remaining bits so the next block starts byte-aligned
+        if (bit_count > 0) {
+            packed[packed_length++] = bit_buffer;
+        }
+        
+        BlockHeader block;
+        block.raw_length = (uint32_t)raw_length;
+        block.packed_length = packed_length;
+        block.crc = crc32c(0, data + start, (size_t)raw_length);
+        fwrite(&block, sizeof(BlockHeader), 1, output);
+        fwrite(packed, 1, packed_length, output);
     }
     
-    // Write remaining bits
-    if (bit_count > 0) {
-        fwrite(&bit_buffer, 1, 1, output);
-    }
-    
+    long comp_size = ftell(output);
     fclose(output);
+    free(packed);
     free(data);
     
     // Calculate compression ratio
-    FILE* original = fopen(input_filename, "rb");
-    FILE* compressed = fopen(output_filename, "rb");
-    fseek(original, 0, SEEK_END);
-    fseek(compressed, 0, SEEK_END);
-    long orig_size = ftell(original);
-    long comp_size = ftell(compressed);
-    fclose(original);
-    fclose(compressed);
-    
     printf("File compressed successfully!\n");
-    printf("Original size: %ld bytes\n", orig_size);
+    printf("Original size: %ld bytes\n", file_size);
     printf("Compressed size: %ld bytes\n", comp_size);
-    printf("Compression ratio: %.2f%%\n", (1.0 - (double)comp_size / orig_size) * 100);
+    if (file_size > 0) {
+        printf("Compression ratio: %.2f%%\n", (1.0 - (double)comp_size / file_size) * 100);
+    }
+}
+
+// Decode every block of an archive, verifying checksums as it goes.
+// Decoded bytes are written to output unless it is NULL (validate-only).
+// Returns 1 if the archive is intact, 0 on the first detected corruption.
+int decode_archive(FILE* input, FILE* output) {
+    ArchiveHeader header;
+    if (!read_header(input, &header)) {
+        printf("Error: Invalid compressed file format!\n");
+        return 0;
+    }
+    
+    // Build Huffman tree
+    int freq_table[256];
+    for (int i = 0; i < 256; i++) {
+        freq_table[i] = (int)header.freq[i];
+    }
+    int root = build_huffman_tree(freq_table);
+    
+    // Every internal node of a well-formed tree has two children, so the
+    // decode loop below never needs to check for -1
+    for (int i = 0; i < node_count; i++) {
+        if (!nodes[i].is_leaf && (nodes[i].left == -1 || nodes[i].right == -1)) {
+            printf("Error: Corrupt frequency table!\n");
+            return 0;
+        }
+    }
+    
+    unsigned char* packed = (unsigned char*)malloc((size_t)header.block_size * MAX_BITS / 8 + 1);
+    unsigned char* raw = (unsigned char*)malloc(header.block_size);
+    if (!packed || !raw) {
+        printf("Error: Memory allocation failed!\n");
+        free(packed);
+        free(raw);
+        return 0;
+    }
+    
+    uint64_t remaining = header.original_size;
+    long block_number = 0;
+    int ok = 1;
+    
+    while (remaining > 0) {
+        BlockHeader block;
+        uint32_t expected = remaining < header.block_size ? (uint32_t)remaining : header.block_size;
+        
+        if (fread(&block, sizeof(BlockHeader), 1, input) != 1) {
+            printf("Error: Truncated archive at block %ld!\n", block_number);
+            ok = 0;
+            break;
+        }
+        if (block.raw_length != expected ||
+            block.packed_length > (uint64_t)expected * MAX_BITS / 8 + 1) {
+            printf("Error: Corrupt header in block %ld!\n", block_number);
+            ok = 0;
+            break;
+        }
+        if (fread(packed, 1, block.packed_length, input) != block.packed_length) {
+            printf("Error: Truncated archive at block %ld!\n", block_number);
+            ok = 0;
+            break;
+        }
+        
+        // Decompress block
+        uint32_t produced = 0;
+        if (nodes[root].is_leaf) {
+            // Single-symbol input: every code is the same one bit
+            memset(raw, nodes[root].data, block.raw_length);
+            produced = block.raw_length;
+        } else {
+            int current_node = root;
+            for (uint32_t p = 0; p < block.packed_length && produced < block.raw_length; p++) {
+                unsigned char byte = packed[p];
+                for (int i = 0; i < 8; i++) {
+                    int bit = (byte >> (7 - i)) & 1;
+                    current_node = bit ? nodes[current_node].right : nodes[current_node].left;
+                    
+                    // If we reach a leaf node
+                    if (nodes[current_node].is_leaf) {
+                        raw[produced++] = nodes[current_node].data;
+                        current_node = root;
+                        if (produced == block.raw_length) break;
+                    }
+                }
+            }
+        }
+        
+        // Checksum the block while it is still in cache
+        if (produced != block.raw_length || crc32c(0, raw, produced) != block.crc) {
+            printf("Error: Checksum mismatch in block %ld!\n", block_number);
+            ok = 0;
+            break;
+        }
+        
+        if (output) {
+            fwrite(raw, 1, produced, output);
+        }
+        remaining -= produced;
+        block_number++;
+    }
+    
+    free(packed);
+    free(raw);
+    return ok;
 }
 
 // Decompress file using Huffman tree
@@ -281,18 +507,6 @@ void decompress_file(const char* input_filename, const char* output_filename) {
         return;
     }
     
-    // Read frequency table from header
-    int freq_table[256];
-    if (!read_header(input, freq_table)) {
-        printf("Error: Invalid compressed file format!\n");
-        fclose(input);
-        return;
-    }
-    
-    // Build Huffman tree
-    int root = build_huffman_tree(freq_table);
-    
-    // Read compressed data
     FILE* output = fopen(output_filename, "wb");
     if (!output) {
         printf("Error: Could not create output file!\n");
@@ -300,47 +514,157 @@ void decompress_file(const char* input_filename, const char* output_filename) {
         return;
     }
     
-    // Decompress data
-    int current_node = root;
-    int bit_pos = 0;
-    unsigned char byte;
+    int ok = decode_archive(input, output);
+    fclose(input);
+    fclose(output);
     
-    while (fread(&byte, 1, 1, input) == 1) {
-        for (int i = 0; i < 8; i++) {
-            int bit = (byte >> (7 - i)) & 1;
-            
-            if (bit == 0) {
-                current_node = nodes[current_node].left;
-            } else {
-                current_node = nodes[current_node].right;
-            }
-            
-            // If we reach a leaf node
-            if (current_node != -1 && nodes[current_node].is_leaf) {
-                fputc(nodes[current_node].data, output);
-                current_node = root;
-            }
-        }
+    if (ok) {
+        printf("File decompressed successfully!\n");
+    } else {
+        // Don't leave a partially restored file behind
+        remove(output_filename);
+        printf("Decompression failed, output discarded.\n");
+    }
+}
+
+// Check an archive's checksums without writing any output
+void validate_file(const char* input_filename) {
+    FILE* input = fopen(input_filename, "rb");
+    if (!input) {
+        printf("Error: Could not open input file!\n");
+        return;
     }
     
+    int ok = decode_archive(input, NULL);
     fclose(input);
-    fclose(output);
-    printf("File decompressed successfully!\n");
+    
+    if (ok) {
+        printf("Archive is valid.\n");
+    } else {
+        printf("Archive is corrupt.\n");
+    }
 }
 
-// Write frequency table as header
-void write_header(FILE* file, int* freq_table) {
-    // Write frequency table
-    fwrite(freq_table, sizeof(int), 256, file);
+// Write archive header
+void write_header(FILE* file, ArchiveHeader* header) {
+    header->header_crc = crc32c(0, (const unsigned char*)header,
+                                offsetof(ArchiveHeader, header_crc));
+    fwrite(header, sizeof(ArchiveHeader), 1, file);
 }
 
-// Read frequency table from header
-int read_header(FILE* file, int* freq_table) {
-    // Read frequency table
-    if (fread(freq_table, sizeof(int), 256, file) != 256) {
+// Read and verify archive header
+int read_header(FILE* file, ArchiveHeader* header) {
+    if (fread(header, sizeof(ArchiveHeader), 1, file) != 1) {
         return 0;  // Error reading header
     }
-    return 1;  // Success
+    if (memcmp(header->magic, ARCHIVE_MAGIC, 4) != 0) {
+        return 0;  // Not an archive of this format
+    }
+    if (crc32c(0, (const unsigned char*)header, offsetof(ArchiveHeader, header_crc)) != header->header_crc) {
+        return 0;  // Header damaged
+    }
+    if (header->block_size == 0 || header->block_size > (1u << 24)) {
+        return 0;
+    }
+    
+    // Frequencies must account for exactly the original size, which the
+    // compressor keeps within INT_MAX so merged tree nodes cannot overflow
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++) {
+        total += header->freq[i];
+    }
+    return total <= INT_MAX && total == header->original_size;  // Success
+}
+
+// CRC32C lookup tables for slicing-by-8
+static uint32_t crc32c_table[8][256];
+static int crc32c_table_ready = 0;
+
+static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+    crc32c_table_ready = 1;
+}
+
+// Portable CRC32C, eight bytes per step
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t length) {
+    if (!crc32c_table_ready) {
+        crc32c_init_table();
+    }
+    
+    while (length >= 8) {
+        crc ^= (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+               ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        crc = crc32c_table[7][crc & 0xFF] ^
+              crc32c_table[6][(crc >> 8) & 0xFF] ^
+              crc32c_table[5][(crc >> 16) & 0xFF] ^
+              crc32c_table[4][crc >> 24] ^
+              crc32c_table[3][p[4]] ^
+              crc32c_table[2][p[5]] ^
+              crc32c_table[1][p[6]] ^
+              crc32c_table[0][p[7]];
+        p += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef HAVE_HW_CRC32C
+// SSE4.2 CRC32 instruction (same Castagnoli polynomial)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t length) {
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, p, 8);
+        crc64 = _mm_crc32_u64(crc64, chunk);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length >= 4) {
+        uint32_t chunk;
+        memcpy(&chunk, p, 4);
+        crc = _mm_crc32_u32(crc, chunk);
+        p += 4;
+        length -= 4;
+    }
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// CRC32C of a buffer, chaining from a previous result (start with 0).
+// Uses the hardware instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t length) {
+#ifdef HAVE_HW_CRC32C
+    static int use_hw = -1;
+    if (use_hw < 0) {
+        use_hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    if (use_hw) {
+        return ~crc32c_hw(~crc, data, length);
+    }
+#endif
+    return ~crc32c_sw(~crc, data, length);
 }
 
 // Print menu
@@ -348,6 +672,7 @@ void print_menu() {
     printf("\n===== Huffman Compression Utility =====\n");
     printf("1. Compress file\n");
     printf("2. Decompress file\n");
-    printf("3. Exit\n");
+    printf("3. Validate archive\n");
+    printf("4. Exit\n");
     printf("==================================\n");
-}
\ No newline at end of file
+}
@@ -2,11 +2,41 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
 
-#define WIDTH 800
-#define HEIGHT 600
-#define MAX_DEPTH 5
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define DEFAULT_WIDTH 800
+#define DEFAULT_HEIGHT 600
+#define DEFAULT_MAX_DEPTH 5
+#define DEFAULT_FOV 90.0
 #define PI 3.14159265359
+#define TILE_SIZE 32
+#define MIN_TILES_PER_THREAD 4      // Tiles per thread in one band, for load balancing
+#define OUTPUT_BUFFER_SIZE (4 << 20)    // Bytes collected before each fwrite
+#define HEATMAP_LOG2_RANGE 16.0     // Heatmap saturates at 2^16 tests per pixel
+#define OUTPUT_SLOTS 4              // Finished bands that may wait for the writer thread
+#define PIPELINE_DEPTH 4            // Bands queued on the render threads at once
+#define BASE_SLOTS 5                // Base-pass bands kept for the refine pass
+#define KEPT_PREVIEW_BUDGET (32 << 20)  // Bytes a refined preview may keep in memory
+#define MAX_THREADS 256
+#define DEFAULT_AA_THRESHOLD 16     // Max channel difference before a pixel is refined
+#define BVH_LEAF_SIZE 4         // Primitives per leaf before SAH is consulted
+#define BVH_BINS 16             // Centroid bins evaluated per split axis
+#define BVH_MAX_DEPTH 60        // Build depth limit; traversal stack is sized from it
+#define PATH_RR_DEPTH 3             // Bounces before Russian roulette may end a path
+#define PATH_MAX_BOUNCES 64         // Hard limit on path length
 
 // Vector structure
 typedef struct {
@@ -18,6 +48,12 @@ typedef struct {
     unsigned char r, g, b;
 } Color;
 
+// Color used while shading: 0-255 scale, single precision, not clamped
+// or rounded until the pixel is stored
+typedef struct {
+    float r, g, b;
+} ColorF;
+
 // Ray structure
 typedef struct {
     Vec3 origin;
@@ -40,71 +76,427 @@ typedef struct {
     double intensity;
 } Light;
 
+// Camera description plus the basis derived from it
+typedef struct {
+    Vec3 position;
+    Vec3 look_at;
+    Vec3 up;
+    double fov;         // Vertical field of view in degrees
+    Vec3 forward, right, true_up;
+    double scale;       // tan(fov / 2)
+} Camera;
+
+// Surface material, referenced by name from scene files
+typedef struct {
+    char name[64];
+    Color color;
+    int specular;
+    double reflective;
+} Material;
+
+// Rectangular block of pixels, the unit of work for render threads
+typedef struct {
+    int x0, y0;
+    int x1, y1;     // Exclusive
+} Tile;
+
+// Per-worker tile deque. The owner takes tiles from the front; idle
+// workers steal from the back so they get the work furthest from the
+// owner's current position.
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;       // Exclusive
+} TileQueue;
+
+// Work counters. Each thread counts into its own copy; the copies are
+// summed when the thread finishes.
+typedef struct {
+    long primary_rays;
+    long shadow_rays;
+    long reflection_rays;
+    long diffuse_rays;      // Path tracing bounces off diffuse surfaces
+    long box_tests;         // Ray/AABB slab tests
+    long sphere_tests;
+    long triangle_tests;
+    long tiles;
+    double tile_seconds;    // Total time spent in tiles, over all threads
+    double slowest_tile;
+} RenderStats;
+
+// Consecutive image rows [row0, row0 + rows) held in memory
+typedef struct {
+    Color* pixels;
+    unsigned int* cost;     // Intersection tests per pixel, or NULL
+    ColorF* sum;            // Running sum of path samples per pixel, or NULL
+    int row0;
+    int rows;
+} RowBuffer;
+
+// Render passes. The base pass traces one centered ray per pixel (or all
+// path samples); the refine pass supersamples pixels whose neighbors in
+// the base image differ. The preview pass is the base pass cut down to
+// one path sample.
+typedef enum {
+    PASS_BASE,
+    PASS_REFINE,
+    PASS_PREVIEW
+} RenderPass;
+
+// One pass over one band of rows, queued on the render pool. Its tiles
+// are dealt out to per-worker deques when it is queued.
+typedef struct RenderJob {
+    RenderPass pass;
+    const Camera* camera;
+    RowBuffer* output;
+    const RowBuffer* base[3];   // Base rows above, of and below the band, read
+                                // by the refine pass; the outer two may be NULL
+    Tile* tiles;
+    int tile_count;
+    TileQueue* queues;          // One per pool thread
+    int worker_count;
+    int active;                 // Workers taking its tiles; guarded by the pool lock
+    int done;
+    struct RenderJob* next;
+} RenderJob;
+
+typedef enum {
+    FORMAT_PPM,             // Binary PPM (P6)
+    FORMAT_TGA              // Run-length encoded Truevision TGA
+} ImageFormat;
+
+// Image file written row by row through a large buffer, so a frame
+// never has to be in memory as a whole
+typedef struct {
+    FILE* file;
+    char filename[512];
+    ImageFormat format;
+    unsigned char* buffer;
+    size_t used;
+    int failed;
+} ImageWriter;
+
+typedef enum {
+    OUTPUT_ROWS,            // Append rows to a file
+    OUTPUT_CLOSE,           // Close the file and free its writer
+    OUTPUT_STOP             // Shut the writer thread down
+} OutputKind;
+
+typedef struct {
+    OutputKind kind;
+    ImageWriter* writer;
+    Color* pixels;          // Private copy of the rows
+    size_t capacity;        // Pixels allocated
+    int rows;
+} OutputSlot;
+
+// Queue of finished bands between the render loop and a writer thread, so
+// tracing the next band (or frame) overlaps with writing the last one.
+// The ring is fixed size, which bounds memory and makes the render loop
+// wait when the disk falls behind.
+typedef struct {
+    OutputSlot slots[OUTPUT_SLOTS];
+    int head;
+    int count;
+    int threaded;           // 0 when the thread could not start: write inline
+    int failed;             // Guarded by lock, like the ring
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t thread;
+} OutputStage;
+
+// Axis-aligned bounding box
+typedef struct {
+    Vec3 min;
+    Vec3 max;
+} AABB;
+
+// BVH node. Interior nodes store the index of their left child (the
+// right child follows it); leaves store a range of primitive indices.
+typedef struct {
+    AABB bounds;
+    int first;      // Left child, or first primitive for leaves
+    int count;      // Number of primitives, 0 for interior nodes
+} BVHNode;
+
+// Bounding volume hierarchy over an array of primitives
+typedef struct {
+    BVHNode* nodes;
+    int node_count;
+    int* indices;   // Primitive indices, grouped by leaf
+} BVH;
+
+// Sphere data in structure-of-arrays layout, ordered like the BVH's
+// primitive indices so each leaf is a contiguous run of lanes. Arrays are
+// padded so vector loads past the last sphere stay in bounds.
+typedef struct {
+    double* cx;
+    double* cy;
+    double* cz;
+    double* radius2;
+    int count;
+} SphereSoA;
+
+// Bounds of both children of an interior node in SoA layout, so one
+// ray can be tested against the pair at once
+typedef struct {
+    double min_x[2], min_y[2], min_z[2];
+    double max_x[2], max_y[2], max_z[2];
+} ChildBounds;
+
+// Entry distances into both children of a node (-1 for a miss)
+typedef void (*ChildIntersectFn)(const ChildBounds* bounds, const Ray* ray,
+                                 Vec3 inv_direction, double t_max, double* t_child);
+
+// Triangle stored by value, in BVH leaf order within its mesh
+typedef struct {
+    Vec3 v0, v1, v2;
+} Triangle;
+
+// Triangle mesh with its own BVH. The source file and transform are kept
+// so the scene can be written back out.
+typedef struct {
+    Triangle* triangles;
+    int triangle_count;
+    BVH bvh;
+    ChildBounds* child_bounds;
+    Material material;
+    char filename[256];
+    Vec3 offset;
+    double scale;
+} Mesh;
+
+// Per-ray constants for the watertight ray/triangle test: the dominant
+// direction axis becomes z, and the shear maps the ray onto +z
+typedef struct {
+    int kx, ky, kz;
+    double sx, sy, sz;
+} WatertightRay;
+
+// Closest intersection found by intersect_scene
+typedef struct {
+    double t;
+    int sphere;         // Sphere index, or -1
+    int mesh;           // Mesh index when a triangle was hit, or -1
+    int triangle;       // Triangle index within the mesh
+} Hit;
+
+// Shading inputs at a hit point
+typedef struct {
+    Vec3 normal;
+    Color color;
+    int specular;
+    double reflectivity;
+} Surface;
+
+// Object that last blocked a shadow ray toward a light
+typedef struct {
+    int sphere;         // Sphere index, or -1
+    int mesh;           // Mesh index when a triangle blocked, or -1
+    int triangle;
+} Occluder;
+
+// PCG32 random number generator state
+typedef struct {
+    unsigned long long state;
+} Rng;
+
+// Per-thread render state, passed down the tracing functions
+typedef struct {
+    Occluder* last_occluder;    // One entry per light
+    RenderStats stats;
+    Rng rng;                    // Path tracing samples, reseeded per pixel
+} ThreadContext;
+
+// Render thread of the pool, with the state it keeps for the whole run
+typedef struct {
+    struct RenderPool* pool;
+    int id;
+    ThreadContext ctx;          // Its counters are summed when the pool stops
+    long refined;               // Pixels supersampled by the refine pass
+} Worker;
+
+// Render threads started once for the whole run. Jobs are served oldest
+// first, and a worker that finds no tiles left in a job moves on to the
+// next one, so the threads only go idle when nothing is queued.
+typedef struct RenderPool {
+    Worker* workers;
+    pthread_t* threads;
+    int thread_count;           // Threads actually started
+    RenderJob* head;            // Queued jobs that may have tiles left
+    RenderJob* tail;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // A job was queued, or the pool is stopping
+    pthread_cond_t finished;    // A job was finished
+} RenderPool;
+
+// Band-sized pixel buffer and the tasks using it, by task number
+typedef struct {
+    RowBuffer rows;
+    long written;               // Last task rendering into it, or -1
+    long busy;                  // Last task rendering into or reading it, or -1
+} BandSlot;
+
+// A queued job, and where its rows go once they are finished
+typedef struct {
+    RenderJob job;
+    Camera camera;
+    RowBuffer rows;             // The task's own band buffer
+    ImageWriter* output;        // Files receiving the finished rows, or NULL
+    ImageWriter* preview;
+    ImageWriter* heatmap;
+    const char* label;          // Progress label, or NULL to stay quiet
+    ImageWriter* close[3];      // Last band of a frame: the frame's files
+    int frame;                  // Last band of a frame: its index, else -1
+    double frame_start;
+} BandTask;
+
+// Bands queued on the pool, oldest first. The render loop keeps up to
+// PIPELINE_DEPTH bands queued, so the threads start on the next band
+// (which may be the next frame's first) while the last tiles of the
+// current one are finished. Bands complete in the order they were queued,
+// which keeps the output in order.
+typedef struct {
+    RenderPool* pool;
+    OutputStage* stage;
+    BandTask tasks[PIPELINE_DEPTH];
+    int head;
+    int count;
+    long submitted;             // Tasks queued so far
+    long completed;             // Tasks numbered below this are finished
+    int band_rows;
+    BandSlot base[BASE_SLOTS];  // Ring of base-pass bands for the refine pass
+    long base_bands;            // Base bands queued so far, picks the next slot
+    RowBuffer kept;             // Whole preview frame, kept for the final pass
+    BandSlot* kept_bands;       // Its bands, or NULL when it isn't kept
+    Color* heat;                // Heatmap colors of one band
+    const char* progress_label;
+    int last_progress;
+    int frames;
+} Pipeline;
+
+// Closest hit among leaf slots [first, first + count) nearer than
+// *closest_t; updates *closest_t and returns the slot, or -1
+typedef int (*LeafIntersectFn)(const Ray* ray, int first, int count,
+                               int accept_exit, double* closest_t);
+
 // Scene objects
-Sphere spheres[10];
-Light lights[5];
+Sphere* spheres = NULL;
+Light* lights = NULL;
 int sphere_count = 0;
+int sphere_capacity = 0;
 int light_count = 0;
+int light_capacity = 0;
+BVH scene_bvh;
+SphereSoA sphere_soa;
+
+// Render settings (overridable from a scene file)
+int image_width = DEFAULT_WIDTH;
+int image_height = DEFAULT_HEIGHT;
+int max_depth = DEFAULT_MAX_DEPTH;
+Color background_color = {135, 206, 235}; // Sky blue
+Camera camera;
+Camera* keyframes = NULL;           // Camera path for animations
+int keyframe_count = 0;
+int keyframe_capacity = 0;
+int aa_samples = 1;                 // Samples for refined pixels, 1 disables
+int aa_threshold = DEFAULT_AA_THRESHOLD;
+int path_samples = 0;               // Path-traced samples per pixel, 0 for Whitted shading
+double* light_cdf = NULL;           // Cumulative light power, for picking lights to sample
+ChildBounds* child_bounds = NULL;
+Mesh* meshes = NULL;
+int mesh_count = 0;
+int mesh_capacity = 0;
 
-// Vector operations
-Vec3 vec3_add(Vec3 a, Vec3 b) {
+// Vector operations. These are small enough to inline into the tracing
+// loops, so vectors are passed and returned by value without a call.
+static inline Vec3 vec3_add(Vec3 a, Vec3 b) {
     return (Vec3){a.x + b.x, a.y + b.y, a.z + b.z};
 }
 
-Vec3 vec3_subtract(Vec3 a, Vec3 b) {
+static inline Vec3 vec3_subtract(Vec3 a, Vec3 b) {
     return (Vec3){a.x - b.x, a.y - b.y, a.z - b.z};
 }
 
-Vec3 vec3_multiply(Vec3 v, double scalar) {
+static inline Vec3 vec3_multiply(Vec3 v, double scalar) {
     return (Vec3){v.x * scalar, v.y * scalar, v.z * scalar};
 }
 
-Vec3 vec3_normalize(Vec3 v) {
-    double length = sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
-    if (length == 0) return (Vec3){0, 0, 0};
-    return (Vec3){v.x/length, v.y/length, v.z/length};
+// a + b * scalar, e.g. the point at distance t along a ray
+static inline Vec3 vec3_madd(Vec3 a, Vec3 b, double scalar) {
+    return (Vec3){a.x + b.x * scalar, a.y + b.y * scalar, a.z + b.z * scalar};
+}
+
+static inline Vec3 vec3_negate(Vec3 v) {
+    return (Vec3){-v.x, -v.y, -v.z};
 }
 
-double vec3_dot(Vec3 a, Vec3 b) {
+static inline double vec3_dot(Vec3 a, Vec3 b) {
     return a.x*b.x + a.y*b.y + a.z*b.z;
 }
 
-double vec3_length(Vec3 v) {
+static inline double vec3_length(Vec3 v) {
     return sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
 }
 
+static inline Vec3 vec3_normalize(Vec3 v) {
+    double length = vec3_length(v);
+    if (length == 0) return (Vec3){0, 0, 0};
+    return vec3_multiply(v, 1.0 / length);
+}
+
+static inline Vec3 vec3_cross(Vec3 a, Vec3 b) {
+    return (Vec3){a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x};
+}
+
+// Mirror direction d about unit normal n: d - 2(d.n)n. Keeps unit length.
+static inline Vec3 vec3_reflect(Vec3 d, Vec3 n) {
+    return vec3_madd(d, n, -2 * vec3_dot(d, n));
+}
+
 // Color operations
-Color color_multiply(Color c, double factor) {
-    Color result;
-    result.r = (unsigned char)(c.r * factor > 255 ? 255 : c.r * factor);
-    result.g = (unsigned char)(c.g * factor > 255 ? 255 : c.g * factor);
-    result.b = (unsigned char)(c.b * factor > 255 ? 255 : c.b * factor);
-    return result;
+static inline ColorF color_to_float(Color c) {
+    return (ColorF){c.r, c.g, c.b};
 }
 
-Color color_add(Color a, Color b) {
-    Color result;
-    result.r = (unsigned char)(a.r + b.r > 255 ? 255 : a.r + b.r);
-    result.g = (unsigned char)(a.g + b.g > 255 ? 255 : a.g + b.g);
-    result.b = (unsigned char)(a.b + b.b > 255 ? 255 : a.b + b.b);
-    return result;
+static inline ColorF color_add(ColorF a, ColorF b) {
+    return (ColorF){a.r + b.r, a.g + b.g, a.b + b.b};
 }
 
-Color color_scale(Color c, double factor) {
-    Color result;
-    result.r = (unsigned char)(c.r * factor);
-    result.g = (unsigned char)(c.g * factor);
-    result.b = (unsigned char)(c.b * factor);
-    return result;
+static inline ColorF color_scale(ColorF c, float factor) {
+    return (ColorF){c.r * factor, c.g * factor, c.b * factor};
+}
+
+// a + b * factor
+static inline ColorF color_madd(ColorF a, ColorF b, float factor) {
+    return (ColorF){a.r + b.r * factor, a.g + b.g * factor, a.b + b.b * factor};
+}
+
+// Limit channels to 255. Light only adds, so this matches saturating
+// every addition along the way.
+static inline ColorF clamp_color(ColorF c) {
+    return (ColorF){c.r < 255 ? c.r : 255, c.g < 255 ? c.g : 255, c.b < 255 ? c.b : 255};
+}
+
+// Round a shaded color to the 8-bit pixel format
+static inline Color color_to_rgb8(ColorF c) {
+    c = clamp_color(c);
+    return (Color){
+        (unsigned char)(c.r > 0 ? c.r + 0.5f : 0),
+        (unsigned char)(c.g > 0 ? c.g + 0.5f : 0),
+        (unsigned char)(c.b > 0 ? c.b + 0.5f : 0)
+    };
 }
 
 // Ray-sphere intersection
-int intersect_ray_sphere(Ray ray, Sphere sphere, double* t1, double* t2) {
-    Vec3 oc = vec3_subtract(ray.origin, sphere.center);
+int intersect_ray_sphere(const Ray* ray, const Sphere* sphere, double* t1, double* t2) {
+    Vec3 oc = vec3_subtract(ray->origin, sphere->center);
     
-    double a = vec3_dot(ray.direction, ray.direction);
-    double b = 2.0 * vec3_dot(oc, ray.direction);
-    double c = vec3_dot(oc, oc) - sphere.radius * sphere.radius;
+    double a = vec3_dot(ray->direction, ray->direction);
+    double b = 2.0 * vec3_dot(oc, ray->direction);
+    double c = vec3_dot(oc, oc) - sphere->radius * sphere->radius;
     
     double discriminant = b*b - 4*a*c;
     
@@ -118,245 +510,3116 @@ int intersect_ray_sphere(Ray ray, Sphere sphere, double* t1, double* t2) {
     return 1; // Intersection found
 }
 
-// Get sphere normal at point
-Vec3 get_sphere_normal(Sphere sphere, Vec3 point) {
-    Vec3 normal = vec3_subtract(point, sphere.center);
-    return vec3_normalize(normal);
+// Get sphere normal at a point on its surface. The offset from the
+// center already has length radius, so no square root is needed.
+Vec3 get_sphere_normal(const Sphere* sphere, Vec3 point) {
+    return vec3_multiply(vec3_subtract(point, sphere->center), 1.0 / sphere->radius);
+}
+
+// Get triangle face normal, flipped to face the incoming ray
+Vec3 get_triangle_normal(const Triangle* tri, Vec3 ray_direction) {
+    Vec3 normal = vec3_normalize(vec3_cross(vec3_subtract(tri->v1, tri->v0),
+                                            vec3_subtract(tri->v2, tri->v0)));
+    if (vec3_dot(normal, ray_direction) > 0) {
+        normal = vec3_negate(normal);
+    }
+    return normal;
+}
+
+static inline double min_d(double a, double b) { return a < b ? a : b; }
+static inline double max_d(double a, double b) { return a > b ? a : b; }
+
+// Bounding box helpers
+AABB aabb_empty() {
+    return (AABB){{1e308, 1e308, 1e308}, {-1e308, -1e308, -1e308}};
+}
+
+AABB aabb_union(AABB a, AABB b) {
+    return (AABB){
+        {min_d(a.min.x, b.min.x), min_d(a.min.y, b.min.y), min_d(a.min.z, b.min.z)},
+        {max_d(a.max.x, b.max.x), max_d(a.max.y, b.max.y), max_d(a.max.z, b.max.z)}
+    };
+}
+
+AABB aabb_include(AABB a, Vec3 p) {
+    return aabb_union(a, (AABB){p, p});
+}
+
+double aabb_surface_area(AABB box) {
+    Vec3 d = vec3_subtract(box.max, box.min);
+    if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+    return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
 }
 
-// Clamp color values
-Color clamp_color(Color c) {
-    Color result;
-    result.r = c.r > 255 ? 255 : (c.r < 0 ? 0 : c.r);
-    result.g = c.g > 255 ? 255 : (c.g < 0 ? 0 : c.g);
-    result.b = c.b > 255 ? 255 : (c.b < 0 ? 0 : c.b);
-    return result;
+double vec3_axis(Vec3 v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
 }
 
-// Check if point is in shadow
-int is_in_shadow(Vec3 point, Light light) {
-    Vec3 light_direction = vec3_subtract(light.position, point);
-    double light_distance = vec3_length(light_direction);
-    light_direction = vec3_normalize(light_direction);
+AABB sphere_bounds(const Sphere* sphere) {
+    Vec3 r = {sphere->radius, sphere->radius, sphere->radius};
+    return (AABB){vec3_subtract(sphere->center, r), vec3_add(sphere->center, r)};
+}
+
+// Slab test; returns the entry distance (0 when the origin is inside)
+// or -1 if the box is missed within [0, t_max]
+double intersect_ray_aabb(Vec3 origin, Vec3 inv_direction, AABB box, double t_max) {
+    double tx1 = (box.min.x - origin.x) * inv_direction.x;
+    double tx2 = (box.max.x - origin.x) * inv_direction.x;
+    double t_near = min_d(tx1, tx2), t_far = max_d(tx1, tx2);
     
-    Ray shadow_ray = {vec3_add(point, vec3_multiply(light_direction, 0.001)), light_direction};
+    double ty1 = (box.min.y - origin.y) * inv_direction.y;
+    double ty2 = (box.max.y - origin.y) * inv_direction.y;
+    t_near = max_d(t_near, min_d(ty1, ty2));
+    t_far = min_d(t_far, max_d(ty1, ty2));
     
-    for (int i = 0; i < sphere_count; i++) {
-        double t1, t2;
-        if (intersect_ray_sphere(shadow_ray, spheres[i], &t1, &t2)) {
-            if (t1 > 0.001 && t1 < light_distance) {
-                return 1; // Point is in shadow
-            }
-        }
-    }
+    double tz1 = (box.min.z - origin.z) * inv_direction.z;
+    double tz2 = (box.max.z - origin.z) * inv_direction.z;
+    t_near = max_d(t_near, min_d(tz1, tz2));
+    t_far = min_d(t_far, max_d(tz1, tz2));
     
-    return 0; // Point is not in shadow
+    if (t_far < t_near || t_far < 0 || t_near > t_max) return -1;
+    return t_near > 0 ? t_near : 0;
 }
 
-// Compute lighting at a point
-Color compute_lighting(Vec3 point, Vec3 normal, Vec3 view_direction, Sphere sphere) {
-    Color final_color = {0, 0, 0};
+// Recursively build the subtree for indices[first, first + count) into
+// node node_index, splitting with a binned surface area heuristic
+void bvh_build_node(BVH* bvh, const AABB* boxes, const Vec3* centroids,
+                    int node_index, int first, int count, int depth) {
+    BVHNode* node = &bvh->nodes[node_index];
     
-    for (int i = 0; i < light_count; i++) {
-        Light light = lights[i];
+    AABB bounds = aabb_empty();
+    AABB centroid_bounds = aabb_empty();
+    for (int i = first; i < first + count; i++) {
+        bounds = aabb_union(bounds, boxes[bvh->indices[i]]);
+        centroid_bounds = aabb_include(centroid_bounds, centroids[bvh->indices[i]]);
+    }
+    node->bounds = bounds;
+    node->first = first;
+    node->count = count;
+    
+    if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH) return;
+    
+    // Evaluate the SAH cost of splitting between every pair of bins
+    // on each axis, and keep the cheapest
+    double best_cost = 1e308;
+    int best_axis = -1, best_split = 0;
+    
+    for (int axis = 0; axis < 3; axis++) {
+        double lo = vec3_axis(centroid_bounds.min, axis);
+        double hi = vec3_axis(centroid_bounds.max, axis);
+        if (hi - lo < 1e-12) continue;
+        double scale = BVH_BINS / (hi - lo);
         
-        // Check if point is in shadow
-        if (is_in_shadow(point, light)) {
-            continue;
+        AABB bin_bounds[BVH_BINS];
+        int bin_count[BVH_BINS];
+        for (int b = 0; b < BVH_BINS; b++) {
+            bin_bounds[b] = aabb_empty();
+            bin_count[b] = 0;
+        }
+        for (int i = first; i < first + count; i++) {
+            int prim = bvh->indices[i];
+            int b = (int)((vec3_axis(centroids[prim], axis) - lo) * scale);
+            if (b >= BVH_BINS) b = BVH_BINS - 1;
+            bin_bounds[b] = aabb_union(bin_bounds[b], boxes[prim]);
+            bin_count[b]++;
         }
         
-        // Diffuse lighting
-        Vec3 light_direction = vec3_normalize(vec3_subtract(light.position, point));
-        double diffuse_intensity = vec3_dot(normal, light_direction);
-        if (diffuse_intensity < 0) diffuse_intensity = 0;
-        
-        Color diffuse = color_scale(sphere.color, diffuse_intensity * light.intensity);
-        
-        // Specular lighting
-        Vec3 reflection = vec3_subtract(
-            vec3_multiply(normal, 2 * vec3_dot(light_direction, normal)),
-            light_direction
-        );
-        double specular_intensity = vec3_dot(reflection, view_direction);
-        if (specular_intensity > 0) {
-            specular_intensity = pow(specular_intensity, sphere.specular);
-            Color specular = color_scale((Color){255, 255, 255}, specular_intensity * light.intensity);
-            diffuse = color_add(diffuse, specular);
+        // Sweep from the right to get the cost of every right-hand side
+        double right_area[BVH_BINS];
+        int right_count[BVH_BINS];
+        AABB acc = aabb_empty();
+        int n = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+            acc = aabb_union(acc, bin_bounds[b]);
+            n += bin_count[b];
+            right_area[b] = aabb_surface_area(acc);
+            right_count[b] = n;
         }
         
-        final_color = color_add(final_color, diffuse);
+        acc = aabb_empty();
+        n = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++) {
+            acc = aabb_union(acc, bin_bounds[b]);
+            n += bin_count[b];
+            if (n == 0 || right_count[b + 1] == 0) continue;
+            double cost = n * aabb_surface_area(acc) + right_count[b + 1] * right_area[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b + 1;
+            }
+        }
+    }
+    
+    // Keep a leaf when no split beats testing every primitive
+    double leaf_cost = count * aabb_surface_area(bounds);
+    if (best_axis < 0 || best_cost >= leaf_cost) return;
+    
+    // Partition primitives by bin
+    double lo = vec3_axis(centroid_bounds.min, best_axis);
+    double scale = BVH_BINS / (vec3_axis(centroid_bounds.max, best_axis) - lo);
+    int i = first, j = first + count - 1;
+    while (i <= j) {
+        int b = (int)((vec3_axis(centroids[bvh->indices[i]], best_axis) - lo) * scale);
+        if (b >= BVH_BINS) b = BVH_BINS - 1;
+        if (b < best_split) {
+            i++;
+        } else {
+            int tmp = bvh->indices[i];
+            bvh->indices[i] = bvh->indices[j];
+            bvh->indices[j] = tmp;
+            j--;
+        }
     }
+    int left_count = i - first;
+    
+    int left = bvh->node_count;
+    bvh->node_count += 2;
+    node->first = left;
+    node->count = 0;
     
-    return clamp_color(final_color);
+    bvh_build_node(bvh, boxes, centroids, left, first, left_count, depth + 1);
+    bvh_build_node(bvh, boxes, centroids, left + 1, i, count - left_count, depth + 1);
 }
 
-// Trace a ray and return color
-Color trace_ray(Ray ray, int depth) {
-    if (depth >= MAX_DEPTH) {
-        return (Color){0, 0, 0}; // Black for maximum depth
+// Build a BVH over count primitives described by their bounding boxes
+int bvh_build(BVH* bvh, const AABB* boxes, int count) {
+    bvh->node_count = 0;
+    bvh->nodes = malloc((2 * (count > 0 ? count : 1)) * sizeof(BVHNode));
+    bvh->indices = malloc((count > 0 ? count : 1) * sizeof(int));
+    Vec3* centroids = malloc((count > 0 ? count : 1) * sizeof(Vec3));
+    if (!bvh->nodes || !bvh->indices || !centroids) {
+        free(bvh->nodes);
+        free(bvh->indices);
+        free(centroids);
+        bvh->nodes = NULL;
+        bvh->indices = NULL;
+        return 0;
     }
     
-    double closest_t = 1e308; // Infinity
-    int closest_sphere_index = -1;
-    
-    // Find closest intersection
-    for (int i = 0; i < sphere_count; i++) {
-        double t1, t2;
-        if (intersect_ray_sphere(ray, spheres[i], &t1, &t2)) {
-            if (t1 > 0.001 && t1 < closest_t) {
-                closest_t = t1;
-                closest_sphere_index = i;
-            } else if (t2 > 0.001 && t2 < closest_t) {
-                closest_t = t2;
-                closest_sphere_index = i;
-            }
-        }
+    for (int i = 0; i < count; i++) {
+        bvh->indices[i] = i;
+        centroids[i] = vec3_multiply(vec3_add(boxes[i].min, boxes[i].max), 0.5);
     }
     
-    // No intersection found
-    if (closest_sphere_index == -1) {
-        return (Color){135, 206, 235}; // Sky blue background
+    // An empty BVH has no nodes at all
+    if (count == 0) {
+        free(centroids);
+        return 1;
     }
     
-    // Get intersection point
-    Vec3 point = vec3_add(ray.origin, vec3_multiply(ray.direction, closest_t));
+    bvh->node_count = 1;
+    bvh_build_node(bvh, boxes, centroids, 0, 0, count, 0);
     
-    // Get surface normal
-    Vec3 normal = get_sphere_normal(spheres[closest_sphere_index], point);
+    free(centroids);
+    return 1;
+}
+
+void bvh_free(BVH* bvh) {
+    free(bvh->nodes);
+    free(bvh->indices);
+    bvh->nodes = NULL;
+    bvh->indices = NULL;
+    bvh->node_count = 0;
+}
+
+// Build the sphere BVH for the current scene
+int build_scene_bvh() {
+    AABB* boxes = malloc((sphere_count > 0 ? sphere_count : 1) * sizeof(AABB));
+    if (!boxes) return 0;
+    for (int i = 0; i < sphere_count; i++) {
+        boxes[i] = sphere_bounds(&spheres[i]);
+    }
+    int ok = bvh_build(&scene_bvh, boxes, sphere_count);
+    free(boxes);
+    return ok;
+}
+
+// Distance at which the ray hits a sphere, or -1. Shadow rays only count
+// a sphere they enter (t1); primary rays also accept the exit point (t2)
+// so rays starting inside a sphere still see it.
+double sphere_hit_distance(Ray ray, const Sphere* sphere, int accept_exit) {
+    double t1, t2;
+    if (!intersect_ray_sphere(&ray, sphere, &t1, &t2)) return -1;
+    if (t1 > 0.001) return t1;
+    if (accept_exit && t2 > 0.001) return t2;
+    return -1;
+}
+
+#define SOA_PADDING 4
+
+// Copy sphere geometry into SoA arrays in BVH leaf order
+int build_sphere_soa() {
+    int n = sphere_count + SOA_PADDING;
+    sphere_soa.cx = malloc(n * sizeof(double));
+    sphere_soa.cy = malloc(n * sizeof(double));
+    sphere_soa.cz = malloc(n * sizeof(double));
+    sphere_soa.radius2 = malloc(n * sizeof(double));
+    if (!sphere_soa.cx || !sphere_soa.cy || !sphere_soa.cz || !sphere_soa.radius2) {
+        return 0;
+    }
     
-    // Compute view direction
-    Vec3 view_direction = vec3_multiply(ray.direction, -1);
-    view_direction = vec3_normalize(view_direction);
+    for (int i = 0; i < n; i++) {
+        if (i < sphere_count) {
+            const Sphere* s = &spheres[scene_bvh.indices[i]];
+            sphere_soa.cx[i] = s->center.x;
+            sphere_soa.cy[i] = s->center.y;
+            sphere_soa.cz[i] = s->center.z;
+            sphere_soa.radius2[i] = s->radius * s->radius;
+        } else {
+            // Padding lanes can never be hit
+            sphere_soa.cx[i] = sphere_soa.cy[i] = sphere_soa.cz[i] = 0;
+            sphere_soa.radius2[i] = -1;
+        }
+    }
+    sphere_soa.count = sphere_count;
+    return 1;
+}
+
+void free_sphere_soa() {
+    free(sphere_soa.cx);
+    free(sphere_soa.cy);
+    free(sphere_soa.cz);
+    free(sphere_soa.radius2);
+    memset(&sphere_soa, 0, sizeof(sphere_soa));
+    free(child_bounds);
+    child_bounds = NULL;
+}
+
+// Gather each interior node's child boxes into SoA pairs. Returns a new
+// array indexed like bvh->nodes, or NULL on allocation failure.
+ChildBounds* build_child_bounds(const BVH* bvh) {
+    ChildBounds* child_bounds = malloc((bvh->node_count > 0 ? bvh->node_count : 1) * sizeof(ChildBounds));
+    if (!child_bounds) return NULL;
     
-    // Compute lighting
-    Color color = compute_lighting(point, normal, view_direction, spheres[closest_sphere_index]);
+    for (int i = 0; i < bvh->node_count; i++) {
+        const BVHNode* node = &bvh->nodes[i];
+        if (node->count > 0) continue;
+        for (int k = 0; k < 2; k++) {
+            AABB box = bvh->nodes[node->first + k].bounds;
+            child_bounds[i].min_x[k] = box.min.x;
+            child_bounds[i].min_y[k] = box.min.y;
+            child_bounds[i].min_z[k] = box.min.z;
+            child_bounds[i].max_x[k] = box.max.x;
+            child_bounds[i].max_y[k] = box.max.y;
+            child_bounds[i].max_z[k] = box.max.z;
+        }
+    }
+    return child_bounds;
+}
+
+void intersect_children_scalar(const ChildBounds* bounds, const Ray* ray,
+                               Vec3 inv_direction, double t_max, double* t_child) {
+    for (int k = 0; k < 2; k++) {
+        AABB box = {{bounds->min_x[k], bounds->min_y[k], bounds->min_z[k]},
+                    {bounds->max_x[k], bounds->max_y[k], bounds->max_z[k]}};
+        t_child[k] = intersect_ray_aabb(ray->origin, inv_direction, box, t_max);
+    }
+}
+
+// Pick the nearest valid lane. Lanes are visited in order with a strict
+// comparison so ties resolve exactly like the scalar loop.
+static int pick_closest_lane(const double* t1, const double* t2, const double* disc,
+                             int first, int lanes, int accept_exit,
+                             double* closest_t, int best) {
+    for (int lane = 0; lane < lanes; lane++) {
+        if (disc[lane] < 0) continue;
+        double t = -1;
+        if (t1[lane] > 0.001) {
+            t = t1[lane];
+        } else if (accept_exit && t2[lane] > 0.001) {
+            t = t2[lane];
+        }
+        if (t > 0 && t < *closest_t) {
+            *closest_t = t;
+            best = first + lane;
+        }
+    }
+    return best;
+}
+
+// Portable path: one sphere at a time, same arithmetic as intersect_ray_sphere
+int intersect_leaf_scalar(const Ray* ray, int first, int count,
+                          int accept_exit, double* closest_t) {
+    Vec3 d = ray->direction;
+    double a = vec3_dot(d, d);
+    int best = -1;
     
-    // Handle reflection
-    double reflectivity = spheres[closest_sphere_index].reflective;
-    if (reflectivity > 0 && depth < MAX_DEPTH) {
-        // Calculate reflection direction: R = D - 2(D·N)N
-        double dot_product = vec3_dot(ray.direction, normal);
-        Vec3 reflection_direction = vec3_subtract(
-            ray.direction,
-            vec3_multiply(normal, 2 * dot_product)
-        );
+    for (int i = first; i < first + count; i++) {
+        double ocx = ray->origin.x - sphere_soa.cx[i];
+        double ocy = ray->origin.y - sphere_soa.cy[i];
+        double ocz = ray->origin.z - sphere_soa.cz[i];
+        double b = 2.0 * (ocx * d.x + ocy * d.y + ocz * d.z);
+        double c = (ocx * ocx + ocy * ocy + ocz * ocz) - sphere_soa.radius2[i];
+        double disc = b * b - 4 * a * c;
+        double t1 = 0, t2 = 0;
+        if (disc >= 0) {
+            t1 = (-b - sqrt(disc)) / (2.0 * a);
+            t2 = (-b + sqrt(disc)) / (2.0 * a);
+        }
+        best = pick_closest_lane(&t1, &t2, &disc, i, 1, accept_exit, closest_t, best);
+    }
+    return best;
+}
+
+#ifdef HAVE_X86_SIMD
+// SSE2 path: one ray against 2 spheres per instruction
+__attribute__((target("sse2")))
+int intersect_leaf_sse2(const Ray* ray, int first, int count,
+                        int accept_exit, double* closest_t) {
+    Vec3 d = ray->direction;
+    __m128d ox = _mm_set1_pd(ray->origin.x), oy = _mm_set1_pd(ray->origin.y), oz = _mm_set1_pd(ray->origin.z);
+    __m128d dx = _mm_set1_pd(d.x), dy = _mm_set1_pd(d.y), dz = _mm_set1_pd(d.z);
+    __m128d a = _mm_set1_pd(vec3_dot(d, d));
+    __m128d two_a = _mm_mul_pd(_mm_set1_pd(2.0), a);
+    __m128d four_a = _mm_mul_pd(_mm_set1_pd(4.0), a);
+    __m128d two = _mm_set1_pd(2.0);
+    __m128d zero = _mm_setzero_pd();
+    int best = -1;
+    
+    for (int i = first; i < first + count; i += 2) {
+        __m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(&sphere_soa.cx[i]));
+        __m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(&sphere_soa.cy[i]));
+        __m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(&sphere_soa.cz[i]));
+        __m128d b = _mm_mul_pd(two, _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz)));
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)),
+                               _mm_loadu_pd(&sphere_soa.radius2[i]));
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(four_a, c));
+        if (_mm_movemask_pd(_mm_cmpge_pd(disc, zero)) == 0) continue;
         
-        Ray reflected_ray = {vec3_add(point, vec3_multiply(normal, 0.001)), reflection_direction};
-        Color reflected_color = trace_ray(reflected_ray, depth + 1);
+        __m128d root = _mm_sqrt_pd(_mm_max_pd(disc, zero));
+        __m128d neg_b = _mm_sub_pd(zero, b);
+        double t1[2], t2[2], dd[2];
+        _mm_storeu_pd(t1, _mm_div_pd(_mm_sub_pd(neg_b, root), two_a));
+        _mm_storeu_pd(t2, _mm_div_pd(_mm_add_pd(neg_b, root), two_a));
+        _mm_storeu_pd(dd, disc);
         
-        color = color_add(
-            color_scale(color, 1 - reflectivity),
-            color_scale(reflected_color, reflectivity)
-        );
+        int lanes = first + count - i < 2 ? first + count - i : 2;
+        best = pick_closest_lane(t1, t2, dd, i, lanes, accept_exit, closest_t, best);
     }
+    return best;
+}
+
+// SSE2 slab test against both child boxes at once
+__attribute__((target("sse2")))
+void intersect_children_sse2(const ChildBounds* bounds, const Ray* ray,
+                             Vec3 inv_direction, double t_max, double* t_child) {
+    __m128d ox = _mm_set1_pd(ray->origin.x), oy = _mm_set1_pd(ray->origin.y), oz = _mm_set1_pd(ray->origin.z);
+    __m128d ix = _mm_set1_pd(inv_direction.x), iy = _mm_set1_pd(inv_direction.y), iz = _mm_set1_pd(inv_direction.z);
     
-    return clamp_color(color);
+    __m128d tx1 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(bounds->min_x), ox), ix);
+    __m128d tx2 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(bounds->max_x), ox), ix);
+    __m128d t_near = _mm_min_pd(tx1, tx2), t_far = _mm_max_pd(tx1, tx2);
+    
+    __m128d ty1 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(bounds->min_y), oy), iy);
+    __m128d ty2 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(bounds->max_y), oy), iy);
+    t_near = _mm_max_pd(t_near, _mm_min_pd(ty1, ty2));
+    t_far = _mm_min_pd(t_far, _mm_max_pd(ty1, ty2));
+    
+    __m128d tz1 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(bounds->min_z), oz), iz);
+    __m128d tz2 = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(bounds->max_z), oz), iz);
+    t_near = _mm_max_pd(t_near, _mm_min_pd(tz1, tz2));
+    t_far = _mm_min_pd(t_far, _mm_max_pd(tz1, tz2));
+    
+    // Hit when t_near <= t_far, t_far >= 0 and t_near <= t_max
+    __m128d zero = _mm_setzero_pd();
+    __m128d hit = _mm_and_pd(_mm_cmple_pd(t_near, t_far),
+                             _mm_and_pd(_mm_cmpge_pd(t_far, zero),
+                                        _mm_cmple_pd(t_near, _mm_set1_pd(t_max))));
+    __m128d entry = _mm_max_pd(t_near, zero);
+    _mm_storeu_pd(t_child, _mm_or_pd(_mm_and_pd(hit, entry),
+                                     _mm_andnot_pd(hit, _mm_set1_pd(-1.0))));
 }
 
-// Initialize scene
-void init_scene() {
-    // Add spheres
-    spheres[0] = (Sphere){
-        {0, -1, 3}, 1, {255, 0, 0}, 500, 0.2 // Red sphere
-    };
-    spheres[1] = (Sphere){
-        {2, 0, 4}, 1, {0, 0, 255}, 500, 0.3 // Blue sphere
-    };
-    spheres[2] = (Sphere){
-        {-2, 0, 4}, 1, {0, 255, 0}, 10, 0.4 // Green sphere
-    };
-    spheres[3] = (Sphere){
-        {0, -5001, 0}, 5000, {255, 255, 0}, 1000, 0.5 // Yellow ground
-    };
-    sphere_count = 4;
+// AVX2 path: one ray against 4 spheres per instruction. FMA is left out
+// of the target so results match the scalar path bit for bit.
+__attribute__((target("avx2")))
+int intersect_leaf_avx2(const Ray* ray, int first, int count,
+                        int accept_exit, double* closest_t) {
+    Vec3 d = ray->direction;
+    __m256d ox = _mm256_set1_pd(ray->origin.x), oy = _mm256_set1_pd(ray->origin.y), oz = _mm256_set1_pd(ray->origin.z);
+    __m256d dx = _mm256_set1_pd(d.x), dy = _mm256_set1_pd(d.y), dz = _mm256_set1_pd(d.z);
+    __m256d a = _mm256_set1_pd(vec3_dot(d, d));
+    __m256d two_a = _mm256_mul_pd(_mm256_set1_pd(2.0), a);
+    __m256d four_a = _mm256_mul_pd(_mm256_set1_pd(4.0), a);
+    __m256d two = _mm256_set1_pd(2.0);
+    __m256d zero = _mm256_setzero_pd();
+    int best = -1;
     
-    // Add lights
-    lights[0] = (Light){
-        {0, 2, 0}, {255, 255, 255}, 0.8 // White light
-    };
-    lights[1] = (Light){
-        {2, 1, 0}, {255, 0, 0}, 0.5 // Red light
-    };
-    light_count = 2;
+    for (int i = first; i < first + count; i += 4) {
+        __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(&sphere_soa.cx[i]));
+        __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(&sphere_soa.cy[i]));
+        __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(&sphere_soa.cz[i]));
+        __m256d b = _mm256_mul_pd(two, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz)));
+        __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+                                  _mm256_loadu_pd(&sphere_soa.radius2[i]));
+        __m256d disc = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(four_a, c));
+        if (_mm256_movemask_pd(_mm256_cmp_pd(disc, zero, _CMP_GE_OQ)) == 0) continue;
+        
+        __m256d root = _mm256_sqrt_pd(_mm256_max_pd(disc, zero));
+        __m256d neg_b = _mm256_sub_pd(zero, b);
+        double t1[4], t2[4], dd[4];
+        _mm256_storeu_pd(t1, _mm256_div_pd(_mm256_sub_pd(neg_b, root), two_a));
+        _mm256_storeu_pd(t2, _mm256_div_pd(_mm256_add_pd(neg_b, root), two_a));
+        _mm256_storeu_pd(dd, disc);
+        
+        int lanes = first + count - i < 4 ? first + count - i : 4;
+        best = pick_closest_lane(t1, t2, dd, i, lanes, accept_exit, closest_t, best);
+    }
+    return best;
 }
+#endif
 
-// Save image to PPM file
-void save_image(Color* pixels, const char* filename) {
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        printf("Error: Could not open file %s for writing\n", filename);
-        return;
+LeafIntersectFn intersect_leaf = intersect_leaf_scalar;
+ChildIntersectFn intersect_children = intersect_children_scalar;
+
+// Choose the widest leaf kernel the CPU supports. requested may be
+// "scalar", "sse2", "avx2" or NULL for automatic selection.
+const char* select_simd_path(const char* requested) {
+    int want_avx2 = 1, want_sse2 = 1;
+    if (requested && strcmp(requested, "scalar") == 0) want_avx2 = want_sse2 = 0;
+    if (requested && strcmp(requested, "sse2") == 0) want_avx2 = 0;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (want_avx2 && __builtin_cpu_supports("avx2")) {
+        intersect_leaf = intersect_leaf_avx2;
+        intersect_children = intersect_children_sse2;
+        return "avx2";
+    }
+    if (want_sse2 && __builtin_cpu_supports("sse2")) {
+        intersect_leaf = intersect_leaf_sse2;
+        intersect_children = intersect_children_sse2;
+        return "sse2";
     }
+#else
+    (void)want_avx2;
+    (void)want_sse2;
+#endif
+    intersect_leaf = intersect_leaf_scalar;
+    intersect_children = intersect_children_scalar;
+    return "scalar";
+}
+
+// Find the closest sphere hit along the ray closer than t_max using a
+// stack-based BVH traversal. Returns the sphere index or -1.
+int intersect_spheres(Ray ray, double t_max, int accept_exit, double* t_hit, RenderStats* stats) {
+    if (scene_bvh.node_count == 0) return -1;
     
-    fprintf(file, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
+    Vec3 inv_direction = {1.0 / ray.direction.x, 1.0 / ray.direction.y, 1.0 / ray.direction.z};
+    int stack[BVH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    int hit_index = -1;
+    double closest_t = t_max;
     
-    for (int i = 0; i < WIDTH * HEIGHT; i++) {
-        fputc(pixels[i].r, file);
-        fputc(pixels[i].g, file);
-        fputc(pixels[i].b, file);
+    stats->box_tests++;
+    if (intersect_ray_aabb(ray.origin, inv_direction, scene_bvh.nodes[0].bounds, closest_t) < 0) {
+        return -1;
     }
+    stack[stack_size++] = 0;
     
-    fclose(file);
-    printf("Image saved as %s\n", filename);
+    while (stack_size > 0) {
+        int node_index = stack[--stack_size];
+        const BVHNode* node = &scene_bvh.nodes[node_index];
+        
+        if (node->count > 0) {
+            stats->sphere_tests += node->count;
+            int slot = intersect_leaf(&ray, node->first, node->count, accept_exit, &closest_t);
+            if (slot >= 0) {
+                hit_index = scene_bvh.indices[slot];
+            }
+            continue;
+        }
+        
+        // Visit the nearer child first by pushing it last
+        int left = node->first, right = node->first + 1;
+        double t_child[2];
+        intersect_children(&child_bounds[node_index], &ray, inv_direction, closest_t, t_child);
+        stats->box_tests += 2;
+        double t_left = t_child[0], t_right = t_child[1];
+        
+        if (t_left >= 0 && t_right >= 0) {
+            if (t_left < t_right) {
+                stack[stack_size++] = right;
+                stack[stack_size++] = left;
+            } else {
+                stack[stack_size++] = left;
+                stack[stack_size++] = right;
+            }
+        } else if (t_left >= 0) {
+            stack[stack_size++] = left;
+        } else if (t_right >= 0) {
+            stack[stack_size++] = right;
+        }
+    }
+    
+    *t_hit = closest_t;
+    return hit_index;
 }
 
-int main() {
-    printf("Ray Tracer - Generating 3D scene...\n");
+WatertightRay watertight_setup(Vec3 direction) {
+    WatertightRay w;
+    double ax = fabs(direction.x), ay = fabs(direction.y), az = fabs(direction.z);
+    w.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    w.kx = (w.kz + 1) % 3;
+    w.ky = (w.kx + 1) % 3;
     
-    // Initialize scene
-    init_scene();
+    // Swap x and y to keep the triangle winding when looking down -z
+    double dz = vec3_axis(direction, w.kz);
+    if (dz < 0) {
+        int tmp = w.kx;
+        w.kx = w.ky;
+        w.ky = tmp;
+    }
+    w.sx = vec3_axis(direction, w.kx) / dz;
+    w.sy = vec3_axis(direction, w.ky) / dz;
+    w.sz = 1.0 / dz;
+    return w;
+}
+
+// Watertight ray/triangle intersection (Woop, Benthin and Wald 2013).
+// Edge tests are done in a sheared space where the ray is the +z axis,
+// so rays through shared edges and vertices never slip between
+// neighboring triangles. Both sides of the triangle are hit.
+// Returns the distance or -1.
+double intersect_ray_triangle(const Ray* ray, const WatertightRay* w,
+                              const Triangle* tri, double t_max) {
+    Vec3 a = vec3_subtract(tri->v0, ray->origin);
+    Vec3 b = vec3_subtract(tri->v1, ray->origin);
+    Vec3 c = vec3_subtract(tri->v2, ray->origin);
     
-    // Allocate pixel buffer
-    Color* pixels = malloc(WIDTH * HEIGHT * sizeof(Color));
-    if (!pixels) {
-        printf("Error: Failed to allocate memory for pixels\n");
-        return 1;
+    double az = vec3_axis(a, w->kz), bz = vec3_axis(b, w->kz), cz = vec3_axis(c, w->kz);
+    double ax = vec3_axis(a, w->kx) - w->sx * az;
+    double ay = vec3_axis(a, w->ky) - w->sy * az;
+    double bx = vec3_axis(b, w->kx) - w->sx * bz;
+    double by = vec3_axis(b, w->ky) - w->sy * bz;
+    double cx = vec3_axis(c, w->kx) - w->sx * cz;
+    double cy = vec3_axis(c, w->ky) - w->sy * cz;
+    
+    // Scaled barycentric coordinates; mixed signs mean a miss
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double wt = bx * ay - by * ax;
+    if ((u < 0 || v < 0 || wt < 0) && (u > 0 || v > 0 || wt > 0)) return -1;
+    
+    double det = u + v + wt;
+    if (det == 0) return -1;
+    
+    double t = (u * (w->sz * az) + v * (w->sz * bz) + wt * (w->sz * cz)) / det;
+    if (t <= 0.001 || t >= t_max) return -1;
+    return t;
+}
+
+// Closest triangle of a mesh hit nearer than t_max. Returns the triangle
+// index (in leaf order) or -1.
+int intersect_mesh(const Mesh* mesh, const Ray* ray, const WatertightRay* w,
+                   Vec3 inv_direction, double t_max, double* t_hit, RenderStats* stats) {
+    if (mesh->bvh.node_count == 0) return -1;
+    stats->box_tests++;
+    if (intersect_ray_aabb(ray->origin, inv_direction, mesh->bvh.nodes[0].bounds, t_max) < 0) {
+        return -1;
     }
     
-    // Camera setup
-    Vec3 camera_position = {0, 0, 0};
+    int stack[BVH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    int hit_index = -1;
+    double closest_t = t_max;
+    stack[stack_size++] = 0;
     
-    // Render scene
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            // Convert pixel coordinates to normalized device coordinates
-            double ndc_x = (x + 0.5) / WIDTH;
-            double ndc_y = (y + 0.5) / HEIGHT;
-            
-            // Convert to screen space coordinates (-1 to 1)
-            double screen_x = 2 * ndc_x - 1;
-            double screen_y = 1 - 2 * ndc_y; // Flip Y axis
-            
-            // Aspect ratio correction
-            screen_x *= (double)WIDTH / HEIGHT;
-            
-            // Create ray direction
-            Vec3 ray_direction = vec3_normalize((Vec3){screen_x, screen_y, 1});
-            
-            // Create ray
-            Ray ray = {camera_position, ray_direction};
-            
-            // Trace ray and get color
-            Color color = trace_ray(ray, 0);
-            
-            // Store pixel
-            pixels[y * WIDTH + x] = color;
+    while (stack_size > 0) {
+        int node_index = stack[--stack_size];
+        const BVHNode* node = &mesh->bvh.nodes[node_index];
+        
+        if (node->count > 0) {
+            stats->triangle_tests += node->count;
+            for (int i = node->first; i < node->first + node->count; i++) {
+                double t = intersect_ray_triangle(ray, w, &mesh->triangles[i], closest_t);
+                if (t > 0) {
+                    closest_t = t;
+                    hit_index = i;
+                }
+            }
+            continue;
         }
         
-        // Progress indicator
-        if (y % (HEIGHT / 10) == 0) {
-            printf("Rendering progress: %d%%\n", (y * 100) / HEIGHT);
+        // Visit the nearer child first by pushing it last
+        int left = node->first, right = node->first + 1;
+        double t_child[2];
+        intersect_children(&mesh->child_bounds[node_index], ray, inv_direction, closest_t, t_child);
+        stats->box_tests += 2;
+        
+        if (t_child[0] >= 0 && t_child[1] >= 0) {
+            if (t_child[0] < t_child[1]) {
+                stack[stack_size++] = right;
+                stack[stack_size++] = left;
+            } else {
+                stack[stack_size++] = left;
+                stack[stack_size++] = right;
+            }
+        } else if (t_child[0] >= 0) {
+            stack[stack_size++] = left;
+        } else if (t_child[1] >= 0) {
+            stack[stack_size++] = right;
         }
     }
     
-    // Save image
-    save_image(pixels, "raytracer_output.ppm");
+    *t_hit = closest_t;
+    return hit_index;
+}
+
+// Closest intersection with any sphere or mesh triangle nearer than t_max.
+// Returns 1 and fills hit if something was hit.
+int intersect_scene(Ray ray, double t_max, int accept_exit, Hit* hit, RenderStats* stats) {
+    hit->t = t_max;
+    hit->sphere = -1;
+    hit->mesh = -1;
+    hit->triangle = -1;
     
-    // Cleanup
-    free(pixels);
+    double t;
+    int sphere = intersect_spheres(ray, hit->t, accept_exit, &t, stats);
+    if (sphere >= 0) {
+        hit->t = t;
+        hit->sphere = sphere;
+    }
     
-    printf("Ray tracing complete! Image saved as raytracer_output.ppm\n");
-    printf("You can view the image with any program that supports PPM format.\n");
+    if (mesh_count > 0) {
+        WatertightRay w = watertight_setup(ray.direction);
+        Vec3 inv_direction = {1.0 / ray.direction.x, 1.0 / ray.direction.y, 1.0 / ray.direction.z};
+        for (int m = 0; m < mesh_count; m++) {
+            int triangle = intersect_mesh(&meshes[m], &ray, &w, inv_direction, hit->t, &t, stats);
+            if (triangle >= 0) {
+                hit->t = t;
+                hit->sphere = -1;
+                hit->mesh = m;
+                hit->triangle = triangle;
+            }
+        }
+    }
     
-    return 0;
-}
\ No newline at end of file
+    return hit->sphere >= 0 || hit->mesh >= 0;
+}
+
+// Any-hit query against the sphere BVH: returns the first sphere found
+// between the ray origin and t_max (not necessarily the closest), or -1.
+// Children are visited in any order since the search stops at a hit.
+int occluded_spheres(Ray ray, double t_max, RenderStats* stats) {
+    if (scene_bvh.node_count == 0) return -1;
+    
+    Vec3 inv_direction = {1.0 / ray.direction.x, 1.0 / ray.direction.y, 1.0 / ray.direction.z};
+    stats->box_tests++;
+    if (intersect_ray_aabb(ray.origin, inv_direction, scene_bvh.nodes[0].bounds, t_max) < 0) {
+        return -1;
+    }
+    
+    int stack[BVH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    
+    while (stack_size > 0) {
+        int node_index = stack[--stack_size];
+        const BVHNode* node = &scene_bvh.nodes[node_index];
+        
+        if (node->count > 0) {
+            stats->sphere_tests += node->count;
+            double t = t_max;
+            int slot = intersect_leaf(&ray, node->first, node->count, 0, &t);
+            if (slot >= 0) return scene_bvh.indices[slot];
+            continue;
+        }
+        
+        double t_child[2];
+        intersect_children(&child_bounds[node_index], &ray, inv_direction, t_max, t_child);
+        stats->box_tests += 2;
+        if (t_child[0] >= 0) stack[stack_size++] = node->first;
+        if (t_child[1] >= 0) stack[stack_size++] = node->first + 1;
+    }
+    return -1;
+}
+
+// Any-hit query against one mesh; returns a blocking triangle or -1
+int occluded_mesh(const Mesh* mesh, const Ray* ray, const WatertightRay* w,
+                  Vec3 inv_direction, double t_max, RenderStats* stats) {
+    if (mesh->bvh.node_count == 0) return -1;
+    stats->box_tests++;
+    if (intersect_ray_aabb(ray->origin, inv_direction, mesh->bvh.nodes[0].bounds, t_max) < 0) {
+        return -1;
+    }
+    
+    int stack[BVH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    
+    while (stack_size > 0) {
+        int node_index = stack[--stack_size];
+        const BVHNode* node = &mesh->bvh.nodes[node_index];
+        
+        if (node->count > 0) {
+            for (int i = node->first; i < node->first + node->count; i++) {
+                stats->triangle_tests++;
+                if (intersect_ray_triangle(ray, w, &mesh->triangles[i], t_max) > 0) return i;
+            }
+            continue;
+        }
+        
+        double t_child[2];
+        intersect_children(&mesh->child_bounds[node_index], ray, inv_direction, t_max, t_child);
+        stats->box_tests += 2;
+        if (t_child[0] >= 0) stack[stack_size++] = node->first;
+        if (t_child[1] >= 0) stack[stack_size++] = node->first + 1;
+    }
+    return -1;
+}
+
+// Is anything between the ray origin and t_max? The cached occluder is
+// tried first: neighboring shadow rays toward the same light are usually
+// blocked by the same object, which then costs a single test. On a miss
+// the any-hit traversals run and the cache is updated.
+int occluded(Ray ray, double t_max, Occluder* cache, RenderStats* stats) {
+    if (cache->sphere >= 0) {
+        stats->sphere_tests++;
+        double t = sphere_hit_distance(ray, &spheres[cache->sphere], 0);
+        if (t > 0 && t < t_max) return 1;
+    } else if (cache->mesh >= 0) {
+        WatertightRay w = watertight_setup(ray.direction);
+        const Triangle* tri = &meshes[cache->mesh].triangles[cache->triangle];
+        stats->triangle_tests++;
+        if (intersect_ray_triangle(&ray, &w, tri, t_max) > 0) return 1;
+    }
+    
+    int sphere = occluded_spheres(ray, t_max, stats);
+    if (sphere >= 0) {
+        cache->sphere = sphere;
+        cache->mesh = -1;
+        return 1;
+    }
+    
+    if (mesh_count > 0) {
+        WatertightRay w = watertight_setup(ray.direction);
+        Vec3 inv_direction = {1.0 / ray.direction.x, 1.0 / ray.direction.y, 1.0 / ray.direction.z};
+        for (int m = 0; m < mesh_count; m++) {
+            int triangle = occluded_mesh(&meshes[m], &ray, &w, inv_direction, t_max, stats);
+            if (triangle >= 0) {
+                cache->sphere = -1;
+                cache->mesh = m;
+                cache->triangle = triangle;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Check if point is in shadow with respect to light light_index, given
+// the unit direction and distance to it
+int is_in_shadow(Vec3 point, Vec3 light_direction, double light_distance,
+                 int light_index, ThreadContext* ctx) {
+    Ray shadow_ray = {vec3_madd(point, light_direction, 0.001), light_direction};
+    
+    ctx->stats.shadow_rays++;
+    return occluded(shadow_ray, light_distance, &ctx->last_occluder[light_index], &ctx->stats);
+}
+
+// Set up a thread's context; returns 0 on allocation failure
+int thread_context_init(ThreadContext* ctx) {
+    ctx->last_occluder = malloc((light_count > 0 ? light_count : 1) * sizeof(Occluder));
+    if (!ctx->last_occluder) return 0;
+    for (int i = 0; i < light_count; i++) {
+        ctx->last_occluder[i] = (Occluder){-1, -1, -1};
+    }
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    return 1;
+}
+
+void thread_context_free(ThreadContext* ctx) {
+    free(ctx->last_occluder);
+    ctx->last_occluder = NULL;
+}
+
+// Add the light that light light_index sends toward view_direction from
+// point, if it is not in shadow. normal and view_direction must be unit
+// vectors.
+void shade_light(ColorF* color, int light_index, Vec3 point, Vec3 normal, Vec3 view_direction,
+                 ColorF surface_color, int surface_specular, ThreadContext* ctx) {
+    const Light* light = &lights[light_index];
+    
+    // Direction and distance to the light, shared with the shadow ray
+    Vec3 to_light = vec3_subtract(light->position, point);
+    double light_distance = vec3_length(to_light);
+    Vec3 light_direction = vec3_multiply(to_light, 1.0 / light_distance);
+    
+    // Diffuse lighting
+    double cos_theta = vec3_dot(normal, light_direction);
+    float diffuse_intensity = cos_theta > 0 ? (float)cos_theta : 0;
+    
+    // Specular lighting
+    Vec3 reflection = vec3_madd(vec3_negate(light_direction), normal, 2 * cos_theta);
+    double specular_intensity = vec3_dot(reflection, view_direction);
+    float specular = specular_intensity > 0 ? (float)pow(specular_intensity, surface_specular) : 0;
+    
+    // A light that would add nothing needs no shadow ray
+    if (diffuse_intensity == 0 && specular == 0) {
+        return;
+    }
+    if (is_in_shadow(point, light_direction, light_distance, light_index, ctx)) {
+        return;
+    }
+    
+    float intensity = (float)light->intensity;
+    *color = color_madd(*color, surface_color, diffuse_intensity * intensity);
+    float highlight = 255 * specular * intensity;
+    *color = color_add(*color, (ColorF){highlight, highlight, highlight});
+}
+
+// Compute lighting at a point. normal and view_direction must be unit
+// vectors.
+ColorF compute_lighting(Vec3 point, Vec3 normal, Vec3 view_direction,
+                        ColorF surface_color, int surface_specular, ThreadContext* ctx) {
+    ColorF final_color = {0, 0, 0};
+    
+    for (int i = 0; i < light_count; i++) {
+        shade_light(&final_color, i, point, normal, view_direction, surface_color, surface_specular, ctx);
+    }
+    
+    return final_color;
+}
+
+// Surface normal and material where ray hit the scene at point
+Surface surface_at(const Ray* ray, const Hit* hit, Vec3 point) {
+    Surface surface;
+    if (hit->sphere >= 0) {
+        const Sphere* sphere = &spheres[hit->sphere];
+        surface.normal = get_sphere_normal(sphere, point);
+        surface.color = sphere->color;
+        surface.specular = sphere->specular;
+        surface.reflectivity = sphere->reflective;
+    } else {
+        const Mesh* mesh = &meshes[hit->mesh];
+        surface.normal = get_triangle_normal(&mesh->triangles[hit->triangle], ray->direction);
+        surface.color = mesh->material.color;
+        surface.specular = mesh->material.specular;
+        surface.reflectivity = mesh->material.reflective;
+    }
+    return surface;
+}
+
+// Trace a ray and return color. The ray direction must be a unit vector;
+// reflected rays keep unit length, so nothing is renormalized on the way.
+ColorF trace_ray(Ray ray, int depth, ThreadContext* ctx) {
+    if (depth >= max_depth) {
+        return (ColorF){0, 0, 0}; // Black for maximum depth
+    }
+    
+    // Find closest intersection
+    Hit hit;
+    if (!intersect_scene(ray, 1e308, 1, &hit, &ctx->stats)) {
+        return color_to_float(background_color); // No intersection found
+    }
+    
+    // Get intersection point, surface normal and material
+    Vec3 point = vec3_madd(ray.origin, ray.direction, hit.t);
+    Surface surface = surface_at(&ray, &hit, point);
+    
+    // Compute lighting
+    Vec3 view_direction = vec3_negate(ray.direction);
+    ColorF color = compute_lighting(point, surface.normal, view_direction,
+                                    color_to_float(surface.color), surface.specular, ctx);
+    
+    // Handle reflection
+    double reflectivity = surface.reflectivity;
+    if (reflectivity > 0 && depth < max_depth) {
+        Ray reflected_ray = {vec3_madd(point, surface.normal, 0.001), vec3_reflect(ray.direction, surface.normal)};
+        ctx->stats.reflection_rays++;
+        ColorF reflected_color = trace_ray(reflected_ray, depth + 1, ctx);
+        
+        color = color_madd(color_scale(clamp_color(color), (float)(1 - reflectivity)),
+                           reflected_color, (float)reflectivity);
+    }
+    
+    return clamp_color(color);
+}
+
+// Next PCG32 output (O'Neill 2014): a 64-bit LCG step with a permuted
+// 32-bit output. Small and fast enough to call several times per bounce.
+static inline unsigned int rng_next(Rng* rng) {
+    unsigned long long old = rng->state;
+    rng->state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+    unsigned int xorshifted = (unsigned int)(((old >> 18) ^ old) >> 27);
+    unsigned int rot = (unsigned int)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+// Uniform float in [0, 1)
+static inline float rng_float(Rng* rng) {
+    return (rng_next(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Build the light selection table: each light is picked for next-event
+// estimation with probability proportional to its power, so dim lights
+// cost few shadow rays. Returns 0 on allocation failure.
+int build_light_distribution() {
+    free(light_cdf);
+    light_cdf = malloc((light_count > 0 ? light_count : 1) * sizeof(double));
+    if (!light_cdf) return 0;
+    
+    double total = 0;
+    for (int i = 0; i < light_count; i++) {
+        const Light* light = &lights[i];
+        double power = light->intensity * (light->color.r + light->color.g + light->color.b) / 765.0;
+        total += power > 0 ? power : 0;
+        light_cdf[i] = total;
+    }
+    for (int i = 0; i < light_count; i++) {
+        // All lights dark: pick uniformly, they add nothing anyway
+        light_cdf[i] = total > 0 ? light_cdf[i] / total : (double)(i + 1) / light_count;
+    }
+    if (light_count > 0) {
+        light_cdf[light_count - 1] = 1.0;
+    }
+    return 1;
+}
+
+// Light for the uniform number u, and the probability it had of being picked
+int sample_light(float u, double* probability) {
+    int lo = 0, hi = light_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (u < light_cdf[mid]) hi = mid; else lo = mid + 1;
+    }
+    *probability = light_cdf[lo] - (lo > 0 ? light_cdf[lo - 1] : 0);
+    return lo;
+}
+
+// Cosine-weighted direction in the hemisphere around unit normal n. The
+// tangent frame is the branchless construction of Duff et al. (2017).
+Vec3 sample_cosine_hemisphere(Vec3 n, float u1, float u2) {
+    double sign = n.z >= 0 ? 1.0 : -1.0;
+    double a = -1.0 / (sign + n.z);
+    double b = n.x * n.y * a;
+    Vec3 tangent = {1 + sign * n.x * n.x * a, sign * b, -sign * n.x};
+    Vec3 bitangent = {b, sign + n.y * n.y * a, -n.y};
+    
+    double r = sqrt(u1);
+    double phi = 2 * PI * u2;
+    Vec3 direction = vec3_multiply(n, sqrt(1 - u1));
+    direction = vec3_madd(direction, tangent, r * cos(phi));
+    return vec3_madd(direction, bitangent, r * sin(phi));
+}
+
+// Trace one Monte Carlo light path and return the radiance along ray. At
+// every hit one light, chosen by power, is sampled directly with a shadow
+// ray; the path then continues as a mirror bounce (with probability equal
+// to the reflectivity) or a cosine-weighted diffuse bounce. Rays that
+// escape pick up the background, which lights the scene like a sky. After
+// PATH_RR_DEPTH bounces Russian roulette ends dim paths early and boosts
+// the survivors, so the estimate stays unbiased.
+ColorF trace_path(Ray ray, ThreadContext* ctx) {
+    ColorF radiance = {0, 0, 0};
+    ColorF throughput = {1, 1, 1};
+    
+    for (int bounce = 0; bounce < PATH_MAX_BOUNCES; bounce++) {
+        Hit hit;
+        if (!intersect_scene(ray, 1e308, 1, &hit, &ctx->stats)) {
+            ColorF sky = color_to_float(background_color);
+            radiance = color_add(radiance, (ColorF){throughput.r * sky.r, throughput.g * sky.g,
+                                                     throughput.b * sky.b});
+            break;
+        }
+        
+        Vec3 point = vec3_madd(ray.origin, ray.direction, hit.t);
+        Surface surface = surface_at(&ray, &hit, point);
+        Vec3 normal = surface.normal;
+        if (vec3_dot(normal, ray.direction) > 0) {
+            normal = vec3_negate(normal);   // Inside of a sphere
+        }
+        ColorF surface_color = color_to_float(surface.color);
+        
+        // Direct light on the non-mirror part of the surface, tinted by the
+        // light's color
+        float diffuse_weight = (float)(1 - surface.reflectivity);
+        if (light_count > 0 && diffuse_weight > 0) {
+            double probability;
+            int i = sample_light(rng_float(&ctx->rng), &probability);
+            ColorF direct = {0, 0, 0};
+            shade_light(&direct, i, point, normal, vec3_negate(ray.direction),
+                        surface_color, surface.specular, ctx);
+            
+            float weight = diffuse_weight / (float)probability / 255;
+            radiance.r += throughput.r * direct.r * lights[i].color.r * weight;
+            radiance.g += throughput.g * direct.g * lights[i].color.g * weight;
+            radiance.b += throughput.b * direct.b * lights[i].color.b * weight;
+        }
+        
+        // Choose how the path continues
+        if (rng_float(&ctx->rng) < surface.reflectivity) {
+            ray = (Ray){vec3_madd(point, normal, 0.001), vec3_reflect(ray.direction, normal)};
+            ctx->stats.reflection_rays++;
+        } else {
+            float u1 = rng_float(&ctx->rng);
+            float u2 = rng_float(&ctx->rng);
+            ray = (Ray){vec3_madd(point, normal, 0.001), sample_cosine_hemisphere(normal, u1, u2)};
+            throughput = (ColorF){throughput.r * surface_color.r / 255, throughput.g * surface_color.g / 255,
+                                  throughput.b * surface_color.b / 255};
+            ctx->stats.diffuse_rays++;
+        }
+        
+        if (bounce + 1 >= PATH_RR_DEPTH) {
+            float survive = throughput.r > throughput.g ? throughput.r : throughput.g;
+            if (throughput.b > survive) survive = throughput.b;
+            if (survive > 0.95f) survive = 0.95f;
+            if (rng_float(&ctx->rng) >= survive) break;
+            throughput = color_scale(throughput, 1 / survive);
+        }
+    }
+    
+    return radiance;
+}
+
+// Append a sphere to the scene, growing the array as needed
+int add_sphere(Sphere sphere) {
+    if (sphere_count == sphere_capacity) {
+        int capacity = sphere_capacity ? sphere_capacity * 2 : 16;
+        Sphere* grown = realloc(spheres, capacity * sizeof(Sphere));
+        if (!grown) return 0;
+        spheres = grown;
+        sphere_capacity = capacity;
+    }
+    spheres[sphere_count++] = sphere;
+    return 1;
+}
+
+// Append a light to the scene, growing the array as needed
+int add_light(Light light) {
+    if (light_count == light_capacity) {
+        int capacity = light_capacity ? light_capacity * 2 : 8;
+        Light* grown = realloc(lights, capacity * sizeof(Light));
+        if (!grown) return 0;
+        lights = grown;
+        light_capacity = capacity;
+    }
+    lights[light_count++] = light;
+    return 1;
+}
+
+// Append a camera path keyframe, growing the array as needed
+int add_keyframe(Camera keyframe) {
+    if (keyframe_count == keyframe_capacity) {
+        int capacity = keyframe_capacity ? keyframe_capacity * 2 : 8;
+        Camera* grown = realloc(keyframes, capacity * sizeof(Camera));
+        if (!grown) return 0;
+        keyframes = grown;
+        keyframe_capacity = capacity;
+    }
+    keyframes[keyframe_count++] = keyframe;
+    return 1;
+}
+
+// Camera at the origin looking down +z, as in the original renderer
+void default_camera(Camera* cam) {
+    cam->position = (Vec3){0, 0, 0};
+    cam->look_at = (Vec3){0, 0, 1};
+    cam->up = (Vec3){0, 1, 0};
+    cam->fov = DEFAULT_FOV;
+}
+
+// Derive the camera basis; returns 0 if the view direction is degenerate
+int setup_camera(Camera* cam) {
+    Vec3 forward = vec3_subtract(cam->look_at, cam->position);
+    if (vec3_length(forward) == 0) return 0;
+    cam->forward = vec3_normalize(forward);
+    
+    Vec3 right = vec3_cross(cam->up, cam->forward);
+    if (vec3_length(right) == 0) return 0;
+    cam->right = vec3_normalize(right);
+    cam->true_up = vec3_cross(cam->forward, cam->right);
+    cam->scale = tan(cam->fov * PI / 360.0);
+    return 1;
+}
+
+// Catmull-Rom spline through p1 (t = 0) and p2 (t = 1)
+Vec3 catmull_rom(Vec3 p0, Vec3 p1, Vec3 p2, Vec3 p3, double t) {
+    double t2 = t * t, t3 = t2 * t;
+    Vec3 result = vec3_multiply(p1, 2);
+    result = vec3_madd(result, vec3_subtract(p2, p0), t);
+    result = vec3_madd(result, vec3_add(vec3_subtract(vec3_multiply(p0, 2), vec3_multiply(p1, 5)),
+                                        vec3_subtract(vec3_multiply(p2, 4), p3)), t2);
+    result = vec3_madd(result, vec3_add(vec3_subtract(vec3_multiply(p1, 3), p0),
+                                        vec3_subtract(p3, vec3_multiply(p2, 3))), t3);
+    return vec3_multiply(result, 0.5);
+}
+
+// Camera for frame frame of frames, moving along a smooth curve through
+// the keyframes (which are spaced evenly in time). The up vector is the
+// scene camera's. Returns 0 if the interpolated view is degenerate.
+int camera_at_frame(int frame, int frames, Camera* cam) {
+    *cam = keyframes[0];
+    if (keyframe_count > 1 && frames > 1) {
+        double u = (double)frame * (keyframe_count - 1) / (frames - 1);
+        int segment = (int)u < keyframe_count - 1 ? (int)u : keyframe_count - 2;
+        double t = u - segment;
+        
+        const Camera* k0 = &keyframes[segment > 0 ? segment - 1 : 0];
+        const Camera* k1 = &keyframes[segment];
+        const Camera* k2 = &keyframes[segment + 1];
+        const Camera* k3 = &keyframes[segment + 2 < keyframe_count ? segment + 2 : keyframe_count - 1];
+        cam->position = catmull_rom(k0->position, k1->position, k2->position, k3->position, t);
+        cam->look_at = catmull_rom(k0->look_at, k1->look_at, k2->look_at, k3->look_at, t);
+        cam->fov = k1->fov + (k2->fov - k1->fov) * t;
+    }
+    cam->up = camera.up;
+    return setup_camera(cam);
+}
+
+// Initialize scene
+void init_scene() {
+    // Add spheres
+    add_sphere((Sphere){
+        {0, -1, 3}, 1, {255, 0, 0}, 500, 0.2 // Red sphere
+    });
+    add_sphere((Sphere){
+        {2, 0, 4}, 1, {0, 0, 255}, 500, 0.3 // Blue sphere
+    });
+    add_sphere((Sphere){
+        {-2, 0, 4}, 1, {0, 255, 0}, 10, 0.4 // Green sphere
+    });
+    add_sphere((Sphere){
+        {0, -5001, 0}, 5000, {255, 255, 0}, 1000, 0.5 // Yellow ground
+    });
+    
+    // Add lights
+    add_light((Light){
+        {0, 2, 0}, {255, 255, 255}, 0.8 // White light
+    });
+    add_light((Light){
+        {2, 1, 0}, {255, 0, 0}, 0.5 // Red light
+    });
+}
+
+// Small deterministic generator so benchmark scenes are reproducible
+// across platforms (xorshift32)
+unsigned int scene_random(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+double scene_random_range(unsigned int* state, double lo, double hi) {
+    return lo + (hi - lo) * (scene_random(state) / 4294967296.0);
+}
+
+// Benchmark scene: the standard ground and lights plus a field of count
+// small random spheres resting on the ground in front of the camera.
+// The field grows with the count so density stays roughly constant.
+void generate_sphere_field(int count, unsigned int seed) {
+    unsigned int state = seed ? seed : 1;
+    double half_width = 0.5 * sqrt((double)count) * 0.6 + 2.0;
+    int specular_choices[] = {10, 100, 500};
+    
+    add_sphere((Sphere){
+        {0, -5001, 0}, 5000, {255, 255, 0}, 1000, 0.5 // Yellow ground
+    });
+    
+    for (int i = 0; i < count; i++) {
+        double radius = scene_random_range(&state, 0.08, 0.25);
+        Sphere sphere;
+        sphere.center.x = scene_random_range(&state, -half_width, half_width);
+        sphere.center.y = -1 + radius;
+        sphere.center.z = scene_random_range(&state, 2.0, 2.0 + 2 * half_width);
+        sphere.radius = radius;
+        sphere.color.r = (unsigned char)(scene_random(&state) & 0xFF);
+        sphere.color.g = (unsigned char)(scene_random(&state) & 0xFF);
+        sphere.color.b = (unsigned char)(scene_random(&state) & 0xFF);
+        sphere.specular = specular_choices[scene_random(&state) % 3];
+        sphere.reflective = scene_random_range(&state, 0.0, 0.5);
+        if (!add_sphere(sphere)) break;
+    }
+    
+    add_light((Light){
+        {0, 4, 0}, {255, 255, 255}, 0.8 // White light
+    });
+    add_light((Light){
+        {2, 3, 0}, {255, 0, 0}, 0.5 // Red light
+    });
+}
+
+// Scene file parser state. The whole file is read into memory and
+// walked once with a cursor, so loading is linear in the file size.
+typedef struct {
+    char* cursor;
+    const char* filename;
+    int line;
+} SceneParser;
+
+// Open-addressing hash table from material name to index. Lookups stay
+// O(1) no matter how many materials a scene defines.
+typedef struct {
+    Material* materials;
+    int count;
+    int capacity;
+    int* slots;         // Material index + 1, 0 for an empty slot
+    int slot_count;     // Always a power of two
+} MaterialTable;
+
+unsigned int material_hash(const char* name) {
+    unsigned int hash = 2166136261u;    // FNV-1a
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int material_find(const MaterialTable* table, const char* name) {
+    if (table->slot_count == 0) return -1;
+    unsigned int mask = table->slot_count - 1;
+    for (unsigned int i = material_hash(name) & mask; table->slots[i]; i = (i + 1) & mask) {
+        int index = table->slots[i] - 1;
+        if (strcmp(table->materials[index].name, name) == 0) return index;
+    }
+    return -1;
+}
+
+// Add or replace a material; returns 0 on allocation failure
+int material_add(MaterialTable* table, const Material* material) {
+    int existing = material_find(table, material->name);
+    if (existing >= 0) {
+        table->materials[existing] = *material;
+        return 1;
+    }
+    
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 16;
+        Material* grown = realloc(table->materials, capacity * sizeof(Material));
+        if (!grown) return 0;
+        table->materials = grown;
+        table->capacity = capacity;
+    }
+    
+    // Keep the load factor at or below one half
+    if ((table->count + 1) * 2 > table->slot_count) {
+        int slot_count = table->slot_count ? table->slot_count * 2 : 32;
+        int* slots = calloc(slot_count, sizeof(int));
+        if (!slots) return 0;
+        for (int m = 0; m < table->count; m++) {
+            unsigned int i = material_hash(table->materials[m].name) & (slot_count - 1);
+            while (slots[i]) i = (i + 1) & (slot_count - 1);
+            slots[i] = m + 1;
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->slot_count = slot_count;
+    }
+    
+    table->materials[table->count] = *material;
+    unsigned int mask = table->slot_count - 1;
+    unsigned int i = material_hash(material->name) & mask;
+    while (table->slots[i]) i = (i + 1) & mask;
+    table->slots[i] = ++table->count;
+    return 1;
+}
+
+void material_table_free(MaterialTable* table) {
+    free(table->materials);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Read a whole file into a NUL-terminated buffer
+char* read_text_file(const char* filename, long* size_out) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return NULL;
+    
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* text = malloc(size + 1);
+    if (text) {
+        size = (long)fread(text, 1, size, file);
+        text[size] = '\0';
+        if (size_out) *size_out = size;
+    }
+    fclose(file);
+    return text;
+}
+
+// Load a Wavefront OBJ file into a mesh. Only vertex positions ("v") and
+// faces ("f") are used; faces with more than three vertices are split
+// into a triangle fan, and negative (relative) indices are supported.
+// Vertices are scaled and then offset. Builds the mesh BVH and stores
+// triangles in leaf order.
+int load_obj(const char* filename, Vec3 offset, double scale, Mesh* mesh) {
+    char* text = read_text_file(filename, NULL);
+    if (!text) {
+        printf("Error: Could not open mesh file %s\n", filename);
+        return 0;
+    }
+    
+    Vec3* vertices = NULL;
+    int vertex_count = 0, vertex_capacity = 0;
+    Triangle* triangles = NULL;
+    int triangle_count = 0, triangle_capacity = 0;
+    const char* error = NULL;
+    int line = 1;
+    char* p = text;
+    
+    while (*p && !error) {
+        while (*p == ' ' || *p == '\t') p++;
+        
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            char* end;
+            Vec3 v;
+            p += 2;
+            v.x = strtod(p, &end);
+            if (end == p) { error = "bad vertex"; break; }
+            p = end;
+            v.y = strtod(p, &end);
+            if (end == p) { error = "bad vertex"; break; }
+            p = end;
+            v.z = strtod(p, &end);
+            if (end == p) { error = "bad vertex"; break; }
+            p = end;
+            
+            if (vertex_count == vertex_capacity) {
+                int capacity = vertex_capacity ? vertex_capacity * 2 : 1024;
+                Vec3* grown = realloc(vertices, capacity * sizeof(Vec3));
+                if (!grown) { error = "out of memory"; break; }
+                vertices = grown;
+                vertex_capacity = capacity;
+            }
+            vertices[vertex_count++] = vec3_add(vec3_multiply(v, scale), offset);
+        } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            int first = -1, previous = -1, corners = 0;
+            p += 2;
+            
+            for (;;) {
+                while (*p == ' ' || *p == '\t') p++;
+                if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '#') break;
+                
+                char* end;
+                long index = strtol(p, &end, 10);
+                if (end == p || index == 0) { error = "bad face index"; break; }
+                p = end;
+                // Skip texture and normal indices ("v/vt/vn", "v//vn")
+                while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+                
+                int v = index > 0 ? (int)index - 1 : vertex_count + (int)index;
+                if (v < 0 || v >= vertex_count) { error = "face index out of range"; break; }
+                
+                if (corners == 0) {
+                    first = v;
+                } else if (corners >= 2) {
+                    if (triangle_count == triangle_capacity) {
+                        int capacity = triangle_capacity ? triangle_capacity * 2 : 1024;
+                        Triangle* grown = realloc(triangles, capacity * sizeof(Triangle));
+                        if (!grown) { error = "out of memory"; break; }
+                        triangles = grown;
+                        triangle_capacity = capacity;
+                    }
+                    triangles[triangle_count++] = (Triangle){vertices[first], vertices[previous], vertices[v]};
+                }
+                previous = v;
+                corners++;
+            }
+            if (!error && corners < 3) error = "face needs at least three vertices";
+        }
+        
+        // Ignore the rest of the line (normals, texture coordinates, groups...)
+        while (*p && *p != '\n') p++;
+        if (*p == '\n') {
+            p++;
+            line++;
+        }
+    }
+    
+    free(text);
+    free(vertices);
+    if (error) {
+        printf("Error: %s:%d: %s\n", filename, line, error);
+        free(triangles);
+        return 0;
+    }
+    if (triangle_count == 0) {
+        printf("Error: %s: mesh has no triangles\n", filename);
+        return 0;
+    }
+    
+    // Build the mesh BVH, then store triangles in leaf order so each leaf
+    // is a contiguous run
+    AABB* boxes = malloc(triangle_count * sizeof(AABB));
+    Triangle* ordered = malloc(triangle_count * sizeof(Triangle));
+    if (!boxes || !ordered) {
+        printf("Error: Failed to allocate memory for mesh %s\n", filename);
+        free(boxes);
+        free(ordered);
+        free(triangles);
+        return 0;
+    }
+    for (int i = 0; i < triangle_count; i++) {
+        AABB box = {triangles[i].v0, triangles[i].v0};
+        box = aabb_include(box, triangles[i].v1);
+        boxes[i] = aabb_include(box, triangles[i].v2);
+    }
+    int ok = bvh_build(&mesh->bvh, boxes, triangle_count);
+    free(boxes);
+    if (ok) {
+        for (int i = 0; i < triangle_count; i++) {
+            ordered[i] = triangles[mesh->bvh.indices[i]];
+        }
+        mesh->child_bounds = build_child_bounds(&mesh->bvh);
+        ok = mesh->child_bounds != NULL;
+    }
+    free(triangles);
+    if (!ok) {
+        printf("Error: Failed to build BVH for mesh %s\n", filename);
+        free(ordered);
+        bvh_free(&mesh->bvh);
+        return 0;
+    }
+    
+    mesh->triangles = ordered;
+    mesh->triangle_count = triangle_count;
+    snprintf(mesh->filename, sizeof(mesh->filename), "%s", filename);
+    mesh->offset = offset;
+    mesh->scale = scale;
+    return 1;
+}
+
+// Append a loaded mesh to the scene, growing the array as needed
+int add_mesh(Mesh mesh) {
+    if (mesh_count == mesh_capacity) {
+        int capacity = mesh_capacity ? mesh_capacity * 2 : 4;
+        Mesh* grown = realloc(meshes, capacity * sizeof(Mesh));
+        if (!grown) return 0;
+        meshes = grown;
+        mesh_capacity = capacity;
+    }
+    meshes[mesh_count++] = mesh;
+    return 1;
+}
+
+void free_meshes() {
+    for (int m = 0; m < mesh_count; m++) {
+        free(meshes[m].triangles);
+        free(meshes[m].child_bounds);
+        bvh_free(&meshes[m].bvh);
+    }
+    free(meshes);
+    meshes = NULL;
+    mesh_count = mesh_capacity = 0;
+}
+
+// Skip spaces and comments, stopping at the end of the line
+void scene_skip_blank(SceneParser* parser) {
+    char* p = parser->cursor;
+    while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+    if (*p == '#') {
+        while (*p && *p != '\n') p++;
+    }
+    parser->cursor = p;
+}
+
+// Read the next whitespace-delimited word on the current line
+int scene_read_word(SceneParser* parser, char* word, int size) {
+    scene_skip_blank(parser);
+    char* p = parser->cursor;
+    int length = 0;
+    while (*p && !isspace((unsigned char)*p) && *p != '#') {
+        if (length < size - 1) word[length++] = *p;
+        p++;
+    }
+    word[length] = '\0';
+    parser->cursor = p;
+    return length > 0;
+}
+
+int scene_read_number(SceneParser* parser, double* value) {
+    scene_skip_blank(parser);
+    char* end;
+    *value = strtod(parser->cursor, &end);
+    if (end == parser->cursor) return 0;
+    parser->cursor = end;
+    return 1;
+}
+
+int scene_read_vec3(SceneParser* parser, Vec3* v) {
+    return scene_read_number(parser, &v->x) &&
+           scene_read_number(parser, &v->y) &&
+           scene_read_number(parser, &v->z);
+}
+
+int scene_read_color(SceneParser* parser, Color* color) {
+    double r, g, b;
+    if (!scene_read_number(parser, &r) || !scene_read_number(parser, &g) ||
+        !scene_read_number(parser, &b)) {
+        return 0;
+    }
+    if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) return 0;
+    *color = (Color){(unsigned char)r, (unsigned char)g, (unsigned char)b};
+    return 1;
+}
+
+// Require the rest of the line to be empty, then move to the next line
+int scene_end_line(SceneParser* parser) {
+    scene_skip_blank(parser);
+    if (*parser->cursor == '\n') {
+        parser->cursor++;
+        parser->line++;
+        return 1;
+    }
+    return *parser->cursor == '\0';
+}
+
+int path_is_absolute(const char* path) {
+#ifdef _WIN32
+    if (path[0] == '\\' || (isalpha((unsigned char)path[0]) && path[1] == ':')) return 1;
+#endif
+    return path[0] == '/';
+}
+
+// Absolute form of path, which must exist; returns 0 on failure
+int absolute_path(const char* path, char* out, size_t size) {
+#ifdef _WIN32
+    return _fullpath(out, path, size) != NULL;
+#else
+    char* full = realpath(path, NULL);
+    if (!full) return 0;
+    int fits = snprintf(out, size, "%s", full) < (int)size;
+    free(full);
+    return fits;
+#endif
+}
+
+// Load a scene description file, replacing the built-in scene. Format,
+// one statement per line ('#' starts a comment):
+//   resolution <width> <height>
+//   depth <max reflection depth>
+//   background <r> <g> <b>
+//   camera <px py pz> <look-at x y z> <vertical fov degrees>
+//   camera_up <x y z>
+//   material <name> <r g b> <specular exponent> <reflectivity>
+//   sphere <cx cy cz> <radius> <material name>
+//   light <px py pz> <r g b> <intensity>
+//   mesh <file.obj> <material name> [<offset x y z> [<scale>]]
+// Materials must be defined before spheres and meshes use them. Mesh
+// paths are relative to the scene file's directory.
+int load_scene(const char* filename) {
+    char* text = read_text_file(filename, NULL);
+    if (!text) {
+        printf("Error: Could not open scene file %s\n", filename);
+        return 0;
+    }
+    
+    SceneParser parser = {text, filename, 1};
+    MaterialTable materials;
+    memset(&materials, 0, sizeof(materials));
+    default_camera(&camera);
+    
+    char keyword[64];
+    const char* error = NULL;
+    
+    while (*parser.cursor) {
+        if (!scene_read_word(&parser, keyword, sizeof(keyword))) {
+            // Blank or comment-only line
+            if (!scene_end_line(&parser)) {
+                error = "unexpected character";
+                break;
+            }
+            continue;
+        }
+        
+        if (strcmp(keyword, "sphere") == 0) {
+            Sphere sphere;
+            char name[64];
+            if (!scene_read_vec3(&parser, &sphere.center) ||
+                !scene_read_number(&parser, &sphere.radius) || sphere.radius <= 0 ||
+                !scene_read_word(&parser, name, sizeof(name))) {
+                error = "expected: sphere <cx cy cz> <radius> <material>";
+                break;
+            }
+            int m = material_find(&materials, name);
+            if (m < 0) {
+                error = "undefined material";
+                break;
+            }
+            sphere.color = materials.materials[m].color;
+            sphere.specular = materials.materials[m].specular;
+            sphere.reflective = materials.materials[m].reflective;
+            if (!add_sphere(sphere)) {
+                error = "out of memory";
+                break;
+            }
+        } else if (strcmp(keyword, "material") == 0) {
+            Material material;
+            double specular;
+            if (!scene_read_word(&parser, material.name, sizeof(material.name)) ||
+                !scene_read_color(&parser, &material.color) ||
+                !scene_read_number(&parser, &specular) ||
+                !scene_read_number(&parser, &material.reflective) ||
+                material.reflective < 0 || material.reflective > 1) {
+                error = "expected: material <name> <r g b> <specular> <reflectivity 0-1>";
+                break;
+            }
+            material.specular = (int)specular;
+            if (!material_add(&materials, &material)) {
+                error = "out of memory";
+                break;
+            }
+        } else if (strcmp(keyword, "mesh") == 0) {
+            char obj_name[256], name[64], path[512];
+            Vec3 offset = {0, 0, 0};
+            double scale = 1;
+            if (!scene_read_word(&parser, obj_name, sizeof(obj_name)) ||
+                !scene_read_word(&parser, name, sizeof(name))) {
+                error = "expected: mesh <file.obj> <material> [<offset x y z> [<scale>]]";
+                break;
+            }
+            // Optional transform
+            scene_skip_blank(&parser);
+            if (*parser.cursor && *parser.cursor != '\n') {
+                if (!scene_read_vec3(&parser, &offset)) {
+                    error = "expected: mesh <file.obj> <material> [<offset x y z> [<scale>]]";
+                    break;
+                }
+                scene_skip_blank(&parser);
+                if (*parser.cursor && *parser.cursor != '\n' &&
+                    (!scene_read_number(&parser, &scale) || scale <= 0)) {
+                    error = "expected: mesh <file.obj> <material> [<offset x y z> [<scale>]]";
+                    break;
+                }
+            }
+            int m = material_find(&materials, name);
+            if (m < 0) {
+                error = "undefined material";
+                break;
+            }
+            
+            // Resolve relative paths against the scene file's directory
+            const char* slash = strrchr(filename, '/');
+            if (!path_is_absolute(obj_name) && slash) {
+                snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - filename), filename, obj_name);
+            } else {
+                snprintf(path, sizeof(path), "%s", obj_name);
+            }
+            
+            Mesh mesh;
+            memset(&mesh, 0, sizeof(mesh));
+            if (!load_obj(path, offset, scale, &mesh)) {
+                error = "could not load mesh";
+                break;
+            }
+            mesh.material = materials.materials[m];
+            if (!add_mesh(mesh)) {
+                error = "out of memory";
+                break;
+            }
+        } else if (strcmp(keyword, "light") == 0) {
+            Light light;
+            if (!scene_read_vec3(&parser, &light.position) ||
+                !scene_read_color(&parser, &light.color) ||
+                !scene_read_number(&parser, &light.intensity)) {
+                error = "expected: light <px py pz> <r g b> <intensity>";
+                break;
+            }
+            if (!add_light(light)) {
+                error = "out of memory";
+                break;
+            }
+        } else if (strcmp(keyword, "camera") == 0) {
+            if (!scene_read_vec3(&parser, &camera.position) ||
+                !scene_read_vec3(&parser, &camera.look_at) ||
+                !scene_read_number(&parser, &camera.fov) ||
+                camera.fov <= 0 || camera.fov >= 180) {
+                error = "expected: camera <px py pz> <look-at x y z> <fov 0-180>";
+                break;
+            }
+        } else if (strcmp(keyword, "keyframe") == 0) {
+            Camera keyframe;
+            if (!scene_read_vec3(&parser, &keyframe.position) ||
+                !scene_read_vec3(&parser, &keyframe.look_at) ||
+                !scene_read_number(&parser, &keyframe.fov) ||
+                keyframe.fov <= 0 || keyframe.fov >= 180) {
+                error = "expected: keyframe <px py pz> <look-at x y z> <fov 0-180>";
+                break;
+            }
+            if (!add_keyframe(keyframe)) {
+                error = "out of memory";
+                break;
+            }
+        } else if (strcmp(keyword, "camera_up") == 0) {
+            if (!scene_read_vec3(&parser, &camera.up)) {
+                error = "expected: camera_up <x y z>";
+                break;
+            }
+        } else if (strcmp(keyword, "resolution") == 0) {
+            double w, h;
+            if (!scene_read_number(&parser, &w) || !scene_read_number(&parser, &h) ||
+                w < 1 || h < 1 || w > 65536 || h > 65536) {
+                error = "expected: resolution <width> <height>";
+                break;
+            }
+            image_width = (int)w;
+            image_height = (int)h;
+        } else if (strcmp(keyword, "depth") == 0) {
+            double depth;
+            if (!scene_read_number(&parser, &depth) || depth < 1) {
+                error = "expected: depth <max depth>";
+                break;
+            }
+            max_depth = (int)depth;
+        } else if (strcmp(keyword, "background") == 0) {
+            if (!scene_read_color(&parser, &background_color)) {
+                error = "expected: background <r g b>";
+                break;
+            }
+        } else {
+            error = "unknown keyword";
+            break;
+        }
+        
+        if (!scene_end_line(&parser)) {
+            error = "unexpected text at end of line";
+            break;
+        }
+    }
+    
+    if (!error && !setup_camera(&camera)) {
+        error = "camera look-at point and up vector are degenerate";
+    }
+    if (error) {
+        printf("Error: %s:%d: %s\n", filename, parser.line, error);
+    }
+    
+    material_table_free(&materials);
+    free(text);
+    return error == NULL;
+}
+
+// Write the current scene in the format read by load_scene. Every sphere
+// gets its own material, which keeps the writer simple and exercises the
+// material table when benchmarking large scenes. Mesh paths are written
+// absolute: the stored ones are relative to the working directory, but
+// the loader resolves them against the directory of the file written here.
+int save_scene(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        printf("Error: Could not open file %s for writing\n", filename);
+        return 0;
+    }
+    
+    fprintf(file, "resolution %d %d\n", image_width, image_height);
+    fprintf(file, "depth %d\n", max_depth);
+    fprintf(file, "background %d %d %d\n", background_color.r, background_color.g, background_color.b);
+    fprintf(file, "camera %.17g %.17g %.17g %.17g %.17g %.17g %.17g\n",
+            camera.position.x, camera.position.y, camera.position.z,
+            camera.look_at.x, camera.look_at.y, camera.look_at.z, camera.fov);
+    fprintf(file, "camera_up %.17g %.17g %.17g\n", camera.up.x, camera.up.y, camera.up.z);
+    for (int i = 0; i < keyframe_count; i++) {
+        const Camera* k = &keyframes[i];
+        fprintf(file, "keyframe %.17g %.17g %.17g %.17g %.17g %.17g %.17g\n",
+                k->position.x, k->position.y, k->position.z,
+                k->look_at.x, k->look_at.y, k->look_at.z, k->fov);
+    }
+    
+    for (int i = 0; i < light_count; i++) {
+        const Light* l = &lights[i];
+        fprintf(file, "light %.17g %.17g %.17g %d %d %d %.17g\n",
+                l->position.x, l->position.y, l->position.z,
+                l->color.r, l->color.g, l->color.b, l->intensity);
+    }
+    for (int i = 0; i < sphere_count; i++) {
+        const Sphere* s = &spheres[i];
+        fprintf(file, "material m%d %d %d %d %d %.17g\n", i,
+                s->color.r, s->color.g, s->color.b, s->specular, s->reflective);
+        fprintf(file, "sphere %.17g %.17g %.17g %.17g m%d\n",
+                s->center.x, s->center.y, s->center.z, s->radius, i);
+    }
+    for (int i = 0; i < mesh_count; i++) {
+        const Mesh* mesh = &meshes[i];
+        const Material* mat = &mesh->material;
+        char path[4096];
+        if (!absolute_path(mesh->filename, path, sizeof(path))) {
+            printf("Error: Could not resolve mesh path %s\n", mesh->filename);
+            fclose(file);
+            return 0;
+        }
+        fprintf(file, "material %s %d %d %d %d %.17g\n", mat->name,
+                mat->color.r, mat->color.g, mat->color.b, mat->specular, mat->reflective);
+        fprintf(file, "mesh %s %s %.17g %.17g %.17g %.17g\n", path, mat->name,
+                mesh->offset.x, mesh->offset.y, mesh->offset.z, mesh->scale);
+    }
+    
+    fclose(file);
+    printf("Scene saved as %s\n", filename);
+    return 1;
+}
+
+// Pick the output format from a file name: .tga selects TGA, anything
+// else PPM
+ImageFormat image_format_for(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    if (dot && (strcmp(dot, ".tga") == 0 || strcmp(dot, ".TGA") == 0)) {
+        return FORMAT_TGA;
+    }
+    return FORMAT_PPM;
+}
+
+// Hand the buffered bytes to the file
+void image_writer_flush(ImageWriter* writer) {
+    if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) {
+        writer->failed = 1;
+    }
+    writer->used = 0;
+}
+
+// Create the file and write the header; returns 0 on failure
+int image_writer_open(ImageWriter* writer, const char* filename) {
+    snprintf(writer->filename, sizeof(writer->filename), "%s", filename);
+    writer->format = image_format_for(filename);
+    writer->used = 0;
+    writer->failed = 0;
+    
+    if (writer->format == FORMAT_TGA && (image_width > 65535 || image_height > 65535)) {
+        printf("Error: TGA images are limited to 65535x65535 pixels\n");
+        return 0;
+    }
+    
+    writer->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if (!writer->buffer) {
+        printf("Error: Failed to allocate output buffer\n");
+        return 0;
+    }
+    writer->file = fopen(filename, "wb");
+    if (!writer->file) {
+        printf("Error: Could not open file %s for writing\n", filename);
+        free(writer->buffer);
+        return 0;
+    }
+    
+    if (writer->format == FORMAT_PPM) {
+        fprintf(writer->file, "P6\n%d %d\n255\n", image_width, image_height);
+    } else {
+        // 18-byte header: no ID or color map, type 10 (RLE true-color),
+        // 24 bits per pixel, descriptor bit 5 set for top-left origin
+        unsigned char header[18] = {0};
+        header[2] = 10;
+        header[12] = (unsigned char)(image_width & 0xFF);
+        header[13] = (unsigned char)(image_width >> 8);
+        header[14] = (unsigned char)(image_height & 0xFF);
+        header[15] = (unsigned char)(image_height >> 8);
+        header[16] = 24;
+        header[17] = 0x20;
+        fwrite(header, 1, sizeof(header), writer->file);
+    }
+    return 1;
+}
+
+// Append one row as TGA run-length packets. A packet covers up to 128
+// pixels: either one color repeated, or literal pixels. Packets do not
+// cross rows.
+void image_writer_encode_tga_row(ImageWriter* writer, const Color* row) {
+    int x = 0;
+    
+    while (x < image_width) {
+        // Worst case packet: header byte plus 128 literal pixels
+        if (writer->used + 1 + 128 * 3 > OUTPUT_BUFFER_SIZE) {
+            image_writer_flush(writer);
+        }
+        unsigned char* out = writer->buffer + writer->used;
+        
+        int run = 1;
+        while (x + run < image_width && run < 128 &&
+               memcmp(&row[x + run], &row[x], sizeof(Color)) == 0) {
+            run++;
+        }
+        
+        if (run > 1) {
+            out[0] = (unsigned char)(0x80 | (run - 1));
+            out[1] = row[x].b;
+            out[2] = row[x].g;
+            out[3] = row[x].r;
+            writer->used += 4;
+            x += run;
+            continue;
+        }
+        
+        // Literal pixels until the next pair of equal pixels starts a run
+        int count = 0;
+        while (x + count < image_width && count < 128) {
+            if (x + count + 1 < image_width &&
+                memcmp(&row[x + count], &row[x + count + 1], sizeof(Color)) == 0) {
+                break;
+            }
+            out[1 + count * 3] = row[x + count].b;
+            out[2 + count * 3] = row[x + count].g;
+            out[3 + count * 3] = row[x + count].r;
+            count++;
+        }
+        out[0] = (unsigned char)(count - 1);
+        writer->used += 1 + count * 3;
+        x += count;
+    }
+}
+
+// Append count finished rows of the image, top to bottom
+void image_writer_write_rows(ImageWriter* writer, const Color* rows, int count) {
+    for (int y = 0; y < count; y++) {
+        const Color* row = rows + (long)y * image_width;
+        
+        if (writer->format == FORMAT_TGA) {
+            image_writer_encode_tga_row(writer, row);
+            continue;
+        }
+        for (int x = 0; x < image_width; x++) {
+            if (writer->used + 3 > OUTPUT_BUFFER_SIZE) {
+                image_writer_flush(writer);
+            }
+            writer->buffer[writer->used++] = row[x].r;
+            writer->buffer[writer->used++] = row[x].g;
+            writer->buffer[writer->used++] = row[x].b;
+        }
+    }
+}
+
+// Flush and close the file; returns 0 if any write failed
+int image_writer_close(ImageWriter* writer) {
+    image_writer_flush(writer);
+    if (fclose(writer->file) != 0) {
+        writer->failed = 1;
+    }
+    free(writer->buffer);
+    
+    if (writer->failed) {
+        printf("Error: Failed to write %s\n", writer->filename);
+        return 0;
+    }
+    printf("Image saved as %s\n", writer->filename);
+    return 1;
+}
+
+// Record that some output was lost; called from either thread
+void output_stage_fail(OutputStage* stage) {
+    pthread_mutex_lock(&stage->lock);
+    stage->failed = 1;
+    pthread_mutex_unlock(&stage->lock);
+}
+
+// Carry out one queued output command. Returns 0 for OUTPUT_STOP.
+int output_stage_run(OutputStage* stage, OutputSlot* slot) {
+    switch (slot->kind) {
+    case OUTPUT_ROWS:
+        image_writer_write_rows(slot->writer, slot->pixels, slot->rows);
+        break;
+    case OUTPUT_CLOSE:
+        if (!image_writer_close(slot->writer)) {
+            output_stage_fail(stage);
+        }
+        free(slot->writer);
+        break;
+    case OUTPUT_STOP:
+        return 0;
+    }
+    return 1;
+}
+
+// Writer thread: carry out commands in order until told to stop. A slot
+// stays counted until it has been handled, so the render loop cannot
+// refill it while it is being written.
+void* output_worker(void* arg) {
+    OutputStage* stage = (OutputStage*)arg;
+    int running = 1;
+    
+    while (running) {
+        pthread_mutex_lock(&stage->lock);
+        while (stage->count == 0) {
+            pthread_cond_wait(&stage->not_empty, &stage->lock);
+        }
+        OutputSlot* slot = &stage->slots[stage->head];
+        pthread_mutex_unlock(&stage->lock);
+        
+        running = output_stage_run(stage, slot);
+        
+        pthread_mutex_lock(&stage->lock);
+        stage->head = (stage->head + 1) % OUTPUT_SLOTS;
+        stage->count--;
+        pthread_cond_signal(&stage->not_full);
+        pthread_mutex_unlock(&stage->lock);
+    }
+    return NULL;
+}
+
+// Start the writer thread. If it cannot be started, commands are carried
+// out immediately by the caller instead.
+void output_stage_start(OutputStage* stage) {
+    memset(stage, 0, sizeof(*stage));
+    pthread_mutex_init(&stage->lock, NULL);
+    pthread_cond_init(&stage->not_empty, NULL);
+    pthread_cond_init(&stage->not_full, NULL);
+    stage->threaded = pthread_create(&stage->thread, NULL, output_worker, stage) == 0;
+}
+
+// Queue a command; rows (count rows of pixels) are copied, so the caller
+// may reuse its buffer at once. Only the render loop calls this.
+void output_stage_push(OutputStage* stage, OutputKind kind, ImageWriter* writer,
+                       const Color* pixels, int rows) {
+    pthread_mutex_lock(&stage->lock);
+    while (stage->count == OUTPUT_SLOTS) {
+        pthread_cond_wait(&stage->not_full, &stage->lock);
+    }
+    OutputSlot* slot = &stage->slots[(stage->head + stage->count) % OUTPUT_SLOTS];
+    pthread_mutex_unlock(&stage->lock);
+    
+    slot->kind = kind;
+    slot->writer = writer;
+    slot->rows = rows;
+    if (kind == OUTPUT_ROWS) {
+        size_t n = (size_t)rows * image_width;
+        if (n > slot->capacity) {
+            Color* grown = realloc(slot->pixels, n * sizeof(Color));
+            if (!grown) {
+                printf("Error: Failed to allocate output buffer\n");
+                output_stage_fail(stage);
+                return;
+            }
+            slot->pixels = grown;
+            slot->capacity = n;
+        }
+        memcpy(slot->pixels, pixels, n * sizeof(Color));
+    }
+    
+    if (!stage->threaded) {
+        output_stage_run(stage, slot);
+        return;
+    }
+    pthread_mutex_lock(&stage->lock);
+    stage->count++;
+    pthread_cond_signal(&stage->not_empty);
+    pthread_mutex_unlock(&stage->lock);
+}
+
+void output_stage_write(OutputStage* stage, ImageWriter* writer, const Color* pixels, int rows) {
+    output_stage_push(stage, OUTPUT_ROWS, writer, pixels, rows);
+}
+
+// Close writer (allocated with malloc) once its queued rows are written
+void output_stage_close(OutputStage* stage, ImageWriter* writer) {
+    output_stage_push(stage, OUTPUT_CLOSE, writer, NULL, 0);
+}
+
+// Wait for all queued output and stop the thread; returns 0 if any write
+// failed
+int output_stage_finish(OutputStage* stage) {
+    output_stage_push(stage, OUTPUT_STOP, NULL, NULL, 0);
+    if (stage->threaded) {
+        pthread_join(stage->thread, NULL);
+    }
+    for (int i = 0; i < OUTPUT_SLOTS; i++) {
+        free(stage->slots[i].pixels);
+    }
+    pthread_mutex_lock(&stage->lock);
+    int failed = stage->failed;
+    pthread_mutex_unlock(&stage->lock);
+    pthread_cond_destroy(&stage->not_full);
+    pthread_cond_destroy(&stage->not_empty);
+    pthread_mutex_destroy(&stage->lock);
+    return !failed;
+}
+
+// Trace the primary ray through image position (px, py), in pixels
+ColorF render_sample(const Camera* cam, double px, double py, ThreadContext* ctx) {
+    // Convert pixel coordinates to normalized device coordinates
+    double ndc_x = px / image_width;
+    double ndc_y = py / image_height;
+    
+    // Convert to screen space coordinates (-1 to 1)
+    double screen_x = 2 * ndc_x - 1;
+    double screen_y = 1 - 2 * ndc_y; // Flip Y axis
+    
+    // Aspect ratio correction
+    screen_x *= (double)image_width / image_height;
+    
+    // Create ray direction in camera space
+    Vec3 ray_direction = vec3_add(cam->forward, vec3_add(
+        vec3_multiply(cam->right, screen_x * cam->scale),
+        vec3_multiply(cam->true_up, screen_y * cam->scale)));
+    ray_direction = vec3_normalize(ray_direction);
+    
+    // Create ray
+    Ray ray = {cam->position, ray_direction};
+    
+    // Trace ray and get color
+    ctx->stats.primary_rays++;
+    return path_samples > 0 ? trace_path(ray, ctx) : trace_ray(ray, 0, ctx);
+}
+
+// Trace the primary ray through the center of pixel (x, y)
+Color render_pixel(const Camera* cam, int x, int y, ThreadContext* ctx) {
+    return color_to_rgb8(render_sample(cam, x + 0.5, y + 0.5, ctx));
+}
+
+// Stateless hash used for sample jitter, so every thread produces the
+// same samples for a pixel regardless of scheduling
+unsigned int sample_hash(unsigned int x, unsigned int y, unsigned int s) {
+    unsigned int h = x * 0x8da6b343u ^ y * 0xd8163841u ^ s * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// Supersample pixel (x, y) on a jittered grid of about aa_samples points
+Color render_pixel_supersampled(const Camera* cam, int x, int y, ThreadContext* ctx) {
+    int grid = (int)ceil(sqrt((double)aa_samples));
+    ColorF sum = {0, 0, 0};
+    int n = grid * grid;
+    
+    for (int s = 0; s < n; s++) {
+        unsigned int h = sample_hash(x, y, s);
+        double jitter_x = (h & 0xFFFF) / 65536.0;
+        double jitter_y = (h >> 16) / 65536.0;
+        double px = x + ((s % grid) + jitter_x) / grid;
+        double py = y + ((s / grid) + jitter_y) / grid;
+        
+        sum = color_add(sum, render_sample(cam, px, py, ctx));
+    }
+    
+    return color_to_rgb8(color_scale(sum, 1.0f / n));
+}
+
+// Add path samples [first, first + count) of pixel (x, y), taken through
+// random points in it, to the running sum; first must be 0 or 1. The
+// generator is seeded from the pixel, so the result does not depend on
+// which thread renders it. Sample 0 and the samples after it come from
+// separate streams, so a 1-sample preview followed by samples [1, n) adds
+// up exactly as a full render does: more samples only refine the estimate.
+ColorF accumulate_path_samples(const Camera* cam, int x, int y, int first, int count, ColorF sum,
+                               ThreadContext* ctx) {
+    for (int s = first; s < first + count; s++) {
+        if (s <= 1) {
+            unsigned int stream = (unsigned int)s;
+            ctx->rng.state = (unsigned long long)sample_hash(x, y, 0x9e3779b9u + stream) << 32 |
+                             sample_hash(y, x, 0x85ebca6bu + stream);
+            rng_next(&ctx->rng);
+        }
+        double px = x + rng_float(&ctx->rng);
+        double py = y + rng_float(&ctx->rng);
+        sum = color_add(sum, render_sample(cam, px, py, ctx));
+    }
+    return sum;
+}
+
+// Largest channel difference between two colors
+int color_difference(Color a, Color b) {
+    int dr = abs(a.r - b.r), dg = abs(a.g - b.g), db = abs(a.b - b.b);
+    int d = dr > dg ? dr : dg;
+    return d > db ? d : db;
+}
+
+// Does pixel x of a base image row differ from a 4-neighbor by more than
+// the threshold? Flat regions such as open sky never qualify. above and
+// below are the neighboring rows, NULL at the image edges.
+int needs_refinement(const Color* above, const Color* row, const Color* below, int x) {
+    Color c = row[x];
+    if (x > 0 && color_difference(c, row[x - 1]) > aa_threshold) return 1;
+    if (x < image_width - 1 && color_difference(c, row[x + 1]) > aa_threshold) return 1;
+    if (above && color_difference(c, above[x]) > aa_threshold) return 1;
+    if (below && color_difference(c, below[x]) > aa_threshold) return 1;
+    return 0;
+}
+
+// Base row y for a refine job, from its band or a neighboring one; NULL
+// outside the image
+const Color* base_row(const RenderJob* job, int y) {
+    for (int i = 0; i < 3; i++) {
+        const RowBuffer* base = job->base[i];
+        if (base && y >= base->row0 && y < base->row0 + base->rows) {
+            return base->pixels + (long)(y - base->row0) * image_width;
+        }
+    }
+    return NULL;
+}
+
+// Monotonic wall-clock time in seconds
+double now_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, count;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// Intersection tests of every kind, the cost measure used for the heatmap
+static inline long stats_tests(const RenderStats* stats) {
+    return stats->box_tests + stats->sphere_tests + stats->triangle_tests;
+}
+
+void stats_add(RenderStats* total, const RenderStats* stats) {
+    total->primary_rays += stats->primary_rays;
+    total->shadow_rays += stats->shadow_rays;
+    total->reflection_rays += stats->reflection_rays;
+    total->diffuse_rays += stats->diffuse_rays;
+    total->box_tests += stats->box_tests;
+    total->sphere_tests += stats->sphere_tests;
+    total->triangle_tests += stats->triangle_tests;
+    total->tiles += stats->tiles;
+    total->tile_seconds += stats->tile_seconds;
+    if (stats->slowest_tile > total->slowest_tile) {
+        total->slowest_tile = stats->slowest_tile;
+    }
+}
+
+void print_render_stats(const RenderStats* stats, double seconds) {
+    long rays = stats->primary_rays + stats->shadow_rays + stats->reflection_rays + stats->diffuse_rays;
+    
+    printf("Render statistics:\n");
+    printf("  Primary rays:    %ld\n", stats->primary_rays);
+    printf("  Shadow rays:     %ld\n", stats->shadow_rays);
+    printf("  Reflection rays: %ld\n", stats->reflection_rays);
+    if (path_samples > 0) {
+        printf("  Diffuse rays:    %ld\n", stats->diffuse_rays);
+    }
+    printf("  Box tests:       %ld (%.1f per ray)\n", stats->box_tests,
+           rays > 0 ? (double)stats->box_tests / rays : 0.0);
+    printf("  Sphere tests:    %ld (%.1f per ray)\n", stats->sphere_tests,
+           rays > 0 ? (double)stats->sphere_tests / rays : 0.0);
+    printf("  Triangle tests:  %ld (%.1f per ray)\n", stats->triangle_tests,
+           rays > 0 ? (double)stats->triangle_tests / rays : 0.0);
+    printf("  Tiles:           %ld, average %.2f ms, slowest %.2f ms\n", stats->tiles,
+           stats->tiles > 0 ? stats->tile_seconds * 1000 / stats->tiles : 0.0, stats->slowest_tile * 1000);
+    printf("  Render time:     %.3f s, %.2f Mrays/s\n", seconds,
+           seconds > 0 ? rays / seconds / 1e6 : 0.0);
+}
+
+// Render every pixel of one tile for the job's pass; returns the number
+// of pixels that were supersampled
+long render_tile(RenderJob* job, Tile tile, ThreadContext* ctx) {
+    RowBuffer* output = job->output;
+    const RowBuffer* base = job->base[1];
+    long refined = 0;
+    
+    for (int y = tile.y0; y < tile.y1; y++) {
+        long offset = (long)(y - output->row0) * image_width;
+        Color* row = output->pixels + offset;
+        const Color* above = NULL;
+        const Color* below = NULL;
+        if (job->pass == PASS_REFINE) {
+            above = base_row(job, y - 1);
+            below = base_row(job, y + 1);
+        }
+        for (int x = tile.x0; x < tile.x1; x++) {
+            long tests = stats_tests(&ctx->stats);
+            long base_index = base ? (long)(y - base->row0) * image_width + x : 0;
+            
+            if (job->pass == PASS_REFINE && path_samples > 0) {
+                // Continue the kept preview's sum with the remaining samples
+                ColorF sum = accumulate_path_samples(job->camera, x, y, 1, path_samples - 1,
+                                                     base->sum[base_index], ctx);
+                row[x] = color_to_rgb8(color_scale(sum, 1.0f / path_samples));
+            } else if (job->pass == PASS_REFINE) {
+                if (needs_refinement(above, base->pixels + base_index - x, below, x)) {
+                    row[x] = render_pixel_supersampled(job->camera, x, y, ctx);
+                    refined++;
+                } else {
+                    row[x] = base->pixels[base_index];
+                }
+            } else if (path_samples > 0) {
+                int samples = job->pass == PASS_PREVIEW ? 1 : path_samples;
+                ColorF sum = accumulate_path_samples(job->camera, x, y, 0, samples, (ColorF){0, 0, 0}, ctx);
+                if (output->sum) output->sum[offset + x] = sum;
+                row[x] = color_to_rgb8(color_scale(sum, 1.0f / samples));
+            } else {
+                row[x] = render_pixel(job->camera, x, y, ctx);
+            }
+            
+            // Refined pixels also carry the cost of their base sample(s)
+            if (output->cost) {
+                unsigned int cost = (unsigned int)(stats_tests(&ctx->stats) - tests);
+                if (job->pass == PASS_REFINE) cost += base->cost[base_index];
+                output->cost[offset + x] = cost;
+            }
+        }
+    }
+    return refined;
+}
+
+// Take the next tile of job from our own queue, or steal one from another
+// worker. Returns -1 once every queue is empty.
+int next_tile(RenderJob* job, int worker_id) {
+    TileQueue* own = &job->queues[worker_id];
+    int tile = -1;
+    
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) {
+        tile = own->head++;
+    }
+    pthread_mutex_unlock(&own->lock);
+    if (tile >= 0) return tile;
+    
+    for (int k = 1; k < job->worker_count; k++) {
+        TileQueue* victim = &job->queues[(worker_id + k) % job->worker_count];
+        
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            tile = --victim->tail;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (tile >= 0) return tile;
+    }
+    
+    return -1;
+}
+
+// Render thread: take tiles from the oldest queued job until the pool is
+// stopped. A job stays queued until a worker finds it has no tiles left to
+// hand out; the last worker to leave it has then finished it.
+void* render_worker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    RenderPool* pool = worker->pool;
+    ThreadContext* ctx = &worker->ctx;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        RenderJob* job = pool->head;
+        if (!job) break;
+        job->active++;
+        pthread_mutex_unlock(&pool->lock);
+        
+        int tile;
+        while ((tile = next_tile(job, worker->id)) >= 0) {
+            double start = now_seconds();
+            worker->refined += render_tile(job, job->tiles[tile], ctx);
+            double elapsed = now_seconds() - start;
+            
+            ctx->stats.tiles++;
+            ctx->stats.tile_seconds += elapsed;
+            if (elapsed > ctx->stats.slowest_tile) {
+                ctx->stats.slowest_tile = elapsed;
+            }
+        }
+        
+        pthread_mutex_lock(&pool->lock);
+        if (pool->head == job) {
+            pool->head = job->next;
+        }
+        if (--job->active == 0) {
+            job->done = 1;
+            pthread_cond_broadcast(&pool->finished);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Start up to thread_count render threads; returns 0 if none could be
+// started. Their contexts are sized for the scene's lights, so the scene
+// must be loaded first.
+int render_pool_start(RenderPool* pool, int thread_count) {
+    memset(pool, 0, sizeof(*pool));
+    pool->workers = malloc(thread_count * sizeof(Worker));
+    pool->threads = malloc(thread_count * sizeof(pthread_t));
+    if (!pool->workers || !pool->threads) {
+        free(pool->workers);
+        free(pool->threads);
+        return 0;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    
+    // Worker ids must be contiguous, so stop at the first thread that
+    // cannot be started; its share of every job is stolen by the others
+    for (int i = 0; i < thread_count; i++) {
+        Worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->refined = 0;
+        if (!thread_context_init(&worker->ctx)) break;
+        if (pthread_create(&pool->threads[i], NULL, render_worker, worker) != 0) {
+            thread_context_free(&worker->ctx);
+            break;
+        }
+        pool->thread_count++;
+    }
+    
+    if (pool->thread_count == 0) {
+        pthread_cond_destroy(&pool->finished);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->workers);
+        free(pool->threads);
+        return 0;
+    }
+    return 1;
+}
+
+// Queue job, whose tiles are filled in. Each worker gets a contiguous run
+// of tiles to start with; stealing rebalances whatever turns out to be
+// expensive.
+void render_pool_submit(RenderPool* pool, RenderJob* job) {
+    job->worker_count = pool->thread_count;
+    for (int i = 0; i < job->worker_count; i++) {
+        job->queues[i].head = (int)((long)job->tile_count * i / job->worker_count);
+        job->queues[i].tail = (int)((long)job->tile_count * (i + 1) / job->worker_count);
+    }
+    job->active = 0;
+    job->done = 0;
+    job->next = NULL;
+    
+    pthread_mutex_lock(&pool->lock);
+    if (pool->head) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait until every tile of job has been rendered
+void render_pool_wait(RenderPool* pool, RenderJob* job) {
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Stop the threads once the queue is empty and add their work counters to
+// stats. Returns the number of pixels supersampled over the whole run.
+long render_pool_stop(RenderPool* pool, RenderStats* stats) {
+    long refined = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+        stats_add(stats, &pool->workers[i].ctx.stats);
+        refined += pool->workers[i].refined;
+        thread_context_free(&pool->workers[i].ctx);
+    }
+    
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->threads);
+    return refined;
+}
+
+// Rows per band: whole tile rows, enough for every thread to get
+// MIN_TILES_PER_THREAD tiles
+int band_height(int thread_count) {
+    int tiles_x = (image_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tile_rows = (thread_count * MIN_TILES_PER_THREAD + tiles_x - 1) / tiles_x;
+    return tile_rows * TILE_SIZE;
+}
+
+// Print a line each time another 10% of the rows is done
+void report_progress(const char* label, int rows_done, int* last_progress) {
+    int percent = (int)((long)rows_done * 100 / image_height);
+    if (percent / 10 > *last_progress / 10) {
+        printf("%s progress: %d%%\n", label, percent);
+        *last_progress = percent;
+    }
+}
+
+// Heatmap color for a pixel that took cost intersection tests. The scale
+// is logarithmic and fixed (black, blue, green, yellow, red at
+// 2^HEATMAP_LOG2_RANGE tests), so bands written separately match and
+// images of different scenes can be compared.
+Color heatmap_color(unsigned int cost) {
+    static const Color ramp[5] = {{0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}};
+    double t = log2(1.0 + cost) / HEATMAP_LOG2_RANGE;
+    if (t > 1) t = 1;
+    
+    double position = t * 4;
+    int i = (int)position;
+    if (i > 3) i = 3;
+    double f = position - i;
+    return (Color){
+        (unsigned char)(ramp[i].r + (ramp[i + 1].r - ramp[i].r) * f + 0.5),
+        (unsigned char)(ramp[i].g + (ramp[i + 1].g - ramp[i].g) * f + 0.5),
+        (unsigned char)(ramp[i].b + (ramp[i + 1].b - ramp[i].b) * f + 0.5)
+    };
+}
+
+// Convert the cost of count rows to heatmap colors in scratch and queue them
+void write_heatmap_rows(OutputStage* stage, ImageWriter* heatmap, const unsigned int* cost,
+                        Color* scratch, int count) {
+    long n = (long)count * image_width;
+    for (long i = 0; i < n; i++) {
+        scratch[i] = heatmap_color(cost[i]);
+    }
+    output_stage_write(stage, heatmap, scratch, count);
+}
+
+// Allocate a band-sized buffer, with per-pixel cost if cost is set
+int row_buffer_alloc(RowBuffer* buffer, int rows, int cost) {
+    size_t pixels = (size_t)rows * image_width;
+    buffer->pixels = malloc(pixels * sizeof(Color));
+    buffer->cost = cost ? malloc(pixels * sizeof(unsigned int)) : NULL;
+    buffer->sum = NULL;
+    buffer->row0 = 0;
+    buffer->rows = 0;
+    return buffer->pixels && (!cost || buffer->cost);
+}
+
+void row_buffer_free(RowBuffer* buffer) {
+    free(buffer->pixels);
+    free(buffer->cost);
+    free(buffer->sum);
+}
+
+// Set up the band buffers and jobs for rendering frames frames on pool;
+// returns 0 on allocation failure. Costs are kept only when a heatmap is
+// written. A preview that the final pass refines is kept whole if it fits
+// in KEPT_PREVIEW_BUDGET, so its rows need not be rendered twice; larger
+// frames render them again band by band to keep memory bounded.
+int pipeline_init(Pipeline* p, RenderPool* pool, OutputStage* stage, int preview, int heatmap,
+                  int frames) {
+    memset(p, 0, sizeof(*p));
+    p->pool = pool;
+    p->stage = stage;
+    p->frames = frames;
+    p->band_rows = band_height(pool->thread_count);
+    int tiles = (image_width + TILE_SIZE - 1) / TILE_SIZE * (p->band_rows / TILE_SIZE);
+    int ok = 1;
+    
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        RenderJob* job = &p->tasks[i].job;
+        if (!row_buffer_alloc(&p->tasks[i].rows, p->band_rows, heatmap)) ok = 0;
+        job->tiles = malloc(tiles * sizeof(Tile));
+        job->queues = malloc(pool->thread_count * sizeof(TileQueue));
+        if (!job->tiles || !job->queues) {
+            ok = 0;
+            free(job->queues);
+            job->queues = NULL;
+            continue;
+        }
+        for (int w = 0; w < pool->thread_count; w++) {
+            pthread_mutex_init(&job->queues[w].lock, NULL);
+        }
+    }
+    
+    if (preview && (aa_samples > 1 || path_samples > 1)) {
+        int bands = (image_height + p->band_rows - 1) / p->band_rows;
+        int sums = path_samples > 1;
+        size_t pixel_bytes = sizeof(Color) + (heatmap ? sizeof(unsigned int) : 0) +
+                             (sums ? sizeof(ColorF) : 0);
+        if ((size_t)image_height * image_width * pixel_bytes > KEPT_PREVIEW_BUDGET) {
+            printf("Note: The preview is too large to keep in memory; the final pass renders it again\n");
+        } else {
+            p->kept_bands = malloc(bands * sizeof(BandSlot));
+            if (p->kept_bands && row_buffer_alloc(&p->kept, image_height, heatmap) && sums) {
+                p->kept.sum = malloc((size_t)image_height * image_width * sizeof(ColorF));
+            }
+            if (!p->kept_bands || !p->kept.pixels || (heatmap && !p->kept.cost) || (sums && !p->kept.sum)) {
+                printf("Note: Not enough memory to keep the preview; the final pass renders it again\n");
+                row_buffer_free(&p->kept);
+                free(p->kept_bands);
+                memset(&p->kept, 0, sizeof(p->kept));
+                p->kept_bands = NULL;
+            }
+        }
+        for (int b = 0; p->kept_bands && b < bands; b++) {
+            long offset = (long)b * p->band_rows * image_width;
+            p->kept_bands[b].rows = (RowBuffer){p->kept.pixels + offset,
+                                                heatmap ? p->kept.cost + offset : NULL,
+                                                sums ? p->kept.sum + offset : NULL, 0, 0};
+            p->kept_bands[b].written = -1;
+            p->kept_bands[b].busy = -1;
+        }
+    }
+    for (int i = 0; i < BASE_SLOTS; i++) {
+        p->base[i].written = -1;
+        p->base[i].busy = -1;
+        if (aa_samples > 1 && !p->kept_bands &&
+            !row_buffer_alloc(&p->base[i].rows, p->band_rows, heatmap)) ok = 0;
+    }
+    if (heatmap && !(p->heat = malloc((size_t)p->band_rows * image_width * sizeof(Color)))) ok = 0;
+    return ok;
+}
+
+void pipeline_free(Pipeline* p) {
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        RenderJob* job = &p->tasks[i].job;
+        row_buffer_free(&p->tasks[i].rows);
+        if (job->queues) {
+            for (int w = 0; w < p->pool->thread_count; w++) {
+                pthread_mutex_destroy(&job->queues[w].lock);
+            }
+        }
+        free(job->queues);
+        free(job->tiles);
+    }
+    for (int i = 0; i < BASE_SLOTS; i++) {
+        row_buffer_free(&p->base[i].rows);
+    }
+    row_buffer_free(&p->kept);
+    free(p->kept_bands);
+    free(p->heat);
+}
+
+// Wait for the oldest queued task, then queue its rows for output and
+// report progress. After a frame's last band its files are closed.
+void pipeline_complete(Pipeline* p) {
+    BandTask* task = &p->tasks[p->head];
+    const RowBuffer* rows = task->job.output;
+    
+    render_pool_wait(p->pool, &task->job);
+    if (task->output) {
+        output_stage_write(p->stage, task->output, rows->pixels, rows->rows);
+    }
+    if (task->preview) {
+        output_stage_write(p->stage, task->preview, rows->pixels, rows->rows);
+    }
+    if (task->heatmap) {
+        write_heatmap_rows(p->stage, task->heatmap, rows->cost, p->heat, rows->rows);
+    }
+    if (task->label) {
+        if (task->label != p->progress_label) {
+            p->progress_label = task->label;
+            p->last_progress = 0;
+        }
+        report_progress(task->label, rows->row0 + rows->rows, &p->last_progress);
+    }
+    if (task->frame >= 0) {
+        for (int i = 0; i < 3; i++) {
+            if (task->close[i]) output_stage_close(p->stage, task->close[i]);
+        }
+        if (p->frames > 1) {
+            printf("Frame %d/%d rendered in %.3f s\n", task->frame + 1, p->frames,
+                   now_seconds() - task->frame_start);
+        }
+    }
+    
+    p->head = (p->head + 1) % PIPELINE_DEPTH;
+    p->count--;
+    p->completed++;
+}
+
+// Complete tasks in order until task number task is finished; nothing to
+// do for -1
+void pipeline_wait(Pipeline* p, long task) {
+    while (p->completed <= task) {
+        pipeline_complete(p);
+    }
+}
+
+// The next free task, once task number wait_for has finished. The caller
+// sets its pass, output and destinations and queues it with
+// pipeline_submit.
+BandTask* pipeline_next(Pipeline* p, long wait_for) {
+    pipeline_wait(p, wait_for);
+    if (p->count == PIPELINE_DEPTH) {
+        pipeline_complete(p);
+    }
+    
+    BandTask* task = &p->tasks[(p->head + p->count) % PIPELINE_DEPTH];
+    task->job.output = &task->rows;
+    task->job.base[0] = task->job.base[1] = task->job.base[2] = NULL;
+    task->output = NULL;
+    task->preview = NULL;
+    task->heatmap = NULL;
+    task->label = NULL;
+    task->frame = -1;
+    return task;
+}
+
+// Split rows [y0, y1) into tiles in scanline order and queue task to render
+// them, seen from cam, into its output. Returns the task's number.
+long pipeline_submit(Pipeline* p, BandTask* task, const Camera* cam, int y0, int y1) {
+    RenderJob* job = &task->job;
+    int tiles_x = (image_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (y1 - y0 + TILE_SIZE - 1) / TILE_SIZE;
+    
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            Tile* tile = &job->tiles[ty * tiles_x + tx];
+            tile->x0 = tx * TILE_SIZE;
+            tile->y0 = y0 + ty * TILE_SIZE;
+            tile->x1 = tile->x0 + TILE_SIZE < image_width ? tile->x0 + TILE_SIZE : image_width;
+            tile->y1 = tile->y0 + TILE_SIZE < y1 ? tile->y0 + TILE_SIZE : y1;
+        }
+    }
+    job->tile_count = tiles_x * tiles_y;
+    job->output->row0 = y0;
+    job->output->rows = y1 - y0;
+    task->camera = *cam;
+    job->camera = &task->camera;
+    
+    render_pool_submit(p->pool, job);
+    p->count++;
+    return p->submitted++;
+}
+
+// Rows [*y0, *y1) of band b
+void band_extent(const Pipeline* p, int b, int* y0, int* y1) {
+    *y0 = b * p->band_rows;
+    *y1 = *y0 + p->band_rows < image_height ? *y0 + p->band_rows : image_height;
+}
+
+// Queue the refine pass over band b once the base bands in slots (above,
+// own and below, NULL outside the image) are rendered, and mark them as
+// read by it. The caller sets the returned task's destinations, which are
+// only looked at when the task completes.
+BandTask* queue_refine_band(Pipeline* p, const Camera* cam, BandSlot* slots[3], int b) {
+    long wait_for = -1;
+    int y0, y1;
+    
+    for (int k = 0; k < 3; k++) {
+        if (slots[k] && slots[k]->written > wait_for) wait_for = slots[k]->written;
+    }
+    BandTask* task = pipeline_next(p, wait_for);
+    task->job.pass = PASS_REFINE;
+    for (int k = 0; k < 3; k++) {
+        task->job.base[k] = slots[k] ? &slots[k]->rows : NULL;
+    }
+    band_extent(p, b, &y0, &y1);
+    long number = pipeline_submit(p, task, cam, y0, y1);
+    for (int k = 0; k < 3; k++) {
+        if (slots[k]) slots[k]->busy = number;
+    }
+    return task;
+}
+
+// Queue frame number frame, seen from cam, band by band; finished bands go
+// to output (and preview and heatmap, which may be NULL) in order, and the
+// files are closed after the last one. Only a few bands of pixels are ever
+// in memory (plus a kept preview), so the resolution is limited by disk
+// space rather than RAM. Returns as soon as the last band is queued, so
+// the next frame's bands follow it on the pool without a gap;
+// pipeline_wait finishes them.
+void render_frame(Pipeline* p, const Camera* cam, ImageWriter* output, ImageWriter* preview,
+                  ImageWriter* heatmap, int frame) {
+    int bands = (image_height + p->band_rows - 1) / p->band_rows;
+    int show_progress = p->frames == 1;
+    const char* label = show_progress ? "Rendering" : NULL;
+    ImageWriter* files[3] = {output, preview, heatmap};
+    double start = now_seconds();
+    BandTask* last = NULL;
+    int y0, y1;
+    
+    // Without refinement the base rows are the final image, so the preview
+    // is written alongside it. Otherwise it needs its own pass to be ready
+    // before the slower full-quality render starts. That pass is the base
+    // pass (or the first path sample), so when the frame is kept the
+    // refine pass builds on it instead of starting over.
+    int kept = 0;
+    if (preview && (aa_samples > 1 || path_samples > 1)) {
+        kept = p->kept_bands != NULL;
+        for (int b = 0; b < bands; b++) {
+            BandSlot* slot = kept ? &p->kept_bands[b] : NULL;
+            band_extent(p, b, &y0, &y1);
+            BandTask* task = pipeline_next(p, slot ? slot->busy : -1);
+            task->job.pass = PASS_PREVIEW;
+            if (slot) task->job.output = &slot->rows;
+            task->preview = preview;
+            task->label = show_progress ? "Preview" : NULL;
+            long number = pipeline_submit(p, task, cam, y0, y1);
+            if (slot) slot->written = slot->busy = number;
+        }
+        preview = NULL;
+    }
+    
+    if (kept) {
+        for (int b = 0; b < bands; b++) {
+            BandSlot* slots[3];
+            for (int k = 0; k < 3; k++) {
+                int neighbor = b + k - 1;
+                slots[k] = neighbor >= 0 && neighbor < bands ? &p->kept_bands[neighbor] : NULL;
+            }
+            last = queue_refine_band(p, cam, slots, b);
+            last->output = output;
+            last->heatmap = heatmap;
+            last->label = label;
+        }
+    } else if (aa_samples == 1) {
+        for (int b = 0; b < bands; b++) {
+            band_extent(p, b, &y0, &y1);
+            BandTask* task = pipeline_next(p, -1);
+            task->job.pass = PASS_BASE;
+            task->output = output;
+            task->preview = preview;
+            task->heatmap = heatmap;
+            task->label = label;
+            pipeline_submit(p, task, cam, y0, y1);
+            last = task;
+        }
+    } else {
+        // Refining a band reads the base rows next to it, so base bands go
+        // into a ring of slots and are queued two bands ahead: the threads
+        // render those while a refine band waits for its neighbors
+        long first = p->base_bands;
+        int queued = 0;
+        for (int b = 0; b < bands; b++) {
+            for (; queued < bands && queued <= b + 2; queued++) {
+                BandSlot* slot = &p->base[(first + queued) % BASE_SLOTS];
+                band_extent(p, queued, &y0, &y1);
+                BandTask* task = pipeline_next(p, slot->busy);
+                task->job.pass = PASS_BASE;
+                task->job.output = &slot->rows;
+                slot->written = slot->busy = pipeline_submit(p, task, cam, y0, y1);
+            }
+            
+            BandSlot* slots[3];
+            for (int k = 0; k < 3; k++) {
+                int neighbor = b + k - 1;
+                slots[k] = neighbor >= 0 && neighbor < bands ? &p->base[(first + neighbor) % BASE_SLOTS] : NULL;
+            }
+            last = queue_refine_band(p, cam, slots, b);
+            last->output = output;
+            last->heatmap = heatmap;
+            last->label = label;
+        }
+        p->base_bands += bands;
+    }
+    
+    // The last band is still queued: its completion closes the files
+    for (int i = 0; i < 3; i++) {
+        last->close[i] = files[i];
+    }
+    last->frame = frame;
+    last->frame_start = start;
+}
+
+// Output name for one frame: name itself for a single frame, otherwise the
+// frame number inserted before the extension (out.ppm -> out_0007.ppm)
+void frame_filename(char* buffer, size_t size, const char* name, int frame, int frames) {
+    if (frames == 1) {
+        snprintf(buffer, size, "%s", name);
+        return;
+    }
+    const char* dot = strrchr(name, '.');
+    const char* slash = strrchr(name, '/');
+    if (!dot || (slash && dot < slash)) {
+        dot = name + strlen(name);
+    }
+    snprintf(buffer, size, "%.*s_%04d%s", (int)(dot - name), name, frame, dot);
+}
+
+// Number of online CPUs, used as the default pool size
+int default_thread_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    int thread_count = default_thread_count();
+    int random_spheres = 0;
+    unsigned int seed = 1;
+    const char* simd = NULL;
+    const char* scene_file = NULL;
+    const char* save_scene_file = NULL;
+    const char* preview_file = NULL;
+    const char* output_file = "raytracer_output.ppm";
+    const char* heatmap_file = NULL;
+    int frames = 1;
+    int width = 0, height = 0;
+    
+    // Parse command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--random-spheres") == 0 && i + 1 < argc) {
+            random_spheres = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            simd = argv[++i];
+        } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scene_file = argv[++i];
+        } else if (strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc) {
+            save_scene_file = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            aa_samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--aa-threshold") == 0 && i + 1 < argc) {
+            aa_threshold = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) {
+            preview_file = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_file = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+            heatmap_file = argv[++i];
+        } else if (strcmp(argv[i], "--path-trace") == 0 && i + 1 < argc) {
+            path_samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--resolution") == 0 && i + 2 < argc) {
+            width = atoi(argv[++i]);
+            height = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--threads N] [--scene FILE] [--random-spheres N] [--seed S]\n"
+                   "          [--save-scene FILE] [--simd scalar|sse2|avx2]\n"
+                   "          [--samples N] [--aa-threshold T] [--preview FILE]\n"
+                   "          [--output FILE] [--resolution W H] [--heatmap FILE]\n"
+                   "          [--frames N] [--path-trace SAMPLES]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (thread_count < 1) thread_count = 1;
+    if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+    if (aa_samples < 1) aa_samples = 1;
+    if (aa_threshold < 0) aa_threshold = 0;
+    if (frames < 1) frames = 1;
+    if (path_samples < 0) path_samples = 0;
+    if (path_samples > 0) {
+        aa_samples = 1;     // Path samples are already spread over the pixel
+    }
+    
+    printf("Ray Tracer - Generating 3D scene...\n");
+    
+    // Initialize scene
+    default_camera(&camera);
+    if (scene_file) {
+        if (!load_scene(scene_file)) {
+            return 1;
+        }
+    } else if (random_spheres > 0) {
+        generate_sphere_field(random_spheres, seed);
+    } else {
+        init_scene();
+    }
+    if (width > 0 && height > 0) {
+        image_width = width;
+        image_height = height;
+    }
+    setup_camera(&camera);
+    
+    if (save_scene_file && !save_scene(save_scene_file)) {
+        return 1;
+    }
+    
+    // Build acceleration structure
+    if (!build_scene_bvh() || !build_sphere_soa() || !(child_bounds = build_child_bounds(&scene_bvh))) {
+        printf("Error: Failed to build BVH\n");
+        return 1;
+    }
+    if (path_samples > 0 && !build_light_distribution()) {
+        printf("Error: Failed to allocate memory for lights\n");
+        return 1;
+    }
+    long triangle_count = 0;
+    for (int m = 0; m < mesh_count; m++) {
+        triangle_count += meshes[m].triangle_count;
+    }
+    printf("Scene: %d spheres, %d meshes (%ld triangles), %d lights, %dx%d\n",
+           sphere_count, mesh_count, triangle_count, light_count, image_width, image_height);
+    printf("Intersection kernel: %s\n", select_simd_path(simd));
+    if (path_samples > 0) {
+        printf("Path tracing: %d sample%s per pixel\n", path_samples, path_samples == 1 ? "" : "s");
+    }
+    
+    if (frames > 1 && keyframe_count == 0) {
+        printf("Error: --frames needs a camera path (keyframe statements in the scene file)\n");
+        return 1;
+    }
+    
+    // The render threads are started once and serve every band of every
+    // frame, with the scene and BVH built once above. A frame's first bands
+    // are queued behind the last bands of the frame before it, and finished
+    // bands go to the writer thread, so tracing and writing both overlap
+    // from one frame to the next.
+    RenderPool pool;
+    if (!render_pool_start(&pool, thread_count)) {
+        printf("Error: Failed to start render threads\n");
+        return 1;
+    }
+    printf("Rendering %d frame%s with %d thread%s\n", frames, frames == 1 ? "" : "s",
+           pool.thread_count, pool.thread_count == 1 ? "" : "s");
+    OutputStage stage;
+    output_stage_start(&stage);
+    Pipeline pipeline;
+    int ok = pipeline_init(&pipeline, &pool, &stage, preview_file != NULL, heatmap_file != NULL, frames);
+    if (!ok) {
+        printf("Error: Failed to allocate memory for pixels\n");
+    }
+    RenderStats stats;
+    memset(&stats, 0, sizeof(stats));
+    double start = now_seconds();
+    
+    for (int frame = 0; frame < frames && ok; frame++) {
+        Camera frame_camera = camera;
+        if (frames > 1 && !camera_at_frame(frame, frames, &frame_camera)) {
+            printf("Error: Camera path is degenerate at frame %d\n", frame);
+            ok = 0;
+            break;
+        }
+        
+        // Open this frame's files; the writer thread closes and frees them
+        // once the pipeline has written the frame's last band
+        const char* names[3] = {output_file, preview_file, heatmap_file};
+        ImageWriter* writers[3] = {NULL, NULL, NULL};
+        for (int i = 0; i < 3 && ok; i++) {
+            if (!names[i]) continue;
+            char numbered[512];
+            frame_filename(numbered, sizeof(numbered), names[i], frame, frames);
+            writers[i] = malloc(sizeof(ImageWriter));
+            if (!writers[i] || !image_writer_open(writers[i], numbered)) {
+                free(writers[i]);
+                writers[i] = NULL;
+                ok = 0;
+            }
+        }
+        
+        if (ok) {
+            render_frame(&pipeline, &frame_camera, writers[0], writers[1], writers[2], frame);
+        } else {
+            for (int i = 0; i < 3; i++) {
+                if (writers[i]) output_stage_close(&stage, writers[i]);
+            }
+        }
+    }
+    
+    pipeline_wait(&pipeline, pipeline.submitted - 1);
+    pipeline_free(&pipeline);
+    long refined = render_pool_stop(&pool, &stats);
+    int saved = output_stage_finish(&stage);
+    double render_seconds = now_seconds() - start;
+    if (!ok || !saved) {
+        return 1;
+    }
+    if (aa_samples > 1) {
+        long total = (long)image_width * image_height * frames;
+        printf("Supersampled %ld of %ld pixels (%.1f%%)\n", refined, total, 100.0 * refined / total);
+    }
+    print_render_stats(&stats, render_seconds);
+    
+    // Cleanup
+    free_sphere_soa();
+    bvh_free(&scene_bvh);
+    free_meshes();
+    free(spheres);
+    free(lights);
+    free(light_cdf);
+    free(keyframes);
+    
+    if (frames == 1) {
+        printf("Ray tracing complete! Image saved as %s\n", output_file);
+    } else {
+        printf("Ray tracing complete! %d frames saved\n", frames);
+    }
+    
+    return 0;
+}
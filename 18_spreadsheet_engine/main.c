@@ -9,18 +9,63 @@
 #define MAX_CELL_LEN 256
 #define MAX_FORMULA_LEN 256
 #define MAX_TOKENS 64
+#define NUM_CELLS (MAX_ROWS * MAX_COLS)
+#define MAX_CODE_LEN MAX_FORMULA_LEN  // Every instruction comes from at least one character
+
+// Bytecode operations of a compiled formula
+typedef enum {
+    OP_NUMBER,  // Push a constant
+    OP_CELL,    // Push a cell's value
+    OP_ADD,     // Replace the top two values with their sum
+    OP_SUB,
+    OP_MUL,
+    OP_DIV
+} OpCode;
+
+// One bytecode instruction. Cell references are resolved to cell indices
+// (row * MAX_COLS + col) when the formula is compiled.
+typedef struct {
+    OpCode op;
+    int cell;       // For OP_CELL
+    double number;  // For OP_NUMBER
+} Instruction;
+
+// Whether a cell's numeric value can be used. A formula reading a cell in
+// error takes on that cell's status instead of computing with it.
+typedef enum {
+    CELL_OK,
+    CELL_ERROR,  // Malformed formula or division by zero
+    CELL_CYCLE   // On a reference cycle, or reading a cell that is
+} CellStatus;
 
 // Cell structure
 typedef struct {
-    char value[MAX_CELL_LEN];      // Display value
+    char value[MAX_CELL_LEN];      // Display value, empty for a formula's numeric result
     char formula[MAX_FORMULA_LEN]; // Original formula
     double numeric_value;          // Computed numeric value
     int is_formula;                // Flag indicating if cell contains formula
+    CellStatus status;             // CELL_OK unless the value shows ERROR or CYCLE
+    Instruction* code;             // Compiled formula, NULL if it doesn't compile
+    int code_length;
+    int* precedents;               // Cells this cell's formula references
+    int precedent_count;
+    int* dependents;               // Cells whose formulas reference this cell
+    int dependent_count;
+    int dependent_capacity;
 } Cell;
 
 // Spreadsheet grid
 Cell spreadsheet[MAX_ROWS][MAX_COLS];
 
+// Work arrays for recalculation, indexed by cell index (row * MAX_COLS + col).
+// A cell belongs to the current recalculation when its visit_mark equals
+// recalc_epoch, so nothing has to be cleared between edits.
+unsigned int visit_mark[NUM_CELLS];
+unsigned int recalc_epoch = 0;
+int pending_inputs[NUM_CELLS];
+int recalc_cells[NUM_CELLS];   // Affected cells, in the order they were found
+int recalc_queue[NUM_CELLS];   // Affected cells, in the order they are evaluated
+
 // Token types for formula parsing
 typedef enum {
     TOKEN_NUMBER,
@@ -29,27 +74,43 @@ typedef enum {
     TOKEN_FUNCTION,
     TOKEN_LPAREN,
     TOKEN_RPAREN,
+    TOKEN_INVALID,
     TOKEN_EOF
 } TokenType;
 
 // Token structure
 typedef struct {
     TokenType type;
-    char value[MAX_CELL_LEN];
+    char op;        // Operator or parenthesis character
+    int cell;       // Cell index of a reference, -1 if out of range
     double number;
 } Token;
 
+// Formula compiler state: the remaining text, one token of lookahead and
+// the code emitted so far
+typedef struct {
+    const char* ptr;
+    Token token;
+    Instruction code[MAX_CODE_LEN];
+    int length;
+    int error;
+} Compiler;
+
 // Function prototypes
 void init_spreadsheet();
 void display_spreadsheet();
-void set_cell(int row, int col, const char* value);
-double evaluate_formula(const char* formula, int* error);
+int set_cell(int row, int col, const char* value);
 Token get_next_token(const char** formula_ptr);
-double parse_expression(const char** formula_ptr, int* error);
-double parse_term(const char** formula_ptr, int* error);
-double parse_factor(const char** formula_ptr, int* error);
-double get_cell_value(int row, int col, int* error);
+int compile_formula(const char* formula, Compiler* compiler);
+void compile_expression(Compiler* compiler);
+void compile_term(Compiler* compiler);
+void compile_factor(Compiler* compiler);
+double run_formula(const Instruction* code, int length, int* error);
 int parse_cell_reference(const char* ref, int* row, int* col);
+void compile_cell(int row, int col);
+void evaluate_cell(int row, int col);
+void update_dependencies(int row, int col);
+int recalculate_from(int row, int col);
 void print_menu();
 
 // Initialize spreadsheet
@@ -60,6 +121,14 @@ void init_spreadsheet() {
             spreadsheet[i][j].formula[0] = '\0';
             spreadsheet[i][j].numeric_value = 0.0;
             spreadsheet[i][j].is_formula = 0;
+            spreadsheet[i][j].status = CELL_OK;
+            spreadsheet[i][j].code = NULL;
+            spreadsheet[i][j].code_length = 0;
+            spreadsheet[i][j].precedents = NULL;
+            spreadsheet[i][j].precedent_count = 0;
+            spreadsheet[i][j].dependents = NULL;
+            spreadsheet[i][j].dependent_count = 0;
+            spreadsheet[i][j].dependent_capacity = 0;
         }
     }
 }
@@ -75,8 +144,16 @@ void display_spreadsheet() {
     for (int i = 0; i < 10; i++) {
         printf("%2d ", i+1);
         for (int j = 0; j < 10; j++) {
-            if (strlen(spreadsheet[i][j].value) > 0) {
-                printf("|%7.7s", spreadsheet[i][j].value);
+            Cell* cell = &spreadsheet[i][j];
+            if (cell->is_formula && cell->value[0] == '\0') {
+                // Formula results are formatted here rather than on every
+                // recalculation, where formatting would cost more than the
+                // arithmetic
+                char number[32];
+                snprintf(number, sizeof(number), "%.2f", cell->numeric_value);
+                printf("|%7.7s", number);
+            } else if (strlen(cell->value) > 0) {
+                printf("|%7.7s", cell->value);
             } else {
                 printf("|       ");
             }
@@ -86,43 +163,215 @@ void display_spreadsheet() {
     printf("\n");
 }
 
-// Set cell value
-void set_cell(int row, int col, const char* value) {
+// Set cell value, then recalculate every cell that depends on it.
+// Returns the number of dependent cells recalculated.
+int set_cell(int row, int col, const char* value) {
     if (row < 0 || row >= MAX_ROWS || col < 0 || col >= MAX_COLS) {
         printf("Error: Invalid cell reference\n");
-        return;
+        return 0;
     }
     
     strncpy(spreadsheet[row][col].formula, value, MAX_FORMULA_LEN - 1);
     spreadsheet[row][col].formula[MAX_FORMULA_LEN - 1] = '\0';
     
     // Check if it's a formula (starts with =)
-    if (value[0] == '=') {
-        spreadsheet[row][col].is_formula = 1;
-        int error = 0;
-        double result = evaluate_formula(value + 1, &error); // Skip '='
+    spreadsheet[row][col].is_formula = value[0] == '=';
+    compile_cell(row, col);
+    update_dependencies(row, col);
+    return recalculate_from(row, col) - 1;
+}
+
+// Compile a cell's formula once, when it is set. A formula that doesn't
+// compile gets no code and shows ERROR until it is replaced.
+void compile_cell(int row, int col) {
+    Cell* cell = &spreadsheet[row][col];
+    Compiler compiler;
+    
+    free(cell->code);
+    cell->code = NULL;
+    cell->code_length = 0;
+    if (!cell->is_formula || !compile_formula(cell->formula + 1, &compiler)) { // Skip '='
+        return;
+    }
+    
+    cell->code = malloc(compiler.length * sizeof(Instruction));
+    if (!cell->code) {
+        printf("Error: Out of memory\n");
+        exit(1);
+    }
+    memcpy(cell->code, compiler.code, compiler.length * sizeof(Instruction));
+    cell->code_length = compiler.length;
+}
+
+// Compute a cell's value from its compiled formula or its text
+void evaluate_cell(int row, int col) {
+    Cell* cell = &spreadsheet[row][col];
+    
+    if (cell->is_formula) {
+        int error = CELL_ERROR;
+        double result = 0.0;
+        if (cell->code) {
+            result = run_formula(cell->code, cell->code_length, &error);
+        }
         
+        cell->status = (CellStatus)error;
         if (error) {
-            strcpy(spreadsheet[row][col].value, "ERROR");
-            spreadsheet[row][col].numeric_value = 0.0;
+            strcpy(cell->value, error == CELL_CYCLE ? "CYCLE" : "ERROR");
+            cell->numeric_value = 0.0;
         } else {
-            spreadsheet[row][col].numeric_value = result;
-            snprintf(spreadsheet[row][col].value, MAX_CELL_LEN, "%.2f", result);
+            cell->numeric_value = result;
+            cell->value[0] = '\0'; // Formatted when displayed
         }
     } else {
-        spreadsheet[row][col].is_formula = 0;
-        strncpy(spreadsheet[row][col].value, value, MAX_CELL_LEN - 1);
-        spreadsheet[row][col].value[MAX_CELL_LEN - 1] = '\0';
+        cell->status = CELL_OK;
+        strncpy(cell->value, cell->formula, MAX_CELL_LEN - 1);
+        cell->value[MAX_CELL_LEN - 1] = '\0';
         
         // Try to convert to number
         char* endptr;
-        double num = strtod(value, &endptr);
+        double num = strtod(cell->formula, &endptr);
         if (*endptr == '\0') { // Entire string is a number
-            spreadsheet[row][col].numeric_value = num;
+            cell->numeric_value = num;
         } else {
-            spreadsheet[row][col].numeric_value = 0.0;
+            cell->numeric_value = 0.0;
+        }
+    }
+}
+
+// Remove one dependent from a cell's list (order doesn't matter)
+void remove_dependent(Cell* cell, int dependent) {
+    for (int i = 0; i < cell->dependent_count; i++) {
+        if (cell->dependents[i] == dependent) {
+            cell->dependents[i] = cell->dependents[--cell->dependent_count];
+            return;
+        }
+    }
+}
+
+// Add a dependent to a cell's list, growing it as needed
+void add_dependent(Cell* cell, int dependent) {
+    if (cell->dependent_count == cell->dependent_capacity) {
+        int capacity = cell->dependent_capacity ? cell->dependent_capacity * 2 : 4;
+        int* grown = realloc(cell->dependents, capacity * sizeof(int));
+        if (!grown) {
+            printf("Error: Out of memory\n");
+            exit(1);
         }
+        cell->dependents = grown;
+        cell->dependent_capacity = capacity;
     }
+    cell->dependents[cell->dependent_count++] = dependent;
+}
+
+// Rebuild the dependency edges of a cell from the references in its
+// compiled formula: the cell leaves the dependent lists of its old
+// precedents and joins those of the cells its new formula references
+// (each once)
+void update_dependencies(int row, int col) {
+    Cell* cell = &spreadsheet[row][col];
+    int index = row * MAX_COLS + col;
+    
+    for (int i = 0; i < cell->precedent_count; i++) {
+        int p = cell->precedents[i];
+        remove_dependent(&spreadsheet[p / MAX_COLS][p % MAX_COLS], index);
+    }
+    free(cell->precedents);
+    cell->precedents = NULL;
+    cell->precedent_count = 0;
+    
+    int refs[MAX_CODE_LEN];  // At most one reference per instruction
+    int count = 0;
+    for (int i = 0; i < cell->code_length; i++) {
+        if (cell->code[i].op == OP_CELL) {
+            int seen = 0;
+            for (int j = 0; j < count; j++) {
+                if (refs[j] == cell->code[i].cell) seen = 1;
+            }
+            if (!seen) refs[count++] = cell->code[i].cell;
+        }
+    }
+    
+    if (count > 0) {
+        cell->precedents = malloc(count * sizeof(int));
+        if (!cell->precedents) {
+            printf("Error: Out of memory\n");
+            exit(1);
+        }
+        memcpy(cell->precedents, refs, count * sizeof(int));
+        cell->precedent_count = count;
+    }
+    for (int i = 0; i < count; i++) {
+        add_dependent(&spreadsheet[refs[i] / MAX_COLS][refs[i] % MAX_COLS], index);
+    }
+}
+
+// Recalculate a cell and everything that depends on it, directly or
+// indirectly, each exactly once and only after all of its inputs (a
+// topological order). The work is proportional to the number of dependents
+// and their references, not to the size of the sheet. Cells on a reference
+// cycle, and cells depending on one, can never be ordered; they show
+// "CYCLE". Returns the number of cells recalculated, including this one.
+int recalculate_from(int row, int col) {
+    int start = row * MAX_COLS + col;
+    int count = 0;
+    
+    // Find the affected cells by following the dependent lists
+    if (++recalc_epoch == 0) {
+        memset(visit_mark, 0, sizeof(visit_mark));
+        recalc_epoch = 1;
+    }
+    visit_mark[start] = recalc_epoch;
+    pending_inputs[start] = 0;
+    recalc_cells[count++] = start;
+    for (int i = 0; i < count; i++) {
+        Cell* cell = &spreadsheet[recalc_cells[i] / MAX_COLS][recalc_cells[i] % MAX_COLS];
+        for (int j = 0; j < cell->dependent_count; j++) {
+            int dependent = cell->dependents[j];
+            if (visit_mark[dependent] != recalc_epoch) {
+                visit_mark[dependent] = recalc_epoch;
+                pending_inputs[dependent] = 0;
+                recalc_cells[count++] = dependent;
+            }
+        }
+    }
+    
+    // Count each affected cell's inputs that are themselves affected
+    for (int i = 0; i < count; i++) {
+        Cell* cell = &spreadsheet[recalc_cells[i] / MAX_COLS][recalc_cells[i] % MAX_COLS];
+        for (int j = 0; j < cell->dependent_count; j++) {
+            pending_inputs[cell->dependents[j]]++;
+        }
+    }
+    
+    // Kahn's algorithm: evaluate a cell once all its affected inputs are
+    // done. Cells still waiting at the end are on or behind a cycle.
+    int head = 0;
+    int tail = 0;
+    for (int i = 0; i < count; i++) {
+        if (pending_inputs[recalc_cells[i]] == 0) {
+            recalc_queue[tail++] = recalc_cells[i];
+        }
+    }
+    while (head < tail) {
+        int index = recalc_queue[head++];
+        evaluate_cell(index / MAX_COLS, index % MAX_COLS);
+        Cell* cell = &spreadsheet[index / MAX_COLS][index % MAX_COLS];
+        for (int j = 0; j < cell->dependent_count; j++) {
+            if (--pending_inputs[cell->dependents[j]] == 0) {
+                recalc_queue[tail++] = cell->dependents[j];
+            }
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (pending_inputs[recalc_cells[i]] > 0) {
+            Cell* cell = &spreadsheet[recalc_cells[i] / MAX_COLS][recalc_cells[i] % MAX_COLS];
+            strcpy(cell->value, "CYCLE");
+            cell->status = CELL_CYCLE;
+            cell->numeric_value = 0.0;
+        }
+    }
+    return count;
 }
 
 // Parse cell reference (e.g., "A1", "B10")
@@ -142,22 +391,13 @@ int parse_cell_reference(const char* ref, int* row, int* col) {
     return 1;
 }
 
-// Get cell value
-double get_cell_value(int row, int col, int* error) {
-    if (row < 0 || row >= MAX_ROWS || col < 0 || col >= MAX_COLS) {
-        *error = 1;
-        return 0.0;
-    }
-    
-    *error = 0;
-    return spreadsheet[row][col].numeric_value;
-}
-
-// Get next token from formula
+// Get next token from formula. Cell references are resolved to cell
+// indices here, so the compiled code never looks at text again.
 Token get_next_token(const char** formula_ptr) {
     Token token;
     token.type = TOKEN_EOF;
-    token.value[0] = '\0';
+    token.op = '\0';
+    token.cell = -1;
     token.number = 0.0;
     
     // Skip whitespace
@@ -175,167 +415,209 @@ Token get_next_token(const char** formula_ptr) {
         char* endptr;
         token.number = strtod(*formula_ptr, &endptr);
         token.type = TOKEN_NUMBER;
-        strncpy(token.value, *formula_ptr, endptr - *formula_ptr);
-        token.value[endptr - *formula_ptr] = '\0';
+        if (endptr == *formula_ptr) {
+            // A lone '.' is no number; always consume the character, so
+            // every token moves the formula pointer forward
+            token.type = TOKEN_INVALID;
+            endptr++;
+        }
         *formula_ptr = endptr;
         return token;
     }
     
     // Cell reference (e.g., A1, B10)
     if (**formula_ptr >= 'A' && **formula_ptr <= 'Z') {
-        const char* start = *formula_ptr;
+        int col = **formula_ptr - 'A';
+        long row = 0;
+        int digits = 0;
         (*formula_ptr)++; // Skip column letter
         
-        // Skip digits
+        // Read the row number
         while (isdigit(**formula_ptr)) {
+            if (row <= MAX_ROWS) row = row * 10 + (**formula_ptr - '0');
+            digits++;
             (*formula_ptr)++;
         }
         
         token.type = TOKEN_CELL_REF;
-        strncpy(token.value, start, *formula_ptr - start);
-        token.value[*formula_ptr - start] = '\0';
+        if (digits > 0 && row >= 1 && row <= MAX_ROWS) {
+            token.cell = (int)(row - 1) * MAX_COLS + col;
+        }
         return token;
     }
     
-    // Operators
+    // Operators and parentheses
     switch (**formula_ptr) {
         case '+':
-            token.type = TOKEN_OPERATOR;
-            token.value[0] = '+';
-            token.value[1] = '\0';
-            (*formula_ptr)++;
-            return token;
         case '-':
-            token.type = TOKEN_OPERATOR;
-            token.value[0] = '-';
-            token.value[1] = '\0';
-            (*formula_ptr)++;
-            return token;
         case '*':
-            token.type = TOKEN_OPERATOR;
-            token.value[0] = '*';
-            token.value[1] = '\0';
-            (*formula_ptr)++;
-            return token;
         case '/':
             token.type = TOKEN_OPERATOR;
-            token.value[0] = '/';
-            token.value[1] = '\0';
-            (*formula_ptr)++;
-            return token;
+            break;
         case '(':
             token.type = TOKEN_LPAREN;
-            token.value[0] = '(';
-            token.value[1] = '\0';
-            (*formula_ptr)++;
-            return token;
+            break;
         case ')':
             token.type = TOKEN_RPAREN;
-            token.value[0] = ')';
-            token.value[1] = '\0';
-            (*formula_ptr)++;
-            return token;
+            break;
+        default:
+            token.type = TOKEN_INVALID;
+            break;
     }
-    
-    // Unknown token
+    token.op = **formula_ptr;
     (*formula_ptr)++;
     return token;
 }
 
-// Parse factor (numbers, cell references, parentheses)
-double parse_factor(const char** formula_ptr, int* error) {
-    Token token = get_next_token(formula_ptr);
+// Append an instruction to the code being compiled
+void emit(Compiler* compiler, OpCode op, int cell, double number) {
+    if (compiler->length == MAX_CODE_LEN) {
+        compiler->error = 1;
+        return;
+    }
+    Instruction* instruction = &compiler->code[compiler->length++];
+    instruction->op = op;
+    instruction->cell = cell;
+    instruction->number = number;
+}
+
+// Move to the next token
+void advance(Compiler* compiler) {
+    compiler->token = get_next_token(&compiler->ptr);
+}
+
+// Compile factor (numbers, cell references, parentheses)
+void compile_factor(Compiler* compiler) {
+    Token token = compiler->token;
     
     switch (token.type) {
         case TOKEN_NUMBER:
-            return token.number;
-            
-        case TOKEN_CELL_REF: {
-            int row, col;
-            if (!parse_cell_reference(token.value, &row, &col)) {
-                *error = 1;
-                return 0.0;
+            emit(compiler, OP_NUMBER, 0, token.number);
+            advance(compiler);
+            return;
+        
+        case TOKEN_CELL_REF:
+            if (token.cell < 0) {
+                compiler->error = 1;
+                return;
             }
-            return get_cell_value(row, col, error);
-        }
-            
-        case TOKEN_LPAREN: {
-            double result = parse_expression(formula_ptr, error);
-            if (*error) return 0.0;
+            emit(compiler, OP_CELL, token.cell, 0.0);
+            advance(compiler);
+            return;
+        
+        case TOKEN_LPAREN:
+            advance(compiler);
+            compile_expression(compiler);
+            if (compiler->error) return;
             
             // Expect closing parenthesis
-            Token next = get_next_token(formula_ptr);
-            if (next.type != TOKEN_RPAREN) {
-                *error = 1;
-                return 0.0;
+            if (compiler->token.type != TOKEN_RPAREN) {
+                compiler->error = 1;
+                return;
             }
-            return result;
-        }
-            
+            advance(compiler);
+            return;
+        
         default:
-            *error = 1;
-            return 0.0;
+            compiler->error = 1;
+            return;
     }
 }
 
-// Parse term (factors with * or /)
-double parse_term(const char** formula_ptr, int* error) {
-    double result = parse_factor(formula_ptr, error);
-    if (*error) return 0.0;
+// Compile term (factors with * or /). Operands are emitted before their
+// operator (postfix order), which is the order the stack VM needs.
+void compile_term(Compiler* compiler) {
+    compile_factor(compiler);
+    if (compiler->error) return;
     
-    Token token = get_next_token(formula_ptr);
-    while (token.type == TOKEN_OPERATOR && (token.value[0] == '*' || token.value[0] == '/')) {
-        double next = parse_factor(formula_ptr, error);
-        if (*error) return 0.0;
-        
-        if (token.value[0] == '*') {
-            result *= next;
-        } else {
-            if (next == 0.0) {
-                *error = 1; // Division by zero
-                return 0.0;
-            }
-            result /= next;
-        }
-        
-        token = get_next_token(formula_ptr);
+    while (compiler->token.type == TOKEN_OPERATOR &&
+           (compiler->token.op == '*' || compiler->token.op == '/')) {
+        OpCode op = compiler->token.op == '*' ? OP_MUL : OP_DIV;
+        advance(compiler);
+        compile_factor(compiler);
+        if (compiler->error) return;
+        emit(compiler, op, 0, 0.0);
     }
+}
+
+// Compile expression (terms with + or -)
+void compile_expression(Compiler* compiler) {
+    compile_term(compiler);
+    if (compiler->error) return;
     
-    // Put back the last token
-    // Note: In a real implementation, we'd need a more sophisticated tokenizer
-    // For simplicity, we'll just continue with the current approach
-    
-    return result;
+    while (compiler->token.type == TOKEN_OPERATOR &&
+           (compiler->token.op == '+' || compiler->token.op == '-')) {
+        OpCode op = compiler->token.op == '+' ? OP_ADD : OP_SUB;
+        advance(compiler);
+        compile_term(compiler);
+        if (compiler->error) return;
+        emit(compiler, op, 0, 0.0);
+    }
+}
+
+// Compile a formula (without its '=') into the compiler's code buffer.
+// Returns 0 if the formula is malformed, including anything left over
+// after the expression (e.g. "A1 B1" or an unmatched ')').
+int compile_formula(const char* formula, Compiler* compiler) {
+    compiler->ptr = formula;
+    compiler->length = 0;
+    compiler->error = 0;
+    advance(compiler);
+    compile_expression(compiler);
+    if (compiler->token.type != TOKEN_EOF) {
+        compiler->error = 1;
+    }
+    return !compiler->error;
 }
 
-// Parse expression (terms with + or -)
-double parse_expression(const char** formula_ptr, int* error) {
-    double result = parse_term(formula_ptr, error);
-    if (*error) return 0.0;
+// Run compiled formula code on a small value stack. The compiler only
+// emits well-formed code, so the stack needs no checks; it can't hold more
+// values than there are instructions. Sets *error to a CellStatus: the
+// status of the first input that is in error, CELL_ERROR for a division
+// by zero, or CELL_OK.
+double run_formula(const Instruction* code, int length, int* error) {
+    double stack[MAX_CODE_LEN];
+    int top = 0;
     
-    Token token = get_next_token(formula_ptr);
-    while (token.type == TOKEN_OPERATOR && (token.value[0] == '+' || token.value[0] == '-')) {
-        double next = parse_term(formula_ptr, error);
-        if (*error) return 0.0;
-        
-        if (token.value[0] == '+') {
-            result += next;
-        } else {
-            result -= next;
+    for (int i = 0; i < length; i++) {
+        switch (code[i].op) {
+            case OP_NUMBER:
+                stack[top++] = code[i].number;
+                break;
+            case OP_CELL: {
+                const Cell* input = &spreadsheet[code[i].cell / MAX_COLS][code[i].cell % MAX_COLS];
+                if (input->status != CELL_OK) {
+                    *error = input->status;
+                    return 0.0;
+                }
+                stack[top++] = input->numeric_value;
+                break;
+            }
+            case OP_ADD:
+                top--;
+                stack[top - 1] += stack[top];
+                break;
+            case OP_SUB:
+                top--;
+                stack[top - 1] -= stack[top];
+                break;
+            case OP_MUL:
+                top--;
+                stack[top - 1] *= stack[top];
+                break;
+            case OP_DIV:
+                top--;
+                if (stack[top] == 0.0) {
+                    *error = CELL_ERROR; // Division by zero
+                    return 0.0;
+                }
+                stack[top - 1] /= stack[top];
+                break;
         }
-        
-        token = get_next_token(formula_ptr);
     }
     
-    return result;
-}
-
-// Evaluate formula
-double evaluate_formula(const char* formula, int* error) {
-    *error = 0;
-    const char* ptr = formula;
-    double result = parse_expression(&ptr, error);
-    return result;
+    *error = CELL_OK;
+    return stack[0];
 }
 
 // Print menu
@@ -387,8 +669,8 @@ int main() {
                 
                 printf("Enter value or formula: ");
                 scanf("%s", input);
-                set_cell(row, col, input);
-                printf("Cell %s set to %s\n", cell_ref, input);
+                int recalculated = set_cell(row, col, input);
+                printf("Cell %s set to %s (%d dependent cells recalculated)\n", cell_ref, input, recalculated);
                 break;
                 
             case 3: